@@ -0,0 +1,171 @@
+// Checks compute dispatch on the GL core backend against whatever GL 4.3
+// driver is installed, Mesa's llvmpipe included: a surfaceless EGL context
+// stands in for Unity's, so no window or GPU is needed. Two dispatches:
+//   storage only   a shader with one storage block and no plain uniforms
+//   image          a shader writing an rgba8 image, so the unit has to be
+//                  bound with the texture's own format
+//
+// Build and run with `make check` from projects/GNUMake; the exit status is
+// nonzero if any case fails, and 2 if there's no GL 4.3 context to test on.
+
+#include "../source/GLEW/glew.h"
+#include "../source/Unity/IUnityGraphics.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+using std::vector;
+
+extern "C" {
+void UnityPluginLoad(IUnityInterfaces* unityInterfaces);
+void UnityPluginUnload();
+int CreateLiveMaterialId();
+void* GetLiveMaterialPtr(int id);
+void SetComputeSource(void* liveMaterial, const char* source, const char* entryPoint);
+void SetComputeBuffer(void* liveMaterial, const char* name, void* nativeBufferPtr);
+void SetComputeImage(void* liveMaterial, const char* name, void* nativeTexturePtr);
+void SubmitDispatch(void* liveMaterial, int uniformsIndex, int groupsX, int groupsY, int groupsZ);
+UnityRenderingEvent GetComputeEventFunc();
+}
+
+// Just enough of IUnityInterfaces for UnityPluginLoad to bring up the GL core backend.
+static IUnityGraphicsDeviceEventCallback deviceEventCallback;
+static UnityGfxRenderer UNITY_INTERFACE_API getRenderer() { return kUnityGfxRendererOpenGLCore; }
+static void UNITY_INTERFACE_API registerCallback(IUnityGraphicsDeviceEventCallback callback) { deviceEventCallback = callback; }
+static void UNITY_INTERFACE_API unregisterCallback(IUnityGraphicsDeviceEventCallback) {}
+static IUnityGraphics graphics;
+static IUnityInterface* UNITY_INTERFACE_API getInterface(UnityInterfaceGUID) { return (IUnityInterface*)&graphics; }
+
+static bool makeContext() {
+	auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (!getPlatformDisplay)
+		return false;
+	EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	EGLint major, minor;
+	if (!display || !eglInitialize(display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API))
+		return false;
+	const EGLint attributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, nullptr, EGL_NO_CONTEXT, attributes);
+	return context && eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+static const char* kStorageOnlySource =
+	"#version 430\n"
+	"layout(local_size_x = 64) in;\n"
+	"layout(std430) buffer Values { uint values[]; };\n"
+	"void main() { values[gl_GlobalInvocationID.x] = gl_GlobalInvocationID.x * 3u + 1u; }\n";
+
+static const char* kImageSource =
+	"#version 430\n"
+	"layout(local_size_x = 8, local_size_y = 8) in;\n"
+	"layout(rgba8) uniform writeonly image2D result;\n"
+	"void main() { imageStore(result, ivec2(gl_GlobalInvocationID.xy), vec4(1.0, 0.5, 0.0, 1.0)); }\n";
+
+static const int kSide = 16;
+
+// Compiles and reflects on the first dispatch, so dispatches until the
+// results show up or it's clearly not going to happen.
+template <typename Done>
+static bool dispatchUntil(int id, int groupsX, int groupsY, Done done) {
+	void* material = GetLiveMaterialPtr(id);
+	for (int attempt = 0; attempt < 50; ++attempt) {
+		SubmitDispatch(material, 0, groupsX, groupsY, 1);
+		GetComputeEventFunc()(id << 16);
+		glFinish();
+		if (done())
+			return true;
+		usleep(10000);
+	}
+	return false;
+}
+
+static int failures = 0;
+
+static void expect(bool ok, const char* name, const char* what) {
+	printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+	if (!ok) {
+		printf("     %s\n", what);
+		++failures;
+	}
+}
+
+static void checkStorageOnly() {
+	const int count = 64;
+	GLuint buffer = 0;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, count * sizeof(GLuint), vector<GLuint>(count, 0).data(), GL_DYNAMIC_READ);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	const int id = CreateLiveMaterialId();
+	void* material = GetLiveMaterialPtr(id);
+	SetComputeSource(material, kStorageOnlySource, "main");
+	SetComputeBuffer(material, "Values", (void*)(size_t)buffer);
+	vector<GLuint> values(count);
+	const bool done = dispatchUntil(id, 1, 1, [&]() {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(GLuint), values.data());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		for (int i = 0; i < count; ++i)
+			if (values[i] != (GLuint)i * 3 + 1)
+				return false;
+		return true;
+	});
+	expect(done, "storage only", "the storage block was never written; was it bound?");
+}
+
+static void checkImage() {
+	GLuint texture = 0;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, kSide, kSide);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	const int id = CreateLiveMaterialId();
+	void* material = GetLiveMaterialPtr(id);
+	SetComputeSource(material, kImageSource, "main");
+	SetComputeImage(material, "result", (void*)(size_t)texture);
+	vector<unsigned char> pixels(kSide * kSide * 4);
+	const bool done = dispatchUntil(id, kSide / 8, kSide / 8, [&]() {
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+		glBindTexture(GL_TEXTURE_2D, 0);
+		for (int i = 0; i < kSide * kSide; ++i)
+			if (pixels[i * 4] != 255 || pixels[i * 4 + 1] < 127 || pixels[i * 4 + 1] > 128 || pixels[i * 4 + 2] != 0 || pixels[i * 4 + 3] != 255)
+				return false;
+		return true;
+	});
+	expect(done, "image", "the image was never written with the expected color; was it bound with its format?");
+}
+
+int main() {
+	if (!makeContext()) {
+		printf("no GL 4.3 core context through surfaceless EGL; nothing checked\n");
+		return 2;
+	}
+
+	graphics.GetRenderer = getRenderer;
+	graphics.RegisterDeviceEventCallback = registerCallback;
+	graphics.UnregisterDeviceEventCallback = unregisterCallback;
+	static IUnityInterfaces interfaces;
+	interfaces.GetInterface = getInterface;
+	UnityPluginLoad(&interfaces);
+
+	checkStorageOnly();
+	checkImage();
+
+	UnityPluginUnload();
+	if (failures)
+		printf("%d failures\n", failures);
+	else
+		printf("all passed\n");
+	// The plugin's threads are left for process exit to end.
+	fflush(stdout);
+	_exit(failures ? 1 : 0);
+}
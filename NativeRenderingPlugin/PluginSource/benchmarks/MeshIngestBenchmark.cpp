@@ -0,0 +1,127 @@
+// Mesh ingestion throughput: the original three-array SetMesh loop against
+// packVertices on interleaved input, with and without quantization.
+//
+// Build and run with `make benchmarks && ./mesh_ingest_benchmark [vertexCount]`
+// from projects/GNUMake.
+
+#include "../source/MeshFormat.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using std::vector;
+
+struct MeshVertex {
+	float pos[3];
+	float normal[3];
+	float uv[2];
+};
+
+// The loop SetMesh used before interleaved ingestion, kept as the baseline.
+static void legacySetMesh(int vertexCount, const float* vertices, const float* normals, const float* uvs, vector<MeshVertex>& mesh) {
+	mesh.resize(vertexCount);
+	for (int i = 0; i < vertexCount; ++i) {
+		MeshVertex& v = mesh[i];
+		v.pos[0] = vertices[0];
+		v.pos[1] = vertices[1];
+		v.pos[2] = vertices[2];
+		v.normal[0] = normals[0];
+		v.normal[1] = normals[1];
+		v.normal[2] = normals[2];
+		v.uv[0] = uvs[0];
+		v.uv[1] = uvs[1];
+		vertices += 3;
+		normals += 3;
+		uvs += 2;
+	}
+}
+
+static volatile unsigned char sink;
+
+template <typename Fn>
+static double bestSeconds(int repeats, Fn fn) {
+	double best = 1e30;
+	for (int i = 0; i < repeats; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		if (elapsed.count() < best)
+			best = elapsed.count();
+	}
+	return best;
+}
+
+static void report(const char* name, int vertexCount, size_t outputStride, double seconds) {
+	printf("%-32s %8.1f Mverts/s  %7.1f MB/s out  (%2zu bytes/vertex)\n",
+		name, vertexCount / seconds / 1e6, vertexCount * outputStride / seconds / 1e6, outputStride);
+}
+
+int main(int argc, char** argv) {
+	const int vertexCount = argc > 1 ? atoi(argv[1]) : 1 << 20;
+	const int repeats = 20;
+
+	vector<float> positions(vertexCount * 3), normals(vertexCount * 3), uvs(vertexCount * 2);
+	vector<MeshVertex> interleaved(vertexCount);
+	srand(1);
+	for (int i = 0; i < vertexCount; ++i) {
+		for (int j = 0; j < 3; ++j) {
+			positions[i * 3 + j] = interleaved[i].pos[j] = (rand() / (float)RAND_MAX) * 200.0f - 100.0f;
+			normals[i * 3 + j] = interleaved[i].normal[j] = (rand() / (float)RAND_MAX) * 2.0f - 1.0f;
+		}
+		for (int j = 0; j < 2; ++j)
+			uvs[i * 2 + j] = interleaved[i].uv[j] = rand() / (float)RAND_MAX;
+	}
+
+	VertexFormat format;
+	format.stride = sizeof(MeshVertex);
+	format.positionOffset = 0;
+	format.normalOffset = 12;
+	format.uvOffset = 24;
+	format.quantization = MeshQuantizeNone;
+
+	printf("%d vertices, best of %d\n", vertexCount, repeats);
+
+	vector<MeshVertex> legacy;
+	report("legacy SetMesh loop", vertexCount, sizeof(MeshVertex), bestSeconds(repeats, [&] {
+		legacySetMesh(vertexCount, positions.data(), normals.data(), uvs.data(), legacy);
+		sink = ((unsigned char*)legacy.data())[vertexCount / 2];
+	}));
+
+	struct Case { const char* name; uint32_t quantization; bool simd; };
+	const Case cases[] = {
+		{ "interleaved, no quantization", MeshQuantizeNone, true },
+		// packVertices only uses SSE2 for 10:10:10 normals, so only those
+		// layouts have a second row.
+		{ "half uv", MeshQuantizeUVHalf, true },
+		{ "half pos", MeshQuantizePositionHalf, true },
+		{ "10:10:10, scalar", MeshQuantizeNormal1010102, false },
+		{ "10:10:10, sse2", MeshQuantizeNormal1010102, true },
+		{ "half pos+uv, 10:10:10, scalar", MeshQuantizePositionHalf | MeshQuantizeUVHalf | MeshQuantizeNormal1010102, false },
+		{ "half pos+uv, 10:10:10, sse2", MeshQuantizePositionHalf | MeshQuantizeUVHalf | MeshQuantizeNormal1010102, true },
+		{ "half pos+uv, octahedral", MeshQuantizePositionHalf | MeshQuantizeUVHalf | MeshQuantizeNormalOctahedral, true },
+	};
+
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		format.quantization = cases[c].quantization;
+		const MeshLayout layout = MeshLayout::forQuantization(format.quantization);
+		vector<unsigned char> packed;
+		report(cases[c].name, vertexCount, layout.stride, bestSeconds(repeats, [&] {
+			packed.resize((size_t)vertexCount * layout.stride);
+			packVertices(format, interleaved.data(), vertexCount, layout, packed.data(), cases[c].simd);
+			sink = packed[packed.size() / 2];
+		}));
+
+		// The SIMD and scalar paths must agree bit for bit.
+		if (cases[c].simd && format.quantization != MeshQuantizeNone) {
+			vector<unsigned char> scalar(packed.size());
+			packVertices(format, interleaved.data(), vertexCount, layout, scalar.data(), false);
+			if (memcmp(scalar.data(), packed.data(), packed.size()) != 0)
+				printf("  WARNING: sse2 output differs from scalar\n");
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,144 @@
+// Checks optimizeMesh on shuffled grids: the average cache miss ratio has to
+// drop, and the result has to describe the same triangles with the same
+// winding as the input, whether it came indexed or as a triangle soup.
+// Invalid input has to be refused and left untouched.
+//
+// Build and run with `make check` from projects/GNUMake; the exit status is
+// nonzero if any case fails.
+
+#include "../source/MeshOptimizer.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+struct GridVertex {
+	float pos[3];
+	float uv[2];
+};
+
+static const size_t kStride = sizeof(GridVertex);
+
+// A side x side quad grid as an indexed triangle list, triangles shuffled so
+// the cache has nothing to work with.
+static void makeGrid(int side, vector<unsigned char>& vertices, vector<uint32_t>& indices) {
+	const int row = side + 1;
+	vertices.resize(row * row * kStride);
+	for (int y = 0; y < row; ++y) {
+		for (int x = 0; x < row; ++x) {
+			GridVertex v = { { (float)x, (float)y, 0.0f }, { x / (float)side, y / (float)side } };
+			memcpy(&vertices[(y * row + x) * kStride], &v, kStride);
+		}
+	}
+
+	vector<uint32_t> triangles;
+	for (int y = 0; y < side; ++y) {
+		for (int x = 0; x < side; ++x) {
+			const uint32_t i = y * row + x;
+			const uint32_t quad[6] = { i, i + 1, i + row, i + 1, i + row + 1, i + row };
+			triangles.insert(triangles.end(), quad, quad + 6);
+		}
+	}
+
+	const size_t triangleCount = triangles.size() / 3;
+	vector<size_t> order(triangleCount);
+	for (size_t i = 0; i < triangleCount; ++i)
+		order[i] = i;
+	srand(1);
+	for (size_t i = triangleCount - 1; i > 0; --i)
+		std::swap(order[i], order[rand() % (i + 1)]);
+
+	indices.clear();
+	for (size_t i = 0; i < triangleCount; ++i)
+		indices.insert(indices.end(), &triangles[order[i] * 3], &triangles[order[i] * 3] + 3);
+}
+
+// Each triangle as its three vertices' bytes, rotated to start at the
+// smallest so winding is kept but the starting corner isn't; sorted, so two
+// meshes with the same triangles compare equal however they're ordered.
+static vector<string> triangleSet(const vector<unsigned char>& vertices, const vector<uint32_t>& indices) {
+	const size_t count = indices.empty() ? vertices.size() / kStride : indices.size();
+	vector<string> triangles;
+	for (size_t t = 0; t + 2 < count; t += 3) {
+		string corners[3];
+		for (int c = 0; c < 3; ++c) {
+			const size_t index = indices.empty() ? t + c : indices[t + c];
+			corners[c].assign((const char*)&vertices[index * kStride], kStride);
+		}
+		const int first = (int)(std::min_element(corners, corners + 3) - corners);
+		triangles.push_back(corners[first] + corners[(first + 1) % 3] + corners[(first + 2) % 3]);
+	}
+	std::sort(triangles.begin(), triangles.end());
+	return triangles;
+}
+
+static int failures = 0;
+
+static void expect(bool ok, const char* name, const char* what) {
+	if (!ok) {
+		printf("FAIL %s: %s\n", name, what);
+		++failures;
+	}
+}
+
+static void checkOptimized(const char* name, vector<unsigned char> vertices, vector<uint32_t> indices) {
+	const vector<string> before = triangleSet(vertices, indices);
+	const size_t vertexCount = vertices.size() / kStride;
+	float acmrBefore = 3.0f; // a soup misses on every vertex
+	if (!indices.empty())
+		acmrBefore = averageCacheMissRatio(indices, vertexCount);
+
+	if (!optimizeMesh(vertices, kStride, indices)) {
+		expect(false, name, "optimizeMesh refused a valid mesh");
+		return;
+	}
+	const float acmrAfter = averageCacheMissRatio(indices, vertices.size() / kStride);
+	printf("%-24s %zu -> %zu vertices, ACMR %.2f -> %.2f\n", name, vertexCount, vertices.size() / kStride, acmrBefore, acmrAfter);
+
+	expect(acmrAfter < acmrBefore, name, "the average cache miss ratio didn't drop");
+	expect(triangleSet(vertices, indices) == before, name, "the triangles or their winding changed");
+	bool inRange = true;
+	for (size_t i = 0; i < indices.size(); ++i)
+		inRange = inRange && indices[i] < vertices.size() / kStride;
+	expect(inRange, name, "an index is out of range");
+}
+
+static void checkRefused(const char* name, vector<unsigned char> vertices, vector<uint32_t> indices) {
+	const vector<unsigned char> originalVertices = vertices;
+	const vector<uint32_t> originalIndices = indices;
+	expect(!optimizeMesh(vertices, kStride, indices), name, "optimizeMesh accepted an invalid mesh");
+	expect(vertices == originalVertices && indices == originalIndices, name, "the refused mesh was modified");
+}
+
+int main(int argc, char** argv) {
+	const int side = argc > 1 ? atoi(argv[1]) : 200;
+
+	vector<unsigned char> vertices;
+	vector<uint32_t> indices;
+	makeGrid(side, vertices, indices);
+	checkOptimized("indexed grid", vertices, indices);
+
+	vector<unsigned char> soup;
+	for (size_t i = 0; i < indices.size(); ++i)
+		soup.insert(soup.end(), &vertices[indices[i] * kStride], &vertices[indices[i] * kStride] + kStride);
+	checkOptimized("triangle soup", soup, vector<uint32_t>());
+
+	vector<uint32_t> outOfRange = indices;
+	outOfRange[outOfRange.size() / 2] = (uint32_t)(vertices.size() / kStride);
+	checkRefused("index out of range", vertices, outOfRange);
+
+	vector<uint32_t> partial(indices.begin(), indices.end() - 1);
+	checkRefused("partial triangle", vertices, partial);
+
+	if (failures)
+		printf("%d failures\n", failures);
+	else
+		printf("all passed\n");
+	return failures ? 1 : 0;
+}
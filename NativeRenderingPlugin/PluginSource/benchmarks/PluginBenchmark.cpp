@@ -0,0 +1,435 @@
+// The plugin's CPU side end to end, through the exported C ABI, on the Null
+// backend: Unity is stood in for by a stub IUnityGraphics that reports the
+// null device, so this runs on any machine, GPU or not.
+//
+// Three groups of results, each a time where lower is better:
+//   latency.*     one exported call, in ns, on a single compiled material
+//   throughput.*  a frame of set, submit and draw per material at 1, 100 and
+//                 10K materials, in ns per material, plus creating and
+//                 compiling them, in ms
+//   contention.*  the main thread setting and submitting while a render
+//                 thread draws the same materials, against either alone
+// plus contention.lock.* counts from the lock statistics, for reference only.
+//
+// Results go to stdout as JSON. Save a run and pass it back with --baseline
+// to have every time more than --threshold percent (default 10) slower than
+// it reported on stderr and the exit status set.
+//
+// Build and run with `make headless && ./plugin_benchmark > baseline.json`,
+// then `./plugin_benchmark --baseline baseline.json`, from projects/GNUMake.
+// --compile-latency sets the Null compiler's per-shader delay in
+// microseconds (default 0).
+
+#include "../source/InstrumentedMutex.h"
+#include "../source/Unity/IUnityGraphics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+extern "C" {
+void UnityPluginLoad(IUnityInterfaces* unityInterfaces);
+void UnityPluginUnload();
+void SetCallbackFunctions(void(*debugLogFunc)(int level, const char*));
+void FlushLog();
+int CreateLiveMaterialId();
+void* GetLiveMaterialPtr(int id);
+void DestroyLiveMaterial(int id);
+void SetShaderSource(void* liveMaterial, const char* fragSrc, const char* fragEntry, const char* vertSrc, const char* vertEntry);
+bool HasProperty(void* liveMaterial, const char* name);
+void SetFloat(void* liveMaterial, const char* name, float value);
+void SetVector4(void* liveMaterial, const char* name, float* value);
+void SetVectorArray(void* liveMaterial, const char* name, float* values, int numVector4s);
+void SubmitUniforms(void* liveMaterial, int uniformsIndex);
+void SetNullCompileLatency(int microseconds);
+void GetDebugInfo(int* numCompileTasks, int* numLiveMaterials);
+void SetLockStatsEnabled(bool enabled);
+void ResetLockStats();
+bool GetLockStats(int index, LockStats* stats);
+UnityRenderingEvent GetRenderEventFunc();
+}
+
+// Just enough of IUnityInterfaces for UnityPluginLoad to bring up the Null backend.
+static IUnityGraphicsDeviceEventCallback deviceEventCallback;
+static UnityGfxRenderer UNITY_INTERFACE_API getRenderer() { return kUnityGfxRendererNull; }
+static void UNITY_INTERFACE_API registerCallback(IUnityGraphicsDeviceEventCallback callback) { deviceEventCallback = callback; }
+static void UNITY_INTERFACE_API unregisterCallback(IUnityGraphicsDeviceEventCallback) {}
+static IUnityGraphics graphics;
+static IUnityInterface* UNITY_INTERFACE_API getInterface(UnityInterfaceGUID) { return (IUnityInterface*)&graphics; }
+
+// The plugin's log would otherwise land in the middle of the JSON on stdout.
+static void discardLog(int, const char*) {}
+
+static const char* kFragmentSource =
+	"float _Time;\n"
+	"float4 _Color;\n"
+	"float4 _Params[4];\n"
+	"float4x4 _Transform;\n"
+	"float4 frag() : SV_Target { return _Color * _Time; }\n";
+static const char* kOtherFragmentSource =
+	"float _Time;\n"
+	"float4 _Color;\n"
+	"float4 _Params[4];\n"
+	"float4x4 _Transform;\n"
+	"float4 frag() : SV_Target { return _Color + _Params[0] * _Time; }\n";
+static const char* kVertexSource =
+	"float4 vert(uint id : SV_VertexID) : SV_Position { return float4(0, 0, 0, 1); }\n";
+
+static const int kRepeats = 5;
+
+struct Result {
+	string name;
+	string unit;
+	double value;
+	bool compared; // against a baseline; lock counts vary too much run to run
+};
+
+static vector<Result> results;
+
+static void record(const string& name, const char* unit, double value, bool compared = true) {
+	Result result = { name, unit, value, compared };
+	results.push_back(result);
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Calls fn(i) for i in [0, calls) kRepeats times and returns the best
+// repeat's time per call, which is the one least disturbed by the rest of
+// the machine.
+template <typename Fn>
+static double bestNsPerCall(int calls, Fn fn) {
+	double best = 1e30;
+	for (int repeat = 0; repeat < kRepeats; ++repeat) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < calls; ++i)
+			fn(i);
+		best = std::min(best, secondsSince(start));
+	}
+	return best * 1e9 / calls;
+}
+
+static UnityRenderingEvent renderEvent;
+
+static int packEvent(int id, int uniformsIndex) { return (id << 16) | uniformsIndex; }
+
+// Layouts arrive on the render thread's next draw after each compile. A
+// material recompiling keeps its old layout until then, so the queue has to
+// empty too.
+static void waitForCompiles(const vector<int>& ids) {
+	for (int queued = 1, materials; queued;) {
+		GetDebugInfo(&queued, &materials);
+		if (queued)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	for (bool compiled = false; !compiled;) {
+		compiled = true;
+		for (size_t i = 0; i < ids.size(); ++i) {
+			renderEvent(packEvent(ids[i], 0));
+			compiled = compiled && HasProperty(GetLiveMaterialPtr(ids[i]), "_Color");
+		}
+		if (!compiled)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+}
+
+static vector<int> createCompiled(int count) {
+	vector<int> ids;
+	for (int i = 0; i < count; ++i) {
+		ids.push_back(CreateLiveMaterialId());
+		SetShaderSource(GetLiveMaterialPtr(ids.back()), kFragmentSource, "frag", kVertexSource, "vert");
+	}
+	waitForCompiles(ids);
+	return ids;
+}
+
+static void destroyAll(const vector<int>& ids) {
+	for (size_t i = 0; i < ids.size(); ++i)
+		DestroyLiveMaterial(ids[i]);
+}
+
+static float color[4] = { 1, 0.5f, 0.25f, 1 };
+static float params[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+
+// What a frame of a LiveMaterial script does on the main thread.
+static void setAndSubmit(void* material, int frame) {
+	SetFloat(material, "_Time", (float)frame);
+	SetVector4(material, "_Color", color);
+	SetVectorArray(material, "_Params", params, 4);
+	SubmitUniforms(material, frame & 1);
+}
+
+static void measureLatency() {
+	const int calls = 100000;
+
+	// Ids are 16 bits and handed out in order, so keep the number created
+	// across the whole run well under 32K.
+	const int creates = 1000;
+	vector<int> created;
+	created.reserve(creates);
+	double best = 1e30;
+	for (int repeat = 0; repeat < kRepeats; ++repeat) {
+		created.clear();
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < creates; ++i)
+			created.push_back(CreateLiveMaterialId());
+		best = std::min(best, secondsSince(start));
+		destroyAll(created);
+	}
+	record("latency.CreateLiveMaterialId", "ns", best * 1e9 / creates);
+
+	vector<int> ids = createCompiled(1);
+	const int id = ids[0];
+	void* material = GetLiveMaterialPtr(id);
+
+	record("latency.SetFloat", "ns", bestNsPerCall(calls, [&](int i) { SetFloat(material, "_Time", (float)i); }));
+	record("latency.SetVector4", "ns", bestNsPerCall(calls, [&](int i) { color[3] = (float)i; SetVector4(material, "_Color", color); }));
+	record("latency.SetVectorArray", "ns", bestNsPerCall(calls, [&](int i) { params[0] = (float)i; SetVectorArray(material, "_Params", params, 4); }));
+
+	// Changing a value each time keeps SubmitUniforms from skipping the copy
+	// of a slot that already holds the same uniforms.
+	double submitAndSet = bestNsPerCall(calls, [&](int i) { SetFloat(material, "_Time", (float)i); SubmitUniforms(material, i & 1); });
+	double set = bestNsPerCall(calls, [&](int i) { SetFloat(material, "_Time", (float)i); });
+	record("latency.SubmitUniforms", "ns", std::max(0.0, submitAndSet - set));
+
+	record("latency.RenderEvent", "ns", bestNsPerCall(calls, [&](int i) { renderEvent(packEvent(id, i & 1)); }));
+	destroyAll(ids);
+
+	// Each SetShaderSource queues compiles that only land on the next draw,
+	// so it's measured once per material over a batch and then drained.
+	const int sources = 1000;
+	ids = createCompiled(sources);
+	best = 1e30;
+	for (int repeat = 0; repeat < kRepeats; ++repeat) {
+		const char* fragment = repeat & 1 ? kFragmentSource : kOtherFragmentSource;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < sources; ++i)
+			SetShaderSource(GetLiveMaterialPtr(ids[i]), fragment, "frag", kVertexSource, "vert");
+		best = std::min(best, secondsSince(start));
+		waitForCompiles(ids);
+	}
+	record("latency.SetShaderSource", "ns", best * 1e9 / sources);
+	destroyAll(ids);
+}
+
+static void measureThroughput(int materialCount) {
+	std::stringstream prefix;
+	prefix << "throughput." << materialCount << ".";
+
+	auto start = std::chrono::steady_clock::now();
+	vector<int> ids = createCompiled(materialCount);
+	record(prefix.str() + "create_and_compile", "ms", secondsSince(start) * 1e3);
+
+	// About a million material frames per repeat whatever the count.
+	const int frames = std::max(10, 1000000 / materialCount);
+	int frame = 0;
+	double best = 1e30;
+	for (int repeat = 0; repeat < kRepeats; ++repeat) {
+		start = std::chrono::steady_clock::now();
+		for (int end = frame + frames; frame < end; ++frame) {
+			for (size_t i = 0; i < ids.size(); ++i) {
+				setAndSubmit(GetLiveMaterialPtr(ids[i]), frame);
+				renderEvent(packEvent(ids[i], frame & 1));
+			}
+			FlushLog();
+		}
+		best = std::min(best, secondsSince(start));
+	}
+	record(prefix.str() + "frame", "ns", best * 1e9 / ((double)frames * materialCount));
+	destroyAll(ids);
+}
+
+// Main thread ns per material for `frames` frames of setAndSubmit, with a
+// render thread drawing the same materials as fast as it can if `render`.
+// The render thread's ns per draw goes to renderNs.
+static double setAndSubmitAgainstRenderThread(const vector<int>& ids, int frames, bool render, double* renderNs) {
+	std::atomic<bool> stop{ false };
+	std::atomic<int> currentFrame{ 0 };
+	uint64_t draws = 0;
+	double renderSeconds = 0;
+	std::thread renderThread;
+	if (render) {
+		renderThread = std::thread([&]() {
+			auto start = std::chrono::steady_clock::now();
+			while (!stop.load(std::memory_order_relaxed)) {
+				const int frame = currentFrame.load(std::memory_order_relaxed);
+				for (size_t i = 0; i < ids.size(); ++i)
+					renderEvent(packEvent(ids[i], frame & 1));
+				draws += ids.size();
+			}
+			renderSeconds = secondsSince(start);
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; ++frame) {
+		for (size_t i = 0; i < ids.size(); ++i)
+			setAndSubmit(GetLiveMaterialPtr(ids[i]), frame);
+		currentFrame.store(frame, std::memory_order_relaxed);
+		FlushLog();
+	}
+	const double seconds = secondsSince(start);
+
+	stop = true;
+	if (render) {
+		renderThread.join();
+		if (renderNs)
+			*renderNs = draws ? renderSeconds * 1e9 / draws : 0;
+	}
+	return seconds * 1e9 / ((double)frames * ids.size());
+}
+
+static void measureContention(int materialCount) {
+	vector<int> ids = createCompiled(materialCount);
+	const int frames = std::max(10, 1000000 / materialCount);
+
+	double alone = 1e30, contended = 1e30, render = 1e30;
+	for (int repeat = 0; repeat < kRepeats; ++repeat) {
+		double renderNs = 0;
+		alone = std::min(alone, setAndSubmitAgainstRenderThread(ids, frames, false, nullptr));
+		contended = std::min(contended, setAndSubmitAgainstRenderThread(ids, frames, true, &renderNs));
+		render = std::min(render, renderNs);
+	}
+	record("contention.main_alone", "ns", alone);
+	record("contention.main_with_render_thread", "ns", contended);
+	record("contention.render_thread_draw", "ns", render);
+
+	// A separate run with lock statistics on, since timing every lock
+	// slows both threads down.
+	ResetLockStats();
+	SetLockStatsEnabled(true);
+	setAndSubmitAgainstRenderThread(ids, frames, true, nullptr);
+	SetLockStatsEnabled(false);
+	LockStats stats;
+	for (int i = 0; GetLockStats(i, &stats); ++i) {
+		if (!stats.acquisitions)
+			continue;
+		const string prefix = string("contention.lock.") + stats.name + ".";
+		record(prefix + "acquisitions", "count", (double)stats.acquisitions, false);
+		record(prefix + "contended", "count", (double)stats.contended, false);
+		record(prefix + "total_wait", "ms", stats.totalWaitMs, false);
+	}
+	destroyAll(ids);
+}
+
+static void writeJson(FILE* out, int compileLatencyUs) {
+	fprintf(out, "{\n");
+	fprintf(out, "  \"benchmark\": \"plugin\",\n");
+	fprintf(out, "  \"compileLatencyUs\": %d,\n", compileLatencyUs);
+	fprintf(out, "  \"results\": [\n");
+	for (size_t i = 0; i < results.size(); ++i) {
+		fprintf(out, "    { \"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f }%s\n",
+			results[i].name.c_str(), results[i].unit.c_str(), results[i].value, i + 1 < results.size() ? "," : "");
+	}
+	fprintf(out, "  ]\n");
+	fprintf(out, "}\n");
+}
+
+// Reads back what writeJson wrote: one result object per line.
+static bool readBaseline(const char* filename, vector<Result>* baseline) {
+	std::ifstream in(filename);
+	if (!in)
+		return false;
+	string line;
+	while (std::getline(in, line)) {
+		char name[256], unit[32];
+		double value;
+		if (sscanf(line.c_str(), " { \"name\": \"%255[^\"]\", \"unit\": \"%31[^\"]\", \"value\": %lf", name, unit, &value) == 3) {
+			Result result = { name, unit, value, true };
+			baseline->push_back(result);
+		}
+	}
+	return true;
+}
+
+// Returns the number of results more than thresholdPercent slower than the
+// baseline's.
+static int compareWithBaseline(const vector<Result>& baseline, double thresholdPercent) {
+	int regressions = 0;
+	fprintf(stderr, "%-48s %12s %12s %8s\n", "", "baseline", "now", "change");
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& result = results[i];
+		if (!result.compared)
+			continue;
+		const Result* before = nullptr;
+		for (size_t j = 0; j < baseline.size(); ++j) {
+			if (baseline[j].name == result.name)
+				before = &baseline[j];
+		}
+		if (!before || before->value <= 0) {
+			fprintf(stderr, "%-48s %12s %9.1f %s %8s\n", result.name.c_str(), "-", result.value, result.unit.c_str(), "new");
+			continue;
+		}
+		const double change = (result.value / before->value - 1) * 100;
+		const bool regressed = change > thresholdPercent;
+		regressions += regressed;
+		fprintf(stderr, "%-48s %9.1f %s %9.1f %s %+7.1f%%%s\n", result.name.c_str(),
+			before->value, result.unit.c_str(), result.value, result.unit.c_str(), change, regressed ? "  REGRESSION" : "");
+	}
+	return regressions;
+}
+
+int main(int argc, char** argv) {
+	const char* baselineFile = nullptr;
+	double thresholdPercent = 10;
+	int compileLatencyUs = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--baseline") && i + 1 < argc) {
+			baselineFile = argv[++i];
+		} else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+			thresholdPercent = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--compile-latency") && i + 1 < argc) {
+			compileLatencyUs = atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "usage: %s [--baseline file] [--threshold percent] [--compile-latency microseconds]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	vector<Result> baseline;
+	if (baselineFile && !readBaseline(baselineFile, &baseline)) {
+		fprintf(stderr, "can't read baseline %s\n", baselineFile);
+		return 2;
+	}
+
+	SetCallbackFunctions(discardLog);
+	graphics.GetRenderer = getRenderer;
+	graphics.RegisterDeviceEventCallback = registerCallback;
+	graphics.UnregisterDeviceEventCallback = unregisterCallback;
+	static IUnityInterfaces interfaces;
+	interfaces.GetInterface = getInterface;
+	UnityPluginLoad(&interfaces);
+	SetNullCompileLatency(compileLatencyUs);
+	renderEvent = GetRenderEventFunc();
+
+	measureLatency();
+	measureThroughput(1);
+	measureThroughput(100);
+	measureThroughput(10000);
+	measureContention(100);
+
+	if (deviceEventCallback)
+		deviceEventCallback(kUnityGfxDeviceEventShutdown);
+	UnityPluginUnload();
+	FlushLog();
+
+	writeJson(stdout, compileLatencyUs);
+	if (!baselineFile)
+		return 0;
+	const int regressions = compareWithBaseline(baseline, thresholdPercent);
+	if (regressions)
+		fprintf(stderr, "%d result%s more than %.0f%% slower than %s\n", regressions, regressions == 1 ? "" : "s", thresholdPercent, baselineFile);
+	return regressions ? 1 : 0;
+}
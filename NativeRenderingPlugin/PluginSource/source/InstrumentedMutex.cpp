@@ -0,0 +1,97 @@
+#include "InstrumentedMutex.h"
+#include "Profiler.h"
+
+#include <deque>
+#include <string.h>
+
+using std::lock_guard;
+using std::mutex;
+
+std::atomic<bool> lockStatsEnabled{ false };
+
+struct LockClass {
+	const char* name;
+	std::atomic<uint64_t> acquisitions{ 0 };
+	std::atomic<uint64_t> contended{ 0 };
+	std::atomic<uint64_t> waitNs{ 0 };
+	std::atomic<uint64_t> maxHoldNs{ 0 };
+};
+
+// Function statics, since global mutexes in other files are constructed
+// during static initialization too.
+static mutex& lockClassesMutex() {
+	static mutex m;
+	return m;
+}
+
+static std::deque<LockClass>& lockClasses() {
+	static std::deque<LockClass> classes; // never shrinks, so references stay valid
+	return classes;
+}
+
+static LockClass& findLockClass(const char* name) {
+	lock_guard<mutex> guard(lockClassesMutex());
+	std::deque<LockClass>& classes = lockClasses();
+	for (size_t i = 0; i < classes.size(); ++i)
+		if (strcmp(classes[i].name, name) == 0)
+			return classes[i];
+	classes.emplace_back();
+	classes.back().name = name;
+	return classes.back();
+}
+
+InstrumentedMutex::InstrumentedMutex(const char* lockClassName) : _class(findLockClass(lockClassName)) {}
+
+void InstrumentedMutex::lockTimed() {
+	if (_mutex.try_lock()) {
+		acquired();
+		return;
+	}
+	const uint64_t start = profilerNow();
+	_mutex.lock();
+	acquired();
+	_class.contended.fetch_add(1, std::memory_order_relaxed);
+	_class.waitNs.fetch_add(_lockedAt - start, std::memory_order_relaxed);
+}
+
+void InstrumentedMutex::acquired() {
+	_lockedAt = profilerNow();
+	_timed = true;
+	_class.acquisitions.fetch_add(1, std::memory_order_relaxed);
+}
+
+void InstrumentedMutex::released() {
+	const uint64_t held = profilerNow() - _lockedAt;
+	uint64_t longest = _class.maxHoldNs.load(std::memory_order_relaxed);
+	while (held > longest && !_class.maxHoldNs.compare_exchange_weak(longest, held, std::memory_order_relaxed)) {}
+	_timed = false;
+}
+
+void setLockStatsEnabled(bool enabled) {
+	lockStatsEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+void resetLockStats() {
+	lock_guard<mutex> guard(lockClassesMutex());
+	std::deque<LockClass>& classes = lockClasses();
+	for (size_t i = 0; i < classes.size(); ++i) {
+		classes[i].acquisitions.store(0, std::memory_order_relaxed);
+		classes[i].contended.store(0, std::memory_order_relaxed);
+		classes[i].waitNs.store(0, std::memory_order_relaxed);
+		classes[i].maxHoldNs.store(0, std::memory_order_relaxed);
+	}
+}
+
+bool getLockStats(int index, LockStats* stats) {
+	lock_guard<mutex> guard(lockClassesMutex());
+	const std::deque<LockClass>& classes = lockClasses();
+	if (index < 0 || (size_t)index >= classes.size())
+		return false;
+	const LockClass& lockClass = classes[index];
+	stats->name = lockClass.name;
+	stats->acquisitions = lockClass.acquisitions.load(std::memory_order_relaxed);
+	stats->contended = lockClass.contended.load(std::memory_order_relaxed);
+	stats->totalWaitMs = lockClass.waitNs.load(std::memory_order_relaxed) / 1e6f;
+	stats->maxHoldMs = lockClass.maxHoldNs.load(std::memory_order_relaxed) / 1e6f;
+	return true;
+}
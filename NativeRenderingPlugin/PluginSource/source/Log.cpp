@@ -0,0 +1,123 @@
+#include "Log.h"
+#include "InstrumentedMutex.h"
+
+#include <atomic>
+#include <iostream>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+using std::lock_guard;
+
+// A bounded multi-producer queue (Vyukov's): each record's sequence says
+// whether it's free for the producer at that position or full for the
+// consumer. Producers that find the ring full drop their message and count
+// it.
+struct LogRecord {
+	std::atomic<size_t> sequence;
+	LogLevel level;
+	char* longText; // heap copy of messages that don't fit in text
+	char text[240];
+};
+
+struct LogRing {
+	static const size_t kCapacity = 1024;
+
+	LogRecord records[kCapacity];
+	std::atomic<size_t> enqueuePos{ 0 };
+	size_t dequeuePos = 0; // under debugLogMutex
+	std::atomic<uint64_t> dropped{ 0 };
+
+	LogRing() {
+		for (size_t i = 0; i < kCapacity; ++i)
+			records[i].sequence.store(i, std::memory_order_relaxed);
+	}
+};
+
+static LogRing& logRing() {
+	static LogRing ring; // a function static, since globals elsewhere may log while they're constructed
+	return ring;
+}
+
+static InstrumentedMutex debugLogMutex("debugLogMutex");
+static std::atomic<DebugLogFuncPtr> logCallback{ nullptr };
+
+static void forward(DebugLogFuncPtr callback, LogLevel level, const char* message) {
+	if (callback)
+		callback(level, message);
+	else
+		(level >= LogWarning ? std::cerr : std::cout) << message << std::endl;
+}
+
+// Must be called with debugLogMutex held.
+static void drainLocked(DebugLogFuncPtr callback) {
+	LogRing& ring = logRing();
+	for (;;) {
+		LogRecord& record = ring.records[ring.dequeuePos % LogRing::kCapacity];
+		if (record.sequence.load(std::memory_order_acquire) != ring.dequeuePos + 1)
+			break;
+		forward(callback, record.level, record.longText ? record.longText : record.text);
+		free(record.longText);
+		record.longText = nullptr;
+		record.sequence.store(ring.dequeuePos + LogRing::kCapacity, std::memory_order_release);
+		++ring.dequeuePos;
+	}
+
+	const uint64_t dropped = ring.dropped.exchange(0, std::memory_order_relaxed);
+	if (dropped) {
+		std::stringstream ss;
+		ss << dropped << " log messages dropped; the log ring was full";
+		forward(callback, LogWarning, ss.str().c_str());
+	}
+}
+
+void setLogCallback(DebugLogFuncPtr callback) {
+	lock_guard<InstrumentedMutex> guard(debugLogMutex);
+	drainLocked(logCallback.load(std::memory_order_relaxed));
+	logCallback.store(callback, std::memory_order_relaxed);
+}
+
+void logMessage(LogLevel level, const char* message) {
+	LogRing& ring = logRing();
+	size_t pos = ring.enqueuePos.load(std::memory_order_relaxed);
+	LogRecord* record;
+	for (;;) {
+		record = &ring.records[pos % LogRing::kCapacity];
+		const intptr_t diff = (intptr_t)record->sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+		if (diff == 0) {
+			if (ring.enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			ring.dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		} else {
+			pos = ring.enqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+
+	record->level = level;
+	const size_t length = strlen(message);
+	if (length < sizeof(record->text)) {
+		memcpy(record->text, message, length + 1);
+		record->longText = nullptr;
+	} else {
+		record->longText = (char*)malloc(length + 1);
+		if (record->longText) {
+			memcpy(record->longText, message, length + 1);
+		} else {
+			memcpy(record->text, message, sizeof(record->text) - 1);
+			record->text[sizeof(record->text) - 1] = '\0';
+		}
+	}
+	record->sequence.store(pos + 1, std::memory_order_release);
+
+	// Nothing managed to block on, so print right away.
+	if (!logCallback.load(std::memory_order_relaxed))
+		drainLog();
+}
+
+void drainLog() {
+	std::unique_lock<InstrumentedMutex> guard(debugLogMutex, std::try_to_lock);
+	if (guard.owns_lock())
+		drainLocked(logCallback.load(std::memory_order_relaxed));
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+
+// Messages from any thread are formatted where they're logged and pushed onto
+// a lock-free ring; drainLog, called from the main thread, hands them to the
+// managed callback along with their level, so warnings and errors reach
+// Debug.LogWarning and Debug.LogError. The render and compile threads
+// therefore never wait on managed code, or on each other to log.
+//
+// Messages below LIVEMATERIAL_LOG_LEVEL are compiled out, formatting and all.
+// Errors never are, whatever the level.
+
+enum LogLevel { LogVerbose, LogInfo, LogWarning, LogError };
+
+#ifndef LIVEMATERIAL_LOG_LEVEL
+#ifdef NDEBUG
+#define LIVEMATERIAL_LOG_LEVEL LogInfo
+#else
+#define LIVEMATERIAL_LOG_LEVEL LogVerbose
+#endif
+#endif
+
+typedef void(*DebugLogFuncPtr)(int level, const char *);
+
+// Flushes what's queued to the previous callback first. Without a callback
+// messages go to stdout as they're logged.
+void setLogCallback(DebugLogFuncPtr callback);
+
+void logMessage(LogLevel level, const char* message);
+
+// Forwards every queued message. A drain already running on another thread
+// makes this a no-op rather than a wait.
+void drainLog();
+
+#define DebugAt(level, ssexp) do { \
+	if ((level) >= LIVEMATERIAL_LOG_LEVEL || (level) >= LogError) { \
+		std::stringstream _ss; _ss << ssexp; \
+		logMessage((level), _ss.str().c_str()); \
+	} \
+} while(0)
+
+#define Debug(m) do { if (LogInfo >= LIVEMATERIAL_LOG_LEVEL) logMessage(LogInfo, m); } while(0)
+#define DebugSS(ssexp) DebugAt(LogInfo, ssexp)
+#define DebugVerbose(ssexp) DebugAt(LogVerbose, ssexp)
+#define DebugWarning(ssexp) DebugAt(LogWarning, ssexp)
+#define DebugError(ssexp) DebugAt(LogError, ssexp)
@@ -0,0 +1,204 @@
+#include "MeshFormat.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MESH_FORMAT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static const uint16_t kHalfOne = 0x3c00;
+
+MeshLayout MeshLayout::forQuantization(uint32_t quantization) {
+	MeshLayout layout;
+	layout.quantization = quantization;
+	layout.positionOffset = 0;
+	layout.normalOffset = layout.positionOffset + (layout.halfPositions() ? 4 * sizeof(uint16_t) : 3 * sizeof(float));
+	layout.uvOffset = layout.normalOffset + (layout.octahedralNormals() || layout.packedNormals() ? sizeof(uint32_t) : 3 * sizeof(float));
+	layout.stride = layout.uvOffset + (layout.halfUVs() ? 2 * sizeof(uint16_t) : 2 * sizeof(float));
+	return layout;
+}
+
+const char* vertexFormatError(const VertexFormat& format) {
+	if (format.stride <= 0)
+		return "vertex stride must be positive";
+	if (format.positionOffset < -1 || format.positionOffset + (int)(3 * sizeof(float)) > format.stride)
+		return "position doesn't fit in the vertex stride";
+	if (format.normalOffset < -1 || format.normalOffset + (int)(3 * sizeof(float)) > format.stride)
+		return "normal doesn't fit in the vertex stride";
+	if (format.uvOffset < -1 || format.uvOffset + (int)(2 * sizeof(float)) > format.stride)
+		return "uv doesn't fit in the vertex stride";
+	return nullptr;
+}
+
+// Round-to-nearest-even float to half conversion, after Fabian Giesen's
+// float_to_half_fast3_rtne. Overflow goes to infinity and NaNs stay NaNs.
+uint16_t floatToHalf(float value) {
+	const uint32_t f32infty = 255u << 23;
+	const uint32_t f16max = (127u + 16) << 23;
+	const uint32_t denormMagic = ((127u - 15) + (23 - 10) + 1) << 23;
+
+	uint32_t f;
+	memcpy(&f, &value, sizeof(f));
+	const uint32_t sign = f & 0x80000000u;
+	f ^= sign;
+
+	uint16_t half;
+	if (f >= f16max) {
+		half = f > f32infty ? 0x7e00 : 0x7c00;
+	} else if (f < (113u << 23)) {
+		// Result is subnormal or zero; let the FPU do the rounding.
+		float fv, magic;
+		memcpy(&fv, &f, sizeof(fv));
+		memcpy(&magic, &denormMagic, sizeof(magic));
+		fv += magic;
+		memcpy(&f, &fv, sizeof(f));
+		half = (uint16_t)(f - denormMagic);
+	} else {
+		const uint32_t mantissaOdd = (f >> 13) & 1;
+		f += ((uint32_t)(15 - 127) << 23) + 0xfff;
+		f += mantissaOdd;
+		half = (uint16_t)(f >> 13);
+	}
+	return half | (uint16_t)(sign >> 16);
+}
+
+static float clampUnit(float v) {
+	return v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+}
+
+uint32_t encodeNormal1010102(const float* normal) {
+	uint32_t packed = 0;
+	for (int i = 0; i < 3; ++i) {
+		const uint32_t v = (uint32_t)lrintf(clampUnit(normal[i]) * 511.5f + 511.5f);
+		packed |= v << (10 * i);
+	}
+	return packed;
+}
+
+uint32_t encodeNormalOctahedral(const float* normal) {
+	const float l1 = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+	float u = 0.0f, v = 0.0f;
+	if (l1 > 0.0f) {
+		u = normal[0] / l1;
+		v = normal[1] / l1;
+		if (normal[2] < 0.0f) {
+			// Fold the lower hemisphere over the diagonals.
+			const float fu = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+			const float fv = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+			u = fu;
+			v = fv;
+		}
+	}
+	const int16_t x = (int16_t)lrintf(clampUnit(u) * 32767.0f);
+	const int16_t y = (int16_t)lrintf(clampUnit(v) * 32767.0f);
+	return (uint32_t)(uint16_t)x | ((uint32_t)(uint16_t)y << 16);
+}
+
+static const float kZeros[3] = { 0.0f, 0.0f, 0.0f };
+
+static const float* attribute(const unsigned char* vertex, int offset) {
+	return offset < 0 ? kZeros : (const float*)(vertex + offset);
+}
+
+static void packNormal(const MeshLayout& layout, const float* normal, unsigned char* dest) {
+	if (layout.octahedralNormals()) {
+		const uint32_t packed = encodeNormalOctahedral(normal);
+		memcpy(dest, &packed, sizeof(packed));
+	} else if (layout.packedNormals()) {
+		const uint32_t packed = encodeNormal1010102(normal);
+		memcpy(dest, &packed, sizeof(packed));
+	} else {
+		memcpy(dest, normal, 3 * sizeof(float));
+	}
+}
+
+static void packVerticesScalar(const VertexFormat& format, const unsigned char* src, int vertexCount,
+	const MeshLayout& layout, unsigned char* dest) {
+	for (int i = 0; i < vertexCount; ++i, src += format.stride, dest += layout.stride) {
+		const float* position = attribute(src, format.positionOffset);
+		if (layout.halfPositions()) {
+			const uint16_t half[4] = { floatToHalf(position[0]), floatToHalf(position[1]), floatToHalf(position[2]), kHalfOne };
+			memcpy(dest + layout.positionOffset, half, sizeof(half));
+		} else {
+			memcpy(dest + layout.positionOffset, position, 3 * sizeof(float));
+		}
+
+		packNormal(layout, attribute(src, format.normalOffset), dest + layout.normalOffset);
+
+		const float* uv = attribute(src, format.uvOffset);
+		if (layout.halfUVs()) {
+			const uint16_t half[2] = { floatToHalf(uv[0]), floatToHalf(uv[1]) };
+			memcpy(dest + layout.uvOffset, half, sizeof(half));
+		} else {
+			memcpy(dest + layout.uvOffset, uv, 2 * sizeof(float));
+		}
+	}
+}
+
+#if MESH_FORMAT_SSE2
+
+static uint32_t encodeNormal1010102SSE2(const float* normal) {
+	__m128 n = _mm_setr_ps(normal[0], normal[1], normal[2], 0.0f);
+	n = _mm_min_ps(_mm_max_ps(n, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+	n = _mm_add_ps(_mm_mul_ps(n, _mm_set1_ps(511.5f)), _mm_set1_ps(511.5f));
+	int32_t v[4];
+	_mm_storeu_si128((__m128i*)v, _mm_cvtps_epi32(n));
+	return (uint32_t)v[0] | ((uint32_t)v[1] << 10) | ((uint32_t)v[2] << 20);
+}
+
+// Only the 10:10:10 normals are vectorized. Four lanes of half conversion
+// for three (or two) values came out slower than the scalar floatToHalf in
+// mesh_ingest_benchmark, and octahedral encoding is branchy either way.
+static void packVerticesSSE2(const VertexFormat& format, const unsigned char* src, int vertexCount,
+	const MeshLayout& layout, unsigned char* dest) {
+	for (int i = 0; i < vertexCount; ++i, src += format.stride, dest += layout.stride) {
+		const float* position = attribute(src, format.positionOffset);
+		if (layout.halfPositions()) {
+			const uint16_t half[4] = { floatToHalf(position[0]), floatToHalf(position[1]), floatToHalf(position[2]), kHalfOne };
+			memcpy(dest + layout.positionOffset, half, sizeof(half));
+		} else {
+			memcpy(dest + layout.positionOffset, position, 3 * sizeof(float));
+		}
+
+		const uint32_t packed = encodeNormal1010102SSE2(attribute(src, format.normalOffset));
+		memcpy(dest + layout.normalOffset, &packed, sizeof(packed));
+
+		const float* uv = attribute(src, format.uvOffset);
+		if (layout.halfUVs()) {
+			const uint16_t half[2] = { floatToHalf(uv[0]), floatToHalf(uv[1]) };
+			memcpy(dest + layout.uvOffset, half, sizeof(half));
+		} else {
+			memcpy(dest + layout.uvOffset, uv, 2 * sizeof(float));
+		}
+	}
+}
+
+#endif // MESH_FORMAT_SSE2
+
+void packVertices(const VertexFormat& format, const void* src, int vertexCount,
+	const MeshLayout& layout, unsigned char* dest, bool allowSimd) {
+	if (vertexCount <= 0)
+		return;
+	const unsigned char* in = (const unsigned char*)src;
+
+	// Already in the GPU layout: one copy, no per-vertex work.
+	if (format.stride == (int32_t)layout.stride &&
+		format.positionOffset == (int32_t)layout.positionOffset &&
+		format.normalOffset == (int32_t)layout.normalOffset &&
+		format.uvOffset == (int32_t)layout.uvOffset &&
+		layout.quantization == MeshQuantizeNone) {
+		memcpy(dest, in, (size_t)vertexCount * layout.stride);
+		return;
+	}
+
+#if MESH_FORMAT_SSE2
+	if (allowSimd && layout.packedNormals()) {
+		packVerticesSSE2(format, in, vertexCount, layout, dest);
+		return;
+	}
+#endif
+
+	packVerticesScalar(format, in, vertexCount, layout, dest);
+}
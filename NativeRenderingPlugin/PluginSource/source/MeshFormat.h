@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Vertex data handed to LiveMaterial::SetMeshInterleaved, and the layouts it
+// gets repacked into for the GPU.
+
+// Describes the caller's interleaved vertex buffer. Attributes are 32-bit
+// floats (position xyz, normal xyz, uv xy) at the given byte offsets within
+// each vertex; an offset of -1 means the attribute is absent and uploads as
+// zeros. Passed by pointer from C#, so keep it plain ints.
+struct VertexFormat {
+	int32_t stride;
+	int32_t positionOffset;
+	int32_t normalOffset;
+	int32_t uvOffset;
+	int32_t quantization; // MeshQuantization flags for the GPU copy
+};
+
+// Optional smaller GPU encodings. Half floats decode in the input assembler
+// and are invisible to shaders; the normal encodings have to be decoded by
+// the vertex shader:
+//   MeshQuantizeNormal1010102:  unorm, n = v.xyz * 2 - 1
+//   MeshQuantizeNormalOctahedral: snorm2, n = (v.x, v.y, 1 - |v.x| - |v.y|),
+//     with n.xy = (1 - |n.yx|) * sign(n.xy) where n.z < 0, then normalized
+enum MeshQuantization {
+	MeshQuantizeNone = 0,
+	MeshQuantizePositionHalf = 1 << 0, // half4 positions, w = 1
+	MeshQuantizeNormal1010102 = 1 << 1,
+	MeshQuantizeNormalOctahedral = 1 << 2, // wins if both normal flags are set
+	MeshQuantizeUVHalf = 1 << 3,
+};
+
+// Where each attribute lives in a GPU vertex for a set of quantization flags.
+struct MeshLayout {
+	uint32_t quantization;
+	uint32_t stride;
+	uint32_t positionOffset;
+	uint32_t normalOffset;
+	uint32_t uvOffset;
+
+	static MeshLayout forQuantization(uint32_t quantization);
+
+	bool halfPositions() const { return (quantization & MeshQuantizePositionHalf) != 0; }
+	bool octahedralNormals() const { return (quantization & MeshQuantizeNormalOctahedral) != 0; }
+	bool packedNormals() const { return !octahedralNormals() && (quantization & MeshQuantizeNormal1010102) != 0; }
+	bool halfUVs() const { return (quantization & MeshQuantizeUVHalf) != 0; }
+};
+
+// Why packVertices can't read a buffer described by format, or nullptr if it can.
+const char* vertexFormatError(const VertexFormat& format);
+
+// Repacks vertexCount vertices from src (described by format) into dest,
+// which must hold vertexCount * layout.stride bytes; a vertexCount below 1
+// writes nothing. Uses SSE2 for 10:10:10 normals where available, the one
+// conversion it speeds up, unless allowSimd is false (for benchmarking).
+void packVertices(const VertexFormat& format, const void* src, int vertexCount,
+	const MeshLayout& layout, unsigned char* dest, bool allowSimd = true);
+
+uint16_t floatToHalf(float value);
+uint32_t encodeNormal1010102(const float* normal);
+uint32_t encodeNormalOctahedral(const float* normal);
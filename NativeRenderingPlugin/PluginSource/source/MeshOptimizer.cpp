@@ -0,0 +1,179 @@
+#include "MeshOptimizer.h"
+
+#include <string.h>
+
+using std::vector;
+
+static const uint32_t kNone = ~0u;
+
+bool optimizeMesh(vector<unsigned char>& vertices, size_t stride, vector<uint32_t>& indices) {
+	if (stride == 0 || vertices.size() % stride != 0)
+		return false;
+	const size_t vertexCount = vertices.size() / stride;
+	if (vertexCount == 0 || vertexCount >= kNone)
+		return false;
+	if ((indices.empty() ? vertexCount : indices.size()) % 3 != 0)
+		return false;
+	for (size_t i = 0; i < indices.size(); ++i)
+		if (indices[i] >= vertexCount)
+			return false;
+
+	weldVertices(vertices, stride, indices);
+	optimizeVertexCache(indices, vertices.size() / stride);
+	optimizeVertexFetch(vertices, stride, indices);
+	return true;
+}
+
+static size_t hashVertex(const unsigned char* vertex, size_t stride) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < stride; ++i)
+		hash = (hash ^ vertex[i]) * 16777619u;
+	return hash;
+}
+
+void weldVertices(vector<unsigned char>& vertices, size_t stride, vector<uint32_t>& indices) {
+	const size_t vertexCount = vertices.size() / stride;
+
+	// Open addressing over the welded vertices, at most half full.
+	size_t tableSize = 2;
+	while (tableSize < vertexCount * 2)
+		tableSize <<= 1;
+	vector<uint32_t> table(tableSize, kNone);
+
+	vector<unsigned char> welded;
+	welded.reserve(vertices.size());
+	vector<uint32_t> remap(vertexCount);
+	uint32_t weldedCount = 0;
+	for (size_t v = 0; v < vertexCount; ++v) {
+		const unsigned char* vertex = &vertices[v * stride];
+		size_t slot = hashVertex(vertex, stride) & (tableSize - 1);
+		while (table[slot] != kNone && memcmp(&welded[table[slot] * stride], vertex, stride) != 0)
+			slot = (slot + 1) & (tableSize - 1);
+		if (table[slot] == kNone) {
+			table[slot] = weldedCount++;
+			welded.insert(welded.end(), vertex, vertex + stride);
+		}
+		remap[v] = table[slot];
+	}
+
+	vector<uint32_t> result(indices.empty() ? vertexCount : indices.size());
+	for (size_t i = 0; i < result.size(); ++i)
+		result[i] = remap[indices.empty() ? i : indices[i]];
+
+	vertices.swap(welded);
+	indices.swap(result);
+}
+
+void optimizeVertexCache(vector<uint32_t>& indices, size_t vertexCount, unsigned cacheSize) {
+	const size_t triangleCount = indices.size() / 3;
+	if (triangleCount == 0)
+		return;
+
+	// The triangles using each vertex, and how many of them are still to be emitted.
+	vector<uint32_t> live(vertexCount, 0);
+	for (size_t i = 0; i < indices.size(); ++i)
+		++live[indices[i]];
+	vector<uint32_t> offsets(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; ++v)
+		offsets[v + 1] = offsets[v] + live[v];
+	vector<uint32_t> adjacency(indices.size());
+	vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+	for (size_t i = 0; i < indices.size(); ++i)
+		adjacency[fill[indices[i]]++] = (uint32_t)(i / 3);
+
+	vector<uint32_t> cacheTime(vertexCount, 0);
+	vector<bool> emitted(triangleCount, false);
+	vector<uint32_t> deadEnds;
+	deadEnds.reserve(indices.size());
+	vector<uint32_t> candidates;
+	vector<uint32_t> result;
+	result.reserve(indices.size());
+
+	uint32_t time = cacheSize + 1;
+	size_t cursor = 0;
+	uint32_t fanning = 0;
+	while (fanning != kNone) {
+		// Emit every remaining triangle around the fanning vertex.
+		candidates.clear();
+		for (uint32_t a = offsets[fanning]; a < offsets[fanning + 1]; ++a) {
+			const uint32_t t = adjacency[a];
+			if (emitted[t])
+				continue;
+			for (int k = 0; k < 3; ++k) {
+				const uint32_t v = indices[t * 3 + k];
+				result.push_back(v);
+				deadEnds.push_back(v);
+				candidates.push_back(v);
+				--live[v];
+				if (time - cacheTime[v] > cacheSize)
+					cacheTime[v] = time++;
+			}
+			emitted[t] = true;
+		}
+
+		// Fan next around the oldest candidate that will still be cached
+		// once its remaining triangles are emitted.
+		uint32_t next = kNone;
+		int64_t bestPriority = -1;
+		for (size_t c = 0; c < candidates.size(); ++c) {
+			const uint32_t v = candidates[c];
+			if (!live[v])
+				continue;
+			int64_t priority = 0;
+			if (time - cacheTime[v] + 2 * live[v] <= cacheSize)
+				priority = time - cacheTime[v];
+			if (priority > bestPriority) {
+				bestPriority = priority;
+				next = v;
+			}
+		}
+
+		// Dead end: back up through recently emitted vertices, then scan.
+		while (next == kNone && !deadEnds.empty()) {
+			const uint32_t v = deadEnds.back();
+			deadEnds.pop_back();
+			if (live[v])
+				next = v;
+		}
+		while (next == kNone && cursor < vertexCount) {
+			if (live[cursor])
+				next = (uint32_t)cursor;
+			else
+				++cursor;
+		}
+		fanning = next;
+	}
+
+	indices.swap(result);
+}
+
+void optimizeVertexFetch(vector<unsigned char>& vertices, size_t stride, vector<uint32_t>& indices) {
+	vector<uint32_t> remap(vertices.size() / stride, kNone);
+	vector<unsigned char> ordered;
+	ordered.reserve(vertices.size());
+	uint32_t orderedCount = 0;
+	for (size_t i = 0; i < indices.size(); ++i) {
+		uint32_t& v = indices[i];
+		if (remap[v] == kNone) {
+			remap[v] = orderedCount++;
+			ordered.insert(ordered.end(), vertices.begin() + v * stride, vertices.begin() + (v + 1) * stride);
+		}
+		v = remap[v];
+	}
+	vertices.swap(ordered);
+}
+
+float averageCacheMissRatio(const vector<uint32_t>& indices, size_t vertexCount, unsigned cacheSize) {
+	if (indices.size() < 3)
+		return 0.0f;
+
+	// In a FIFO a vertex is cached until cacheSize more misses push it out.
+	vector<uint32_t> missedAt(vertexCount, kNone);
+	uint32_t misses = 0;
+	for (size_t i = 0; i < indices.size(); ++i) {
+		const uint32_t v = indices[i];
+		if (missedAt[v] == kNone || misses - missedAt[v] >= cacheSize)
+			missedAt[v] = misses++;
+	}
+	return misses / (float)(indices.size() / 3);
+}
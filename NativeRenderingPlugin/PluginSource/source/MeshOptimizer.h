@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Offline-style preprocessing for meshes handed to SetMesh*, run on the mesh
+// worker thread when RenderAPI::OptimizeMeshes is set. Vertices are opaque
+// blocks of stride bytes (already packed for the GPU); indices describe a
+// triangle list, or are empty when the vertices are one.
+
+// Welds, reorders triangles for the post-transform cache and then vertices for
+// fetch locality. Returns false, leaving everything untouched, if the input
+// isn't a valid triangle list.
+bool optimizeMesh(std::vector<unsigned char>& vertices, size_t stride, std::vector<uint32_t>& indices);
+
+// Merges byte-identical vertices and produces the index buffer for the result.
+void weldVertices(std::vector<unsigned char>& vertices, size_t stride, std::vector<uint32_t>& indices);
+
+// Reorders triangles for a post-transform vertex cache of about cacheSize
+// entries, using Tipsify (Sander, Nehab and Barczak, 2007). Linear time.
+void optimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount, unsigned cacheSize = 16);
+
+// Renumbers vertices in the order the indices first reach them, dropping any
+// that aren't referenced.
+void optimizeVertexFetch(std::vector<unsigned char>& vertices, size_t stride, std::vector<uint32_t>& indices);
+
+// Vertex shader invocations per triangle with a FIFO cache of cacheSize entries.
+float averageCacheMissRatio(const std::vector<uint32_t>& indices, size_t vertexCount, unsigned cacheSize = 16);
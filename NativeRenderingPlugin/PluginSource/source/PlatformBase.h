@@ -28,8 +28,11 @@
 
 
 
-// Which graphics device APIs we possibly support?
-#if UNITY_METRO
+// Which graphics device APIs we possibly support? UNITY_HEADLESS builds
+// without any, leaving only the Null backend (see projects/GNUMake).
+#if UNITY_HEADLESS
+	// no graphics libraries
+#elif UNITY_METRO
 	#define SUPPORT_D3D11 1
 	#if WINDOWS_UWP
 		#define SUPPORT_D3D12 1
@@ -0,0 +1,135 @@
+#include "Profiler.h"
+
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::vector;
+
+std::atomic<bool> profilerEnabled{ false };
+
+static const std::chrono::steady_clock::time_point profilerEpoch = std::chrono::steady_clock::now();
+
+uint64_t profilerNow() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - profilerEpoch).count();
+}
+
+struct ProfileEvent {
+	const char* name;
+	int materialId;
+	uint64_t start;
+	uint64_t end;
+};
+
+// One thread writes events and writeProfileTrace reads them, so head and
+// tail are all the synchronization needed. A full buffer drops new events.
+struct ProfileBuffer {
+	static const size_t kCapacity = 1 << 15;
+
+	ProfileEvent events[kCapacity];
+	std::atomic<size_t> head{ 0 }; // written by the owning thread
+	std::atomic<size_t> tail{ 0 }; // written by the reader
+	std::atomic<uint64_t> dropped{ 0 };
+	int threadId = 0;
+	string threadName; // under buffersMutex
+};
+
+// Buffers outlive their threads; a thread that exits leaves its last events
+// to be read, and the few worker threads are never replaced in bulk.
+static mutex buffersMutex;
+static vector<ProfileBuffer*> buffers;
+static thread_local ProfileBuffer* threadBuffer = nullptr;
+
+static ProfileBuffer* currentThreadBuffer() {
+	if (!threadBuffer) {
+		ProfileBuffer* buffer = new ProfileBuffer();
+		lock_guard<mutex> guard(buffersMutex);
+		buffer->threadId = (int)buffers.size() + 1;
+		buffers.push_back(buffer);
+		threadBuffer = buffer;
+	}
+	return threadBuffer;
+}
+
+void setProfilerEnabled(bool enabled) {
+	profilerEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+void setProfilerThreadName(const char* name) {
+	ProfileBuffer* buffer = currentThreadBuffer();
+	lock_guard<mutex> guard(buffersMutex);
+	buffer->threadName = name ? name : "";
+}
+
+void recordProfileEvent(const char* name, int materialId, uint64_t start, uint64_t end) {
+	ProfileBuffer* buffer = currentThreadBuffer();
+	const size_t head = buffer->head.load(std::memory_order_relaxed);
+	if (head - buffer->tail.load(std::memory_order_acquire) == ProfileBuffer::kCapacity) {
+		buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	ProfileEvent& event = buffer->events[head % ProfileBuffer::kCapacity];
+	event.name = name;
+	event.materialId = materialId;
+	event.start = start;
+	event.end = end;
+	buffer->head.store(head + 1, std::memory_order_release);
+}
+
+static void writeJSONString(FILE* file, const string& s) {
+	fputc('"', file);
+	for (size_t i = 0; i < s.size(); ++i) {
+		const unsigned char c = (unsigned char)s[i];
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+bool writeProfileTrace(const char* filename) {
+	FILE* file = fopen(filename, "w");
+	if (!file)
+		return false;
+
+	// Also keeps two callers from reading the same buffers at once.
+	lock_guard<mutex> guard(buffersMutex);
+	uint64_t dropped = 0;
+	bool first = true;
+	fprintf(file, "{\"traceEvents\":[");
+	for (size_t b = 0; b < buffers.size(); ++b) {
+		ProfileBuffer* buffer = buffers[b];
+		const string name = buffer->threadName.empty() ? "thread " + std::to_string(buffer->threadId) : buffer->threadName;
+		fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",", buffer->threadId);
+		writeJSONString(file, name);
+		fprintf(file, "}}");
+		first = false;
+
+		const size_t head = buffer->head.load(std::memory_order_acquire);
+		size_t tail = buffer->tail.load(std::memory_order_relaxed);
+		for (; tail != head; ++tail) {
+			const ProfileEvent& event = buffer->events[tail % ProfileBuffer::kCapacity];
+			fprintf(file, ",\n{\"name\":");
+			writeJSONString(file, event.name);
+			fprintf(file, ",\"cat\":\"livematerial\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+				event.start / 1000.0, (event.end - event.start) / 1000.0, buffer->threadId);
+			if (event.materialId >= 0)
+				fprintf(file, ",\"args\":{\"material\":%d}", event.materialId);
+			fprintf(file, "}");
+		}
+		buffer->tail.store(head, std::memory_order_release);
+		dropped += buffer->dropped.exchange(0, std::memory_order_relaxed);
+	}
+	fprintf(file, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":%llu}}\n", (unsigned long long)dropped);
+
+	const bool ok = !ferror(file);
+	return fclose(file) == 0 && ok;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Scoped CPU timing of the plugin's phases: drawing, shader updates,
+// reflection, uniform uploads and compiles. Each thread records into its
+// own fixed-size buffer without locking; writeProfileTrace drains them all
+// into a Chrome trace (chrome://tracing, or ui.perfetto.dev).
+//
+// While disabled a scope costs one relaxed load and a branch that's always
+// taken the same way.
+
+extern std::atomic<bool> profilerEnabled;
+
+void setProfilerEnabled(bool enabled);
+
+// Names the calling thread's track in the trace; threads not named are
+// numbered.
+void setProfilerThreadName(const char* name);
+
+// Writes every event recorded since the last call as trace_event JSON and
+// forgets them. False if the file couldn't be written.
+bool writeProfileTrace(const char* filename);
+
+uint64_t profilerNow(); // nanoseconds
+void recordProfileEvent(const char* name, int materialId, uint64_t start, uint64_t end);
+
+// Times the enclosing block. The name must be a string literal, or otherwise
+// outlive the trace.
+class ProfileScope {
+public:
+	explicit ProfileScope(const char* name, int materialId = -1) : _name(nullptr) {
+		if (profilerEnabled.load(std::memory_order_relaxed)) {
+			_name = name;
+			_materialId = materialId;
+			_start = profilerNow();
+		}
+	}
+
+	~ProfileScope() {
+		if (_name)
+			recordProfileEvent(_name, _materialId, _start, profilerNow());
+	}
+
+private:
+	ProfileScope(const ProfileScope&);
+	ProfileScope& operator=(const ProfileScope&);
+
+	const char* _name;
+	int _materialId;
+	uint64_t _start;
+};
@@ -1,9 +1,13 @@
 #include "RenderAPI.h"
 #include "PlatformBase.h"
+#include "MeshOptimizer.h"
+#include "Profiler.h"
 #include "Unity/IUnityGraphics.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 
 using std::endl;
 
@@ -26,36 +30,187 @@ const char* shaderTypeName(ShaderType shaderType) {
 	return nullptr;
 }
 
+UniformLayout::~UniformLayout() {
+	for (auto i = props.begin(); i != props.end(); ++i)
+		delete i->second;
+}
+
+ShaderProp* UniformLayout::find(const char* name) const {
+	auto i = props.find(name);
+	return i != props.end() ? i->second : nullptr;
+}
+
+// Derived from the props and texture slots, so equal layouts find equal ones.
+void UniformLayout::findTexelSizes() {
+	texelSizes.clear();
+	for (auto i = textureSlots.begin(); i != textureSlots.end(); ++i) {
+		auto prop = find((i->first + "_TexelSize").c_str());
+		if (prop && prop->type == PropType::Vector4 && prop->size > 0)
+			texelSizes.push_back(std::make_pair(i->second, prop));
+	}
+}
+
+bool UniformLayout::sameAs(const UniformLayout& other) const {
+	if (programHash != other.programHash ||
+		constantBufferSize != other.constantBufferSize ||
+		props.size() != other.props.size() ||
+		textureSlotCount != other.textureSlotCount ||
+		textureSlots != other.textureSlots)
+		return false;
+
+#if SUPPORT_OPENGL_UNIFIED || SUPPORT_OPENGL_LEGACY
+	// GL uniform locations belong to a program object, so they must match too.
+	if (textureUniformIndexes != other.textureUniformIndexes ||
+		imageSlots != other.imageSlots ||
+		imageUniformIndexes != other.imageUniformIndexes ||
+		storageBlockSlots != other.storageBlockSlots)
+		return false;
+#endif
+
+	for (auto i = props.begin(), j = other.props.begin(); i != props.end(); ++i, ++j) {
+		auto a = i->second;
+		auto b = j->second;
+		if (a->name != b->name || a->type != b->type || a->offset != b->offset ||
+			a->size != b->size || a->arraySize != b->arraySize)
+			return false;
+#if SUPPORT_OPENGL_UNIFIED || SUPPORT_OPENGL_LEGACY
+		if (a->uniformIndex != b->uniformIndex)
+			return false;
+#endif
+	}
+	return true;
+}
+
 LiveMaterial::LiveMaterial(RenderAPI* renderAPI, int id)
 	: _renderAPI(renderAPI)
 	, _id(id)
 {}
 
+LiveMaterial::~LiveMaterial() {
+	if (_gpuBuffer) delete[] _gpuBuffer;
+	destroyFeedbackTargets();
+}
+
 void LiveMaterial::SetDrawingEnabled(bool enabled) {
 	_drawingEnabled = enabled;
 }
 
 void LiveMaterial::SubmitUniforms(int uniformIndex) {
-	lock_guard<mutex> uniformsGuard(uniformsMutex);
-	lock_guard<mutex> gpuGuard(gpuMutex);
+	ProfileScope scope("SubmitUniforms", id());
+	lock_guard<InstrumentedMutex> uniformsGuard(uniformsMutex);
+	lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
 	assert(uniformIndex < MAX_GPU_BUFFERS);
+	ensureGpuBuffer();
 	if (_gpuBuffer && _constantBuffer) {
 		unsigned char* dest = _gpuBuffer + _constantBufferSize * uniformIndex;
-#if false
-		for (auto iter = shaderProps.begin(); iter != shaderProps.end(); ++iter) {
-			auto name = iter->first;
-			auto prop = iter->second;
-			if (0 != memcmp(dest + prop->offset, _constantBuffer + prop->offset, prop->arraySize * prop->size))
-				DebugSS("Changed prop " << name);
+		if (memcmp(dest, _constantBuffer, _constantBufferSize) != 0) {
+			memcpy(dest, _constantBuffer, _constantBufferSize);
+			_slotVersions[uniformIndex] = ++_inputVersion;
+		}
+	}
+}
+
+void LiveMaterial::SetResolutionBudget(float gpuMilliseconds, float minScale) {
+	_minResolutionScale = minScale;
+	_gpuBudgetMs = gpuMilliseconds;
+	touchInputs();
+}
+
+static const float kGpuTimeSmoothing = 0.1f; // weight of each new measurement
+
+bool LiveMaterial::gpuTimingWanted() const {
+	return _renderAPI->measureGpuTime() || _gpuBudgetMs > 0.0f;
+}
 
+void LiveMaterial::recordGpuTime(float milliseconds) {
+	_gpuTimeMs = _gpuTimeMs < 0.0f ? milliseconds : _gpuTimeMs + (milliseconds - _gpuTimeMs) * kGpuTimeSmoothing;
+	++_gpuTimeSamples;
+	_stats.gpuTimeMs = _gpuTimeMs;
+	_stats.gpuTimeSamples = _gpuTimeSamples;
+}
+
+static const float kResolutionScaleStep = 1.0f / 16.0f;
+static const int kAutoScaleInterval = 8; // measurements between changes, so lagging timings can catch up
+
+bool LiveMaterial::reducedResolution(int width, int height, RenderTargetDesc& desc) {
+	float scale = _resolutionScale;
+	const float budget = _gpuBudgetMs;
+	if (budget > 0.0f) {
+		if (_gpuTimeSamples != _gpuTimeSamplesSeen) {
+			_gpuTimeSamplesSeen = _gpuTimeSamples;
+			if (++_measurementsSinceScaled >= kAutoScaleInterval) {
+				// Cost goes with pixel count, so step the scale by its square root.
+				const float ratio = budget / _gpuTimeMs;
+				if (ratio < 1.0f || ratio > 2.0f) {
+					_autoScale *= std::max(0.5f, std::min(1.25f, sqrtf(ratio)));
+					_measurementsSinceScaled = 0;
+				}
+			}
 		}
-#endif
-		memcpy(dest, _constantBuffer, _constantBufferSize);
+		_autoScale = std::max((float)_minResolutionScale, std::min(scale, _autoScale));
+		scale = _autoScale;
 	}
+
+	// Quantized, so the pool sees the same few sizes rather than a new one each frame.
+	scale = std::max(kResolutionScaleStep, floorf(scale / kResolutionScaleStep + 0.5f) * kResolutionScaleStep);
+	if (scale >= 1.0f)
+		return false;
+	desc = RenderTargetDesc(std::max(1, (int)(width * scale + 0.5f)), std::max(1, (int)(height * scale + 0.5f)), RenderTargetRGBA16F);
+	return true;
+}
+
+void LiveMaterial::SetTemporalAmortization(int phases) {
+	if (phases != 1 && phases != 2 && phases != 4) {
+		if (_renderAPI->showWarnings())
+			DebugWarning("temporal amortization takes 1, 2 or 4 phases, not " << phases << " (id=" << id() << ")");
+		phases = 1;
+	}
+	_amortizationPhases = phases;
+	touchInputs();
+}
+
+int LiveMaterial::amortizationPhase(int* phases) {
+	*phases = _amortizationPhases;
+	if (*phases <= 1)
+		return _drawPhase = -1;
+	_drawPhase = (int)(_amortizationDraws++ % (unsigned)*phases);
+	return _drawPhase;
+}
+
+void LiveMaterial::touchInputs() {
+	_resourceVersion = ++_inputVersion;
+	// Textures, samplers and targets are part of the instance key.
+	if (_instancingEnabled)
+		_renderAPI->instanceGroupsChanged();
+}
+
+bool LiveMaterial::drawIsCached(int uniformIndex) {
+	// Amortized draws only converge over several, so they're never skipped.
+	if (!_staticUntilChanged || _graphTarget || !_feedbackSampler.empty() || _amortizationPhases > 1)
+		return false;
+
+	uint64_t slotVersion;
+	{
+		lock_guard<InstrumentedMutex> guard(gpuMutex);
+		slotVersion = _slotVersions[uniformIndex];
+	}
+	const uint64_t resourceVersion = _resourceVersion;
+	const uint64_t textureGeneration = _renderAPI->textureGeneration();
+	if (slotVersion == _drawnSlotVersion && resourceVersion == _drawnResourceVersion &&
+		_programGeneration == _drawnProgramGeneration && textureGeneration == _drawnTextureGeneration) {
+		++_stats.skippedDraws;
+		return true;
+	}
+
+	_drawnSlotVersion = slotVersion;
+	_drawnResourceVersion = resourceVersion;
+	_drawnProgramGeneration = _programGeneration;
+	_drawnTextureGeneration = textureGeneration;
+	return false;
 }
 
 void LiveMaterial::setproparray(const char* name, PropType type, float* value, int numElems) {
-    lock_guard<mutex> guard(uniformsMutex);
+    lock_guard<InstrumentedMutex> guard(uniformsMutex);
 
     if (!_constantBuffer || numElems < 1) return;
 
@@ -66,11 +221,12 @@ void LiveMaterial::setproparray(const char* name, PropType type, float* value, i
 	if (numElems > 1) {
 		//DebugSS("setproparray(" << name << ", " << propTypeStrings[type] << ", " << value << ", " << numElems << ") is copying " << bytesToCopy << " bytes.");
 	}
+	ensureConstantBufferUnique();
 	memcpy(_constantBuffer + prop->offset, value, bytesToCopy);
 }
 
 void LiveMaterial::getproparray(const char* name, PropType type, float* value, int numElems) {
-	lock_guard<mutex> guard(uniformsMutex);
+	lock_guard<InstrumentedMutex> guard(uniformsMutex);
 	getproparray_locked(name, type, value, numElems);
 }
 
@@ -86,6 +242,96 @@ void LiveMaterial::getproparray_locked(const char* name, PropType type, float* v
 
 void LiveMaterial::Draw(int uniformIndex) { }
 
+void LiveMaterial::SetInstancingEnabled(bool enabled) {
+	if (_instancingEnabled == enabled)
+		return;
+	_instancingEnabled = enabled;
+	_renderAPI->instanceGroupsChanged();
+}
+
+bool LiveMaterial::instanceKey(InstanceKey* key) {
+	if (!_instancingEnabled)
+		return false;
+	{
+		lock_guard<InstrumentedMutex> guard(uniformsMutex);
+		if (!_layout || !_programSource)
+			return false;
+		key->programHash = _layout->programHash;
+		key->program = _programSource;
+	}
+	{
+		// The instanced draw goes wherever the leader draws, so a material
+		// with a target of its own has to draw itself.
+		lock_guard<InstrumentedMutex> guard(texturesMutex);
+		if (_renderTextureSource || !_feedbackSamplerSource.empty() || !_graphOutput.empty())
+			return false;
+		key->textures.clear();
+		for (auto i = _textureSources.begin(); i != _textureSources.end(); ++i)
+			key->textures[i->first] = i->second.second;
+		key->samplers = _samplerDescs;
+	}
+	key->meshKey = _meshKey;
+	key->parentId = _parentId;
+	return true;
+}
+
+size_t LiveMaterial::instanceStride() const {
+	// Instance blocks are read back as float4s, so pad each one to 16 bytes.
+	return (_constantBufferSize + 15) & ~(size_t)15;
+}
+
+bool LiveMaterial::appendInstanceData(int uniformIndex, size_t stride, vector<unsigned char>& data) {
+	lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+	assert(uniformIndex < MAX_GPU_BUFFERS);
+	if (!_gpuBuffer || instanceStride() != stride)
+		return false; // not compiled yet, or compiled to a different layout
+
+	size_t start = data.size();
+	data.resize(start + stride, 0);
+	memcpy(&data[start], _gpuBuffer + _constantBufferSize * uniformIndex, _constantBufferSize);
+	return true;
+}
+
+bool LiveMaterial::DrawInstanced(int uniformIndex, const unsigned char* instanceData, int instanceCount, size_t stride) {
+	return false;
+}
+
+void LiveMaterial::setBuiltinFloat(unsigned char* block, const char* name, float value) {
+	// Plugin-provided uniforms are optional; only write them if the shader declares one.
+	auto prop = _layout ? _layout->find(name) : nullptr;
+	if (!prop || prop->type != PropType::Float || prop->size == 0)
+		return;
+	memcpy(block + prop->offset, &value, sizeof(float));
+}
+
+void LiveMaterial::writeTexelSizes(unsigned char* block, const vector<TextureInfo>& textures) {
+	if (!_layout)
+		return;
+	for (auto i = _layout->texelSizes.begin(); i != _layout->texelSizes.end(); ++i) {
+		if (i->first >= textures.size() || textures[i->first].width <= 0)
+			continue;
+		const TextureInfo& texture = textures[i->first];
+		const float texelSize[4] = { 1.0f / texture.width, 1.0f / texture.height, (float)texture.width, (float)texture.height };
+		memcpy(block + i->second->offset, texelSize, sizeof(texelSize));
+	}
+}
+
+const unsigned char* LiveMaterial::drawBlock(int uniformIndex, const vector<TextureInfo>& textures) {
+	assert(uniformIndex < MAX_GPU_BUFFERS);
+	if (!_gpuBuffer)
+		return nullptr;
+
+	const unsigned char* slot = _gpuBuffer + _constantBufferSize * uniformIndex;
+	_drawBlock.assign(slot, slot + _constantBufferSize);
+	unsigned char* block = _drawBlock.data();
+	writeTexelSizes(block, textures);
+	if (_drawPhase >= 0)
+		setBuiltinFloat(block, "_LivePhase", (float)_drawPhase);
+	if (_drawInstanceStride > 0)
+		setBuiltinFloat(block, "_LiveInstanceStride", (float)(_drawInstanceStride / 16));
+	return block;
+}
+
 bool LiveMaterial::NeedsRender()
 {
 	return false;
@@ -108,25 +354,28 @@ void LiveMaterial::SetMatrixArray(const char* name, float* values, int numMatric
 }
 
 
+// Scripts set their textures every frame, so only an actual change may count
+// as a new input; otherwise static until changed never skips a textured draw.
+bool LiveMaterial::textureSourceChanged(const char* name, int id, void* nativeTexturePointer) {
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	auto& source = _textureSources[name];
+	if (source.first == id && source.second == nativeTexturePointer)
+		return false;
+	source = std::make_pair(id, nativeTexturePointer);
+	return true;
+}
+
 bool LiveMaterial::SetTextureID(const char * name, int id)
 {
-	if (!id) {
-		_SetTexture(name, nullptr);
-		return false;
-	}
-	
 	void* nativeTexturePointer = nullptr;
-	{
-		lock_guard<mutex> guard(texturesMutex);
-
-		auto iter = texturePointers.find(id);
-		if (iter == texturePointers.end())
+	if (id) {
+		nativeTexturePointer = _renderAPI->FindTexturePointer(id);
+		if (!nativeTexturePointer)
 			return true; // needs pointer. caller will do expensive GetNativeTexturePtr
-
-		nativeTexturePointer = iter->second;
-		assert(nativeTexturePointer);
 	}
 
+	if (textureSourceChanged(name, id, nativeTexturePointer))
+		touchInputs();
 	_SetTexture(name, nativeTexturePointer);
 	return false;
 }
@@ -134,8 +383,7 @@ bool LiveMaterial::SetTextureID(const char * name, int id)
 void LiveMaterial::SetTexturePtr(const char * name, int id, void * nativeTexturePointer)
 {
 	assert(id);
-	assert(texturePointers.find(id) == texturePointers.end());
-	texturePointers[id] = nativeTexturePointer;
+	_renderAPI->SetTexturePointer(id, nativeTexturePointer);
 	bool needsSet = SetTextureID(name, id);
 	assert(!needsSet);
 }
@@ -144,32 +392,129 @@ void LiveMaterial::_SetTexture(const char* name, void* nativeTexturePointer) {
 	assert(false);
 }
 
+void LiveMaterial::SetSampler(const char* name, const SamplerDesc& desc) {
+	SamplerDesc valid = desc;
+	if (valid.filter < 0 || valid.filter >= SamplerFilterCount) valid.filter = SamplerTrilinear;
+	if (valid.wrap < 0 || valid.wrap >= SamplerWrapCount) valid.wrap = SamplerRepeat; // e.g. Unity's MirrorOnce
+	valid.anisotropy = std::min(std::max(valid.anisotropy, 1), 16);
+
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	auto i = _samplerDescs.find(name);
+	if (i != _samplerDescs.end() && !(i->second < valid) && !(valid < i->second))
+		return;
+	_samplerDescs[name] = valid;
+	++_samplersVersion;
+	touchInputs();
+}
+
+bool LiveMaterial::samplerSetFor(const string& name, SamplerDesc* desc) const {
+	auto i = _samplerDescs.find(name);
+	if (i == _samplerDescs.end())
+		return false;
+	*desc = i->second;
+	return true;
+}
+
 void LiveMaterial::SetRenderTexture(void* nativeTexturePointer) {
 	assert(false);
 }
 
-void LiveMaterial::GetFloat(const char * name, float* value) { getproparray(name, PropType::Float, value, 1); }
-void LiveMaterial::GetVector4(const char* name, float* value) { getproparray(name, PropType::Vector4, value, 1); }
-void LiveMaterial::GetMatrix(const char* name, float* value) { getproparray(name, PropType::Vector4, value, 1); }
+void LiveMaterial::SetFeedback(const char* samplerName, int width, int height, int format) {
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	_feedbackSamplerSource = samplerName ? samplerName : "";
+	_feedbackDescSource = RenderTargetDesc(width, height, (RenderTargetFormat)format);
+	_feedbackPending = true;
+	touchInputs();
+}
 
-static ShaderProp* _lookupPropByName(const PropMap& props, const char* name) {
-	auto i = props.find(name);
-	return i != props.end() ? i->second : nullptr;
+RenderTarget* LiveMaterial::beginFeedback(RenderTarget** previous) {
+	string samplerName;
+	RenderTargetDesc desc;
+	bool pending = false;
+	{
+		lock_guard<InstrumentedMutex> guard(texturesMutex);
+		std::swap(pending, _feedbackPending);
+		if (pending) {
+			samplerName = _feedbackSamplerSource;
+			desc = _feedbackDescSource;
+		}
+	}
+
+	if (pending) {
+		destroyFeedbackTargets();
+		_feedbackSampler = samplerName;
+		if (!samplerName.empty()) {
+			_feedback[0] = _renderAPI->CreateRenderTarget(desc);
+			_feedback[1] = _feedback[0] ? _renderAPI->CreateRenderTarget(desc) : nullptr;
+			if (!_feedback[1])
+				destroyFeedbackTargets();
+		}
+	}
+
+	*previous = _feedback[_feedbackWrite ^ 1];
+	return _feedback[_feedbackWrite];
 }
 
+void LiveMaterial::SetGraphOutput(const char* name, int width, int height, int format) {
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	_graphOutput = name ? name : "";
+	_graphOutputDesc = RenderTargetDesc(width, height, (RenderTargetFormat)format);
+	touchInputs();
+}
+
+void LiveMaterial::SetGraphInput(const char* samplerName, const char* outputName) {
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	if (outputName && *outputName)
+		_graphInputs[samplerName] = outputName;
+	else
+		_graphInputs.erase(samplerName);
+	touchInputs();
+}
+
+bool LiveMaterial::getGraphNode(string& output, RenderTargetDesc& outputDesc, map<string, string>& inputs) {
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	output = _graphOutput;
+	outputDesc = _graphOutputDesc;
+	inputs = _graphInputs;
+	return !output.empty() || !inputs.empty();
+}
+
+void LiveMaterial::DrawGraphPass(int uniformIndex, RenderTarget* target, const GraphTextures& textures) {
+	_graphTarget = target;
+	_graphTextures = &textures;
+	Draw(uniformIndex);
+	_graphTarget = nullptr;
+	_graphTextures = nullptr;
+}
+
+void LiveMaterial::destroyFeedbackTargets() {
+	SAFE_DELETE(_feedback[0]);
+	SAFE_DELETE(_feedback[1]);
+	_feedbackWrite = 0;
+}
+
+void LiveMaterial::GetFloat(const char * name, float* value) { getproparray(name, PropType::Float, value, 1); }
+void LiveMaterial::GetVector4(const char* name, float* value) { getproparray(name, PropType::Vector4, value, 1); }
+void LiveMaterial::GetMatrix(const char* name, float* value) { getproparray(name, PropType::Matrix, value, 1); }
+
 void LiveMaterial::SetDepthWritesEnabled(bool enabled) {
 }
 
 bool LiveMaterial::HasProperty(const char* name) {
-	lock_guard<mutex> guard(uniformsMutex);
-	return _lookupPropByName(shaderProps, name) != nullptr;
+	lock_guard<InstrumentedMutex> guard(uniformsMutex);
+	return _layout && _layout->find(name) != nullptr;
 }
 
 void LiveMaterial::DumpUniformsToFile(const char* filename, bool flatten) {
-	lock_guard<mutex> guard(uniformsMutex);
+	lock_guard<InstrumentedMutex> guard(uniformsMutex);
     std::ofstream js(filename);
     js << "{" << endl;
-    for (auto i = shaderProps.begin(); i != shaderProps.end(); ++i) {
+    if (!_layout) {
+        js << "}" << endl;
+        return;
+    }
+    const PropMap& props = _layout->props;
+    for (auto i = props.begin(); i != props.end(); ++i) {
         auto prop = i->second;
 
 		if (prop->size == 0)
@@ -211,7 +556,7 @@ void LiveMaterial::DumpUniformsToFile(const char* filename, bool flatten) {
 
         auto nexti = i;
         nexti++;
-        if (nexti != shaderProps.end())
+        if (nexti != props.end())
           js << ", ";
 
         js << "\n";
@@ -220,46 +565,16 @@ void LiveMaterial::DumpUniformsToFile(const char* filename, bool flatten) {
     js << "}" << endl;
 }
 
-ShaderProp * LiveMaterial::propForNameSizeOffset(const char * name, uint16_t size, uint16_t offset) {
-	auto prop = _lookupPropByName(shaderProps, name);
-	if (!prop || prop->size != size || prop->offset != offset) {
-		if (prop)
-			DebugSS("WARNING: deleting prop named " << prop->name);
-		SAFE_DELETE(prop);
-		auto type = ShaderProp::typeForSize(size);
-		int arraySize = 1;
-		if (type == FloatBlock) {
-			arraySize = size / sizeof(float);
-			size = sizeof(float);
-			type = PropType::Float;
-		}
-		prop = shaderProps[name] = new ShaderProp(type, name);
-		prop->size = size;
-		prop->arraySize = arraySize;
-		prop->offset = offset;
-	}
-	else {
-		assert(prop->size == size);
-		assert(prop->offset == offset);
-	}
-
-	return prop;
-}
-
 ShaderProp * LiveMaterial::propForName(const char * name, PropType type)
 {
-	auto prop = _lookupPropByName(shaderProps, name);
-	if (!prop || (prop->type != type && type != PropType::FloatBlock)) {
-		if (prop)
-			DebugSS("WARNING: deleting prop named " << prop->name);
-		SAFE_DELETE(prop);
-		prop = shaderProps[name] = new ShaderProp(type, name);
-	}
-	//assert(prop->type == type);
+	// Layouts are immutable; names the shader doesn't declare are ignored.
+	auto prop = _layout ? _layout->find(name) : nullptr;
+	if (prop && prop->type != type && type != PropType::FloatBlock)
+		return nullptr;
 	return prop;
 }
 
-static void copyProps(PropMap* oldProps, PropMap* newProps, unsigned char* oldBuffer, unsigned char* newBuffer) {
+static void copyProps(const PropMap* oldProps, const PropMap* newProps, unsigned char* oldBuffer, unsigned char* newBuffer) {
 	for (auto i = oldProps->begin(); i != oldProps->end(); ++i) {
 		auto oldProp = i->second;
 		auto newPropI = newProps->find(oldProp->name);
@@ -277,46 +592,174 @@ static void copyProps(PropMap* oldProps, PropMap* newProps, unsigned char* oldBu
 }
 
 
-void LiveMaterial::ensureConstantBufferSize(size_t size, PropMap* oldProps, PropMap* newProps) {
+void LiveMaterial::ensureConstantBufferSize(size_t size, const UniformLayout* oldLayout, const UniformLayout* newLayout) {
 	// must have GUARD_UNIFORMS and GUARD_GPU
 
+	auto oldConstantBlock = _constantBlock;
 	auto oldConstantBuffer = _constantBuffer;
 	auto oldGpuBuffer = _gpuBuffer;
 	auto oldConstantBufferSize = _constantBufferSize;
 
-	_constantBuffer = new unsigned char[size];
+	_constantBlock = std::make_shared<vector<unsigned char>>(size, (unsigned char)0);
+	_constantBuffer = _constantBlock->data();
 	_gpuBuffer = new unsigned char[size * MAX_GPU_BUFFERS];
 	_constantBufferSize = size;
 
-    memset(_constantBuffer, 0, size);
     memset(_gpuBuffer, 0, size * MAX_GPU_BUFFERS);		
 
 	// If we have references to the old props, we can copy the values over to keep rendering
 	// relatively smooth.
-	if (oldProps && newProps) {
-		copyProps(oldProps, newProps, oldConstantBuffer, _constantBuffer);
-		for (int i = 0; i < MAX_GPU_BUFFERS; ++i)
-			copyProps(oldProps, newProps, oldGpuBuffer + oldConstantBufferSize * i, _gpuBuffer + _constantBufferSize * i);
+	if (oldLayout && newLayout) {
+		if (oldConstantBuffer)
+			copyProps(&oldLayout->props, &newLayout->props, oldConstantBuffer, _constantBuffer);
+		if (oldGpuBuffer)
+			for (int i = 0; i < MAX_GPU_BUFFERS; ++i)
+				copyProps(&oldLayout->props, &newLayout->props, oldGpuBuffer + oldConstantBufferSize * i, _gpuBuffer + _constantBufferSize * i);
 	}
 
-	if (oldConstantBuffer) delete[] oldConstantBuffer;
 	if (oldGpuBuffer) delete[] oldGpuBuffer;
 }
 
+void LiveMaterial::setLayout(UniformLayoutRef layout) {
+	// must have GUARD_UNIFORMS and GUARD_GPU
+	if (layout == _layout)
+		return; // recompiled to an identical layout; keep our values as they are
+	ensureConstantBufferSize(layout ? layout->constantBufferSize : 0, _layout.get(), layout.get());
+	_layout = layout;
+	if (_instancingEnabled)
+		_renderAPI->instanceGroupsChanged(); // the layout's program hash is part of the instance key
+}
+
+UniformLayoutRef LiveMaterial::currentLayout() {
+	lock_guard<InstrumentedMutex> guard(uniformsMutex);
+	return _layout;
+}
+
+void LiveMaterial::ensureConstantBufferUnique() {
+	// must have GUARD_UNIFORMS
+	if (_constantBlock && _constantBlock.use_count() > 1) {
+		_constantBlock = std::make_shared<vector<unsigned char>>(*_constantBlock);
+		_constantBuffer = _constantBlock->data();
+	}
+}
+
+void LiveMaterial::ensureGpuBuffer() {
+	// must have GUARD_GPU. Clones only allocate their GPU copies once they submit.
+	if (!_gpuBuffer && _constantBufferSize > 0) {
+		_gpuBuffer = new unsigned char[_constantBufferSize * MAX_GPU_BUFFERS];
+		memset(_gpuBuffer, 0, _constantBufferSize * MAX_GPU_BUFFERS);
+	}
+}
+
+void LiveMaterial::_CopyFrom(LiveMaterial* parent) {
+	{
+		lock_guard<InstrumentedMutex> guard(parent->uniformsMutex);
+		_layout = parent->_layout;
+		_constantBlock = parent->_constantBlock;
+		_constantBuffer = parent->_constantBuffer;
+		_constantBufferSize = parent->_constantBufferSize;
+		_programSource = parent->_programSource;
+	}
+
+	{
+		lock_guard<InstrumentedMutex> guard(parent->texturesMutex);
+		computeBuffers = parent->computeBuffers;
+		computeImages = parent->computeImages;
+		_feedbackSamplerSource = parent->_feedbackSamplerSource;
+		_feedbackDescSource = parent->_feedbackDescSource;
+		_feedbackPending = !_feedbackSamplerSource.empty();
+	}
+
+	{
+		lock_guard<InstrumentedMutex> guard(parent->meshMutex);
+		meshSource = parent->meshSource;
+		_meshPending = meshSource != nullptr;
+		_meshKey = parent->_meshKey.load();
+	}
+
+	_stats = parent->_stats;
+	_drawingEnabled = parent->_drawingEnabled;
+	_instancingEnabled = parent->_instancingEnabled;
+	_parentId = parent->id();
+}
+
+void LiveMaterial::syncWithParent() {
+	// Render thread only, with materialsMutex held.
+	if (!_parentId)
+		return;
+
+	auto parent = _renderAPI->GetLiveMaterialByIdLocked(_parentId);
+	if (!parent) {
+		_parentId = 0; // parent was destroyed; keep what we have
+		return;
+	}
+
+	parent->syncWithParent();
+	if (parent->_programGeneration == _adoptedGeneration)
+		return;
+
+	_AdoptProgram(parent);
+	_adoptedGeneration = parent->_programGeneration;
+	++_programGeneration;
+}
+
+void LiveMaterial::_AdoptProgram(LiveMaterial* parent) {
+	lock_guard<InstrumentedMutex> parentGuard(parent->uniformsMutex);
+	lock_guard<InstrumentedMutex> uniformsGuard(uniformsMutex);
+	lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+	_programSource = parent->_programSource;
+	if (_instancingEnabled)
+		_renderAPI->instanceGroupsChanged();
+	if (_layout == parent->_layout)
+		return;
+
+	if (_constantBlock == nullptr || _constantBlock.use_count() > 1) {
+		// Never written; keep sharing whatever the parent has now.
+		_layout = parent->_layout;
+		_constantBlock = parent->_constantBlock;
+		_constantBuffer = parent->_constantBuffer;
+		_constantBufferSize = parent->_constantBufferSize;
+		if (_gpuBuffer) delete[] _gpuBuffer;
+		_gpuBuffer = nullptr;
+	} else {
+		auto layout = parent->_layout;
+		ensureConstantBufferSize(layout ? layout->constantBufferSize : 0, _layout.get(), layout.get());
+		_layout = layout;
+	}
+}
+
 LiveMaterial* RenderAPI::CreateLiveMaterial() {
-	lock_guard<mutex> guard(materialsMutex);
+	lock_guard<InstrumentedMutex> guard(materialsMutex);
+	return _createLiveMaterialLocked();
+}
+
+LiveMaterial* RenderAPI::_createLiveMaterialLocked() {
 	++liveMaterialCount;
 
 	// Wrap around at 16 bits; the C# side packs the LiveMaterial's id
 	// into half an int when rendering (the other half is the uniform index).
 	if (liveMaterialCount > std::numeric_limits<int16_t>::max())
-		liveMaterialCount = 0;
+		liveMaterialCount = 1;
 
 	auto id = liveMaterialCount;
 	assert(id > 0);
 	auto liveMaterial = _newLiveMaterial(id);
 	assert(liveMaterials.find(id) == liveMaterials.end());
 	liveMaterials[id] = liveMaterial;
+	instanceGroupsChanged();
+	return liveMaterial;
+}
+
+LiveMaterial* RenderAPI::CloneLiveMaterial(int parentId) {
+	lock_guard<InstrumentedMutex> guard(materialsMutex);
+	auto parent = GetLiveMaterialByIdLocked(parentId);
+	if (!parent)
+		return nullptr;
+
+	// No compile or reflection here; the clone picks up the parent's GPU
+	// objects on the render thread the first time it's drawn.
+	auto liveMaterial = _createLiveMaterialLocked();
+	liveMaterial->_CopyFrom(parent);
 	return liveMaterial;
 }
 
@@ -339,6 +782,9 @@ void LiveMaterial::SetShaderSource(
 
 	extern string GetShaderIncludePath();
 
+	// Giving a clone its own source detaches it from its parent's program.
+	_parentId = 0;
+
 	if (fragSrc && strlen(fragSrc) > 0) {
 		CompileTask task;
 		task.quitting = false;
@@ -363,12 +809,24 @@ void LiveMaterial::SetShaderSource(
 		tasks.push_back(task);
 	}
 
+	{
+		// Separated by nulls, which none of them contain.
+		auto program = std::make_shared<string>(fragSrc ? fragSrc : "");
+		for (auto part : { fragEntry, vertSrc, vertEntry }) {
+			program->push_back('\0');
+			program->append(part ? part : "");
+		}
+		lock_guard<InstrumentedMutex> guard(uniformsMutex);
+		_programSource = program;
+	}
+	_renderAPI->instanceGroupsChanged();
+
 	if (tasks.size() > 0) {
-		Debug("setting state to Compiling");
+		DebugVerbose("setting state to Compiling");
 		_stats.compileState = CompileState::Compiling;
 	}
 	else {
-		Debug("WARNING: no tasks in SetShaderSource");
+		DebugWarning("no tasks in SetShaderSource");
 	}
 
 	_QueueCompileTasks(tasks);
@@ -380,7 +838,16 @@ void LiveMaterial::_QueueCompileTasks(vector<CompileTask> compileTasks) {
 }
 
 void LiveMaterial::SetMesh(int vertexCount, float* vertices, float* normals, float* uvs) {
-	mesh.resize(vertexCount);
+	SetMeshIndexed(vertexCount, vertices, normals, uvs, 0, nullptr);
+}
+
+void LiveMaterial::SetMeshIndexed(int vertexCount, float* vertices, float* normals, float* uvs, int indexCount, int* indices) {
+	if (vertexCount < 0) {
+		DebugError("SetMesh: negative vertex count " << vertexCount);
+		return;
+	}
+	vector<unsigned char> packed(vertexCount * sizeof(MeshVertex));
+	MeshVertex* mesh = (MeshVertex*)packed.data();
 	for (int i = 0; i < vertexCount; ++i) {
 		MeshVertex& v = mesh[i];
 		v.pos[0] = vertices[0];
@@ -395,16 +862,132 @@ void LiveMaterial::SetMesh(int vertexCount, float* vertices, float* normals, flo
 		normals += 3;
 		uvs += 2;
 	}
+
+	setPendingMesh(packed, MeshLayout::forQuantization(MeshQuantizeNone), indexCount, indices);
+}
+
+void LiveMaterial::SetMeshInterleaved(const void* vertices, int vertexCount, const VertexFormat& format, int indexCount, const int* indices) {
+	auto error = vertexCount < 0 ? "negative vertex count" : vertexFormatError(format);
+	if (error) {
+		DebugError("SetMeshInterleaved: " << error);
+		return;
+	}
+
+	// Repack outside the lock; this is the expensive part for big meshes.
+	auto layout = MeshLayout::forQuantization(format.quantization);
+	vector<unsigned char> packed((size_t)vertexCount * layout.stride);
+	packVertices(format, vertices, vertexCount, layout, packed.data());
+	setPendingMesh(packed, layout, indexCount, indices);
+}
+
+// 64-bit FNV-1a, a word at a time; good enough to key the mesh registry,
+// which compares contents on a match anyway.
+static uint64_t hashBytes(const void* data, size_t size, uint64_t hash) {
+	const uint64_t prime = 0x100000001b3ull;
+	const unsigned char* bytes = (const unsigned char*)data;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * prime;
+	}
+	for (; i < size; ++i)
+		hash = (hash ^ bytes[i]) * prime;
+	return hash;
+}
+
+// Indices go straight to glDrawElements and DrawIndexed, so a bad one is an
+// out of bounds read on the GPU rather than a wrong triangle.
+static const char* indicesError(int indexCount, const int* indices, size_t vertexCount) {
+	if (!indices)
+		return nullptr;
+	if (indexCount < 0 || indexCount % 3 != 0)
+		return "the index count isn't a multiple of 3";
+	for (int i = 0; i < indexCount; ++i)
+		if (indices[i] < 0 || (size_t)indices[i] >= vertexCount)
+			return "an index is out of range of the vertices";
+	return nullptr;
+}
+
+void LiveMaterial::setPendingMesh(vector<unsigned char>& vertices, const MeshLayout& layout, int indexCount, const int* indices) {
+	auto error = indicesError(indexCount, indices, vertices.size() / layout.stride);
+	if (error) {
+		DebugError("SetMesh: " << error << "; keeping the previous mesh");
+		return;
+	}
+
+	MeshRef mesh;
+	if (!vertices.empty()) {
+		auto data = new MeshData();
+		data->layout = layout;
+		data->vertexCount = (uint32_t)(vertices.size() / layout.stride);
+		data->vertices.swap(vertices);
+		data->indices.assign(indices, indices + (indices ? indexCount : 0));
+		data->updateHash();
+
+		if (_renderAPI->optimizeMeshes())
+			mesh = _renderAPI->FindOptimizedMesh(data->hash);
+		if (mesh) {
+			delete data;
+		} else {
+			mesh = _renderAPI->InternMesh(data);
+			if (_renderAPI->optimizeMeshes())
+				_renderAPI->QueueMeshOptimization(mesh);
+		}
+	}
+
+	lock_guard<InstrumentedMutex> guard(meshMutex);
+	_meshPending = true;
+	_meshKey = mesh ? mesh->hash : 0;
+	meshSource = mesh;
+	touchInputs();
+	_renderAPI->instanceGroupsChanged();
+}
+
+void LiveMaterial::replaceMesh(const MeshRef& mesh, const MeshRef& replacement) {
+	lock_guard<InstrumentedMutex> guard(meshMutex);
+	if (meshSource != mesh || mesh == replacement)
+		return;
+	_meshPending = true;
+	_meshKey = replacement->hash;
+	meshSource = replacement;
+	_renderAPI->instanceGroupsChanged();
+}
+
+bool LiveMaterial::takePendingMesh(MeshRef& mesh) {
+	// Render thread
+	lock_guard<InstrumentedMutex> guard(meshMutex);
+	if (!_meshPending)
+		return false;
+	_meshPending = false;
+	mesh = meshSource;
+	return true;
+}
+
+void MeshData::updateHash() {
+	uint64_t h = hashBytes(&layout.quantization, sizeof(layout.quantization), 0xcbf29ce484222325ull);
+	h = hashBytes(vertices.data(), vertices.size(), h);
+	h = hashBytes(indices.data(), indices.size() * sizeof(uint32_t), h);
+	hash = h ? (size_t)h : 1; // 0 means no mesh
+}
+
+bool MeshData::sameAs(const MeshData& other) const {
+	return hash == other.hash &&
+		layout.quantization == other.layout.quantization &&
+		vertices == other.vertices &&
+		indices == other.indices;
 }
 
 Stats LiveMaterial::GetStats() { return _stats; }
 void LiveMaterial::SetStats(Stats stats) { _stats = stats; }
 
 void LiveMaterial::PrintUniforms() {
-	lock_guard<mutex> guard(uniformsMutex);
+	lock_guard<InstrumentedMutex> guard(uniformsMutex);
+	if (!_layout)
+		return;
 
     std::stringstream ss;
-    for (auto i = shaderProps.begin(); i != shaderProps.end(); ++i) {
+    for (auto i = _layout->props.begin(); i != _layout->props.end(); ++i) {
         auto prop = i->second;
         ss << prop->name << " ";
 #if SUPPORT_D3D11
@@ -434,7 +1017,66 @@ void LiveMaterial::PrintUniforms() {
 
 void LiveMaterial::SetComputeSource(
 	const char* source, const char* entryPoint) {
-	assert(false);
+
+	if (!source || strlen(source) == 0) {
+		DebugWarning("no source in SetComputeSource");
+		return;
+	}
+
+	extern string GetShaderIncludePath();
+
+	_parentId = 0;
+
+	CompileTask task;
+	task.quitting = false;
+	task.shaderType = Compute;
+	task.src = source;
+	task.entryPoint = entryPoint ? entryPoint : "";
+	task.filename = GetShaderIncludePath() + "\\compute.hlsl";
+	task.liveMaterialId = id();
+	task.id = ++inputId;
+	{
+		auto program = std::make_shared<string>(task.src);
+		program->push_back('\0');
+		program->append(task.entryPoint);
+		lock_guard<InstrumentedMutex> guard(uniformsMutex);
+		_programSource = program;
+	}
+	_renderAPI->instanceGroupsChanged();
+
+	DebugVerbose("setting state to Compiling");
+	_stats.compileState = CompileState::Compiling;
+
+	_QueueCompileTasks(vector<CompileTask>(1, task));
+}
+
+void LiveMaterial::SetComputeBuffer(const char* name, void* nativeBufferPtr) {
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	if (nativeBufferPtr)
+		computeBuffers[name] = nativeBufferPtr;
+	else
+		computeBuffers.erase(name);
+}
+
+void LiveMaterial::SetComputeImage(const char* name, void* nativeTexturePtr) {
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	if (nativeTexturePtr)
+		computeImages[name] = nativeTexturePtr;
+	else
+		computeImages.erase(name);
+}
+
+void LiveMaterial::SubmitDispatch(int uniformsIndex, int groupsX, int groupsY, int groupsZ) {
+	SubmitUniforms(uniformsIndex);
+
+	lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+	_dispatchGroups[uniformsIndex][0] = groupsX;
+	_dispatchGroups[uniformsIndex][1] = groupsY;
+	_dispatchGroups[uniformsIndex][2] = groupsZ;
+}
+
+bool LiveMaterial::Dispatch(int uniformIndex) {
+	return false;
 }
 
 static Queue<CompileTask> compileQueue;
@@ -451,8 +1093,15 @@ void RenderAPI::Initialize() {
 }
 
 RenderAPI::~RenderAPI() {
+	if (meshThread.joinable()) {
+		MeshTask task;
+		task.quitting = true;
+		meshQueue.push(task);
+		meshThread.join();
+	}
+
 	{
-		lock_guard<mutex> guard(materialsMutex);
+		lock_guard<InstrumentedMutex> guard(materialsMutex);
 		for (auto iter = liveMaterials.begin(); iter != liveMaterials.end(); iter++) {
 			auto liveMaterial = iter->second;
 			delete liveMaterial;
@@ -460,6 +1109,8 @@ RenderAPI::~RenderAPI() {
 		liveMaterials.clear();
 	}
 
+	DestroyRenderTargets();
+
 	{
 		CompileTask task;
 		task.quitting = true;
@@ -469,29 +1120,291 @@ RenderAPI::~RenderAPI() {
 
 
 void RenderAPI::runCompileFunc() {
-	bool quitting = true;
-	Debug("COMPILE THREAD STARTING");
-	while (quitting) {
-		Debug("compile thread waiting on queue");
+	bool running = true;
+	DebugVerbose("COMPILE THREAD STARTING");
+	setProfilerThreadName("compile");
+	while (running) {
+		DebugVerbose("compile thread waiting on queue");
 		auto compileTask = compileQueue.pop();
-		Debug("compile thread popped an entry");
+		DebugVerbose("compile thread popped an entry");
 		if (compileTask.quitting) // TODO: signal some other way
-			quitting = true;
-		else
+			running = false;
+		else {
+			ProfileScope scope("compileShader", compileTask.liveMaterialId);
 			compileShader(compileTask);
+		}
 	}
-	Debug("COMPILE THREAD FINISHED");
+	DebugVerbose("COMPILE THREAD FINISHED");
 }
 
 void RenderAPI::GetDebugInfo(int * numCompileTasks, int * numLiveMaterials)
 {
 	*numCompileTasks = (int)compileQueue.approximate_size();
 	{
-		lock_guard<mutex> guard(materialsMutex);
+		lock_guard<InstrumentedMutex> guard(materialsMutex);
 		*numLiveMaterials = static_cast<int>(liveMaterials.size());
 	}
 }
 
+void RenderAPI::GetLayoutInfo(int* numLayouts, int* numLayoutUsers)
+{
+	lock_guard<InstrumentedMutex> guard(layoutsMutex);
+	*numLayouts = 0;
+	*numLayoutUsers = 0;
+	for (auto i = layouts.begin(); i != layouts.end(); ++i) {
+		auto users = i->second.use_count();
+		if (users > 0) {
+			++*numLayouts;
+			*numLayoutUsers += (int)users;
+		}
+	}
+}
+
+void RenderAPI::GetMeshInfo(int* numMeshes, int64_t* cpuBytes, int64_t* gpuBytes)
+{
+	lock_guard<InstrumentedMutex> guard(meshesMutex);
+	*numMeshes = 0;
+	*cpuBytes = 0;
+	*gpuBytes = 0;
+	for (auto i = meshes.begin(); i != meshes.end(); ++i) {
+		auto mesh = i->second.lock();
+		if (mesh) {
+			++*numMeshes;
+			*cpuBytes += mesh->cpuBytes();
+			*gpuBytes += mesh->gpuBytes;
+		}
+	}
+}
+
+// Interned entries are weak, so the ones nobody uses pile up until swept.
+// Sweeping only once the map has doubled since the last sweep keeps
+// interning amortized O(1) however many entries are live.
+static const size_t kInternSweepMinSize = 64;
+
+template <typename WeakMap>
+static void sweepExpired(WeakMap& entries, size_t* sweepSize) {
+	if (entries.size() < *sweepSize)
+		return;
+	for (auto i = entries.begin(); i != entries.end();) {
+		if (i->second.expired())
+			i = entries.erase(i);
+		else
+			++i;
+	}
+	*sweepSize = std::max(kInternSweepMinSize, entries.size() * 2);
+}
+
+MeshRef RenderAPI::InternMesh(MeshData* mesh)
+{
+	lock_guard<InstrumentedMutex> guard(meshesMutex);
+	auto range = meshes.equal_range(mesh->hash);
+	for (auto i = range.first; i != range.second; ++i) {
+		auto existing = i->second.lock();
+		if (existing && existing->sameAs(*mesh)) {
+			delete mesh;
+			return existing;
+		}
+	}
+
+	sweepExpired(meshes, &meshesSweepSize);
+
+	MeshRef ref(mesh);
+	meshes.insert(std::make_pair(mesh->hash, std::weak_ptr<const MeshData>(ref)));
+	return ref;
+}
+
+MeshRef RenderAPI::FindOptimizedMesh(size_t hash)
+{
+	// Trusts the 64-bit content hash rather than keeping every submitted
+	// mesh alive just to compare against.
+	lock_guard<InstrumentedMutex> guard(meshesMutex);
+	auto iter = optimizedMeshes.find(hash);
+	if (iter == optimizedMeshes.end())
+		return nullptr;
+	return iter->second.lock();
+}
+
+void RenderAPI::QueueMeshOptimization(MeshRef mesh)
+{
+	{
+		lock_guard<InstrumentedMutex> guard(meshThreadMutex);
+		if (!meshThread.joinable())
+			meshThread = thread(&RenderAPI::runMeshFunc, this);
+	}
+
+	MeshTask task;
+	task.mesh = mesh;
+	meshQueue.push(task);
+}
+
+void RenderAPI::runMeshFunc()
+{
+	setProfilerThreadName("mesh");
+	for (;;) {
+		MeshTask task = meshQueue.pop();
+		if (task.quitting)
+			break;
+
+		const MeshRef& mesh = task.mesh;
+		MeshRef optimized = FindOptimizedMesh(mesh->hash);
+		if (!optimized) {
+			ProfileScope scope("optimizeMesh");
+			auto data = new MeshData();
+			data->layout = mesh->layout;
+			data->vertices = mesh->vertices;
+			data->indices = mesh->indices;
+			if (optimizeMesh(data->vertices, data->layout.stride, data->indices)) {
+				data->vertexCount = (uint32_t)(data->vertices.size() / data->layout.stride);
+				data->updateHash();
+				DebugSS("optimized mesh: " << mesh->vertexCount << " -> " << data->vertexCount << " vertices, ACMR "
+					<< averageCacheMissRatio(data->indices, data->vertexCount));
+				optimized = InternMesh(data);
+			} else {
+				delete data;
+				optimized = mesh;
+			}
+
+			lock_guard<InstrumentedMutex> guard(meshesMutex);
+			sweepExpired(optimizedMeshes, &optimizedMeshesSweepSize);
+			optimizedMeshes[mesh->hash] = optimized;
+		}
+
+		lock_guard<InstrumentedMutex> guard(materialsMutex);
+		for (auto i = liveMaterials.begin(); i != liveMaterials.end(); ++i)
+			i->second->replaceMesh(mesh, optimized);
+	}
+}
+
+static const int kRenderTargetMaxSize = 16384;
+static const uint64_t kRenderTargetIdleFrames = 4; // unused this long and a target is destroyed
+
+bool RenderTargetDesc::valid() const {
+	return width > 0 && width <= kRenderTargetMaxSize &&
+		height > 0 && height <= kRenderTargetMaxSize &&
+		format >= 0 && format < RenderTargetFormatCount &&
+		(samples == 1 || samples == 2 || samples == 4 || samples == 8);
+}
+
+size_t RenderTargetDesc::bytes() const {
+	static const size_t bytesPerPixel[RenderTargetFormatCount] = { 4, 8, 16, 2, 4 };
+	return (size_t)width * height * samples * bytesPerPixel[format];
+}
+
+RenderTarget* RenderAPI::_newRenderTarget(const RenderTargetDesc& desc) { return nullptr; }
+
+RenderTarget* RenderAPI::CreateRenderTarget(const RenderTargetDesc& desc)
+{
+	if (!desc.valid()) {
+		DebugError("invalid render target " << desc.width << "x" << desc.height << " format " << desc.format << " samples " << desc.samples);
+		return nullptr;
+	}
+
+	RenderTarget* target = _newRenderTarget(desc);
+	if (target)
+		target->desc = desc;
+	return target;
+}
+
+RenderTarget* RenderAPI::AcquireRenderTarget(const RenderTargetDesc& desc)
+{
+	// Prefer the most recently used match, so the rest go idle and get trimmed.
+	RenderTarget* target = nullptr;
+	for (size_t i = 0; i < renderTargets.size(); ++i) {
+		RenderTarget* candidate = renderTargets[i];
+		if (!candidate->acquired && candidate->desc == desc &&
+			(!target || candidate->lastUsedFrame > target->lastUsedFrame))
+			target = candidate;
+	}
+
+	if (!target) {
+		target = CreateRenderTarget(desc);
+		if (!target)
+			return nullptr;
+		renderTargets.push_back(target);
+		renderTargetCount = (int)renderTargets.size();
+		residentBytes += desc.bytes();
+		if (residentBytes > peakResidentBytes)
+			peakResidentBytes = residentBytes.load();
+	}
+
+	target->acquired = true;
+	target->lastUsedFrame = frameIndex;
+	acquiredBytes += desc.bytes();
+	if (acquiredBytes > framePeakBytes)
+		framePeakBytes = acquiredBytes;
+	return target;
+}
+
+void RenderAPI::ReleaseRenderTarget(RenderTarget* target)
+{
+	if (!target || !target->acquired)
+		return;
+	target->acquired = false;
+	acquiredBytes -= target->desc.bytes();
+}
+
+void RenderAPI::EndFrame()
+{
+	for (size_t i = 0; i < renderTargets.size();) {
+		RenderTarget* target = renderTargets[i];
+		target->acquired = false;
+		if (frameIndex - target->lastUsedFrame >= kRenderTargetIdleFrames) {
+			residentBytes -= target->desc.bytes();
+			delete target;
+			renderTargets[i] = renderTargets.back();
+			renderTargets.pop_back();
+		} else {
+			++i;
+		}
+	}
+	renderTargetCount = (int)renderTargets.size();
+
+	lastFramePeakBytes = (int64_t)framePeakBytes;
+	acquiredBytes = 0;
+	framePeakBytes = 0;
+	++frameIndex;
+}
+
+void RenderAPI::DestroyRenderTargets()
+{
+	for (size_t i = 0; i < renderTargets.size(); ++i)
+		delete renderTargets[i];
+	renderTargets.clear();
+	renderTargetCount = 0;
+	residentBytes = 0;
+	acquiredBytes = 0;
+}
+
+void RenderAPI::GetRenderTargetInfo(int* numTargets, int64_t* resident, int64_t* peakResident, int64_t* framePeak)
+{
+	*numTargets = renderTargetCount;
+	*resident = residentBytes;
+	*peakResident = peakResidentBytes;
+	*framePeak = lastFramePeakBytes;
+}
+
+UniformLayoutRef RenderAPI::InternLayout(UniformLayout* layout)
+{
+	layout->findTexelSizes();
+
+	lock_guard<InstrumentedMutex> guard(layoutsMutex);
+	auto range = layouts.equal_range(layout->programHash);
+	for (auto i = range.first; i != range.second; ++i) {
+		auto existing = i->second.lock();
+		if (existing && existing->sameAs(*layout)) {
+			delete layout;
+			return existing;
+		}
+	}
+
+	// New program; drop entries for layouts nobody uses anymore if enough have piled up.
+	sweepExpired(layouts, &layoutsSweepSize);
+
+	UniformLayoutRef ref(layout);
+	layouts.insert(std::make_pair(layout->programHash, std::weak_ptr<const UniformLayout>(ref)));
+	return ref;
+}
+
 bool RenderAPI::compileShader(CompileTask task) {
 	assert(false);
 	return false;
@@ -500,7 +1413,7 @@ bool RenderAPI::compileShader(CompileTask task) {
 void RenderAPI::compileThreadFunc(RenderAPI * renderAPI) { renderAPI->runCompileFunc(); }
 
 bool RenderAPI::DestroyLiveMaterial(int id) {
-	lock_guard<mutex> guard(materialsMutex);
+	lock_guard<InstrumentedMutex> guard(materialsMutex);
 
 	auto iter = liveMaterials.find(id);
 	if (iter == liveMaterials.end())
@@ -511,12 +1424,13 @@ bool RenderAPI::DestroyLiveMaterial(int id) {
 
 	liveMaterials.erase(id);
 	delete liveMaterial;
+	instanceGroupsChanged();
 	return true;
 }
 
 LiveMaterial * RenderAPI::GetLiveMaterialById(int id)
 {
-	lock_guard<mutex> guard(materialsMutex);
+	lock_guard<InstrumentedMutex> guard(materialsMutex);
 	return GetLiveMaterialByIdLocked(id);
 }
 
@@ -539,8 +1453,335 @@ void RenderAPI::QueueCompileTasks(vector<CompileTask> tasks)
 void RenderAPI::ClearCompileCache() {
 }
 
+void RenderAPI::DrawInstanced(int leaderId, int uniformIndex) {
+	ProfileScope scope("RenderAPI::DrawInstanced", leaderId);
+	auto leader = GetLiveMaterialByIdLocked(leaderId);
+	if (!leader)
+		return;
+
+	updateInstanceGroups();
+	auto groupOf = instanceGroupOf.find(leader);
+	if (groupOf == instanceGroupOf.end()) {
+		// Not instanced, not compiled yet, or drawing into a target of its own.
+		leader->Draw(uniformIndex);
+		return;
+	}
+
+	// Every member issues the event, after all of them have submitted; the
+	// first one this frame draws the group.
+	auto group = groupOf->second;
+	if (group->drawnFrame == frameIndex && group->drawnUniformIndex == uniformIndex)
+		return;
+	group->drawnFrame = frameIndex;
+	group->drawnUniformIndex = uniformIndex;
+
+	auto stride = leader->instanceStride();
+	instanceData.clear();
+	instanceMembers.clear();
+	for (size_t i = 0; i < group->members.size(); ++i) {
+		if (group->members[i]->appendInstanceData(uniformIndex, stride, instanceData))
+			instanceMembers.push_back(group->members[i]);
+	}
+	if (instanceMembers.empty())
+		return;
+
+	// Backends without instancing support draw the group one material at a time.
+	if (!leader->DrawInstanced(uniformIndex, instanceData.data(), (int)instanceMembers.size(), stride)) {
+		for (size_t i = 0; i < instanceMembers.size(); ++i)
+			instanceMembers[i]->Draw(uniformIndex);
+	}
+}
+
+void RenderAPI::updateInstanceGroups() {
+	// materialsMutex is held, so no material is created or destroyed meanwhile.
+	auto version = _instanceGroupsVersion.load(std::memory_order_acquire);
+	if (version == instanceGroupsBuilt)
+		return;
+	instanceGroupsBuilt = version;
+
+	map<InstanceKey, InstanceGroup> groups;
+	InstanceKey key;
+	for (auto iter = liveMaterials.begin(); iter != liveMaterials.end(); ++iter) {
+		auto liveMaterial = iter->second;
+		if (liveMaterial->instanceKey(&key))
+			groups[key].members.push_back(liveMaterial);
+	}
+	// Keep when each group was last drawn, so regrouping mid-frame doesn't draw one twice.
+	for (auto iter = groups.begin(); iter != groups.end(); ++iter) {
+		auto old = instanceGroups.find(iter->first);
+		if (old != instanceGroups.end()) {
+			iter->second.drawnFrame = old->second.drawnFrame;
+			iter->second.drawnUniformIndex = old->second.drawnUniformIndex;
+		}
+	}
+	instanceGroups.swap(groups);
+
+	instanceGroupOf.clear();
+	for (auto iter = instanceGroups.begin(); iter != instanceGroups.end(); ++iter) {
+		for (size_t i = 0; i < iter->second.members.size(); ++i)
+			instanceGroupOf[iter->second.members[i]] = &iter->second;
+	}
+}
+
+void RenderAPI::ExecuteGraph(int uniformIndex) {
+	ProfileScope scope("RenderAPI::ExecuteGraph");
+	struct Node {
+		LiveMaterial* material;
+		string output;
+		RenderTargetDesc outputDesc;
+		map<string, string> inputs;
+		vector<size_t> producers;
+		vector<size_t> consumers;
+		size_t unsortedProducers = 0;
+		size_t lastUse = (size_t)-1; // position in the order of the output's last consumer
+		bool live = false;
+		RenderTarget* target = nullptr;
+	};
+
+	vector<Node> nodes;
+	for (auto iter = liveMaterials.begin(); iter != liveMaterials.end(); ++iter) {
+		Node node;
+		node.material = iter->second;
+		if (node.material->getGraphNode(node.output, node.outputDesc, node.inputs))
+			nodes.push_back(node);
+	}
+
+	map<string, size_t> producerByName;
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		if (nodes[i].output.empty())
+			continue;
+		if (!producerByName.insert(std::make_pair(nodes[i].output, i)).second && showWarnings())
+			DebugWarning("graph output " << nodes[i].output << " is already written by another material (id=" << nodes[i].material->id() << ")");
+	}
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		for (auto input = nodes[i].inputs.begin(); input != nodes[i].inputs.end(); ++input) {
+			auto producer = producerByName.find(input->second);
+			if (producer == producerByName.end() || producer->second == i)
+				continue;
+			auto& producers = nodes[i].producers;
+			if (std::find(producers.begin(), producers.end(), producer->second) == producers.end())
+				producers.push_back(producer->second);
+		}
+	}
+
+	// Cull: only what a sink (transitively) reads from gets drawn.
+	vector<size_t> stack;
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		if (nodes[i].output.empty()) {
+			nodes[i].live = true;
+			stack.push_back(i);
+		}
+	}
+	while (!stack.empty()) {
+		const size_t i = stack.back();
+		stack.pop_back();
+		for (size_t p = 0; p < nodes[i].producers.size(); ++p) {
+			Node& producer = nodes[nodes[i].producers[p]];
+			if (!producer.live) {
+				producer.live = true;
+				stack.push_back(nodes[i].producers[p]);
+			}
+		}
+	}
+
+	// Producers first (Kahn), ties broken by material id.
+	vector<size_t> order;
+	size_t liveCount = 0;
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		if (!nodes[i].live)
+			continue;
+		++liveCount;
+		nodes[i].unsortedProducers = nodes[i].producers.size();
+		for (size_t p = 0; p < nodes[i].producers.size(); ++p)
+			nodes[nodes[i].producers[p]].consumers.push_back(i);
+		if (!nodes[i].unsortedProducers)
+			order.push_back(i);
+	}
+	for (size_t k = 0; k < order.size(); ++k) {
+		const Node& node = nodes[order[k]];
+		for (size_t c = 0; c < node.consumers.size(); ++c)
+			if (--nodes[node.consumers[c]].unsortedProducers == 0)
+				order.push_back(node.consumers[c]);
+	}
+	if (order.size() < liveCount && showWarnings())
+		DebugError("render graph has a cycle; " << liveCount - order.size() << " materials not drawn");
+
+	for (size_t k = 0; k < order.size(); ++k) {
+		const Node& node = nodes[order[k]];
+		for (size_t p = 0; p < node.producers.size(); ++p)
+			nodes[node.producers[p]].lastUse = k;
+	}
+
+	LiveMaterial::GraphTextures textures;
+	for (size_t k = 0; k < order.size(); ++k) {
+		Node& node = nodes[order[k]];
+		if (!node.output.empty()) {
+			node.target = AcquireRenderTarget(node.outputDesc);
+			if (!node.target)
+				continue;
+		}
+
+		textures.clear();
+		for (auto input = node.inputs.begin(); input != node.inputs.end(); ++input) {
+			auto producer = producerByName.find(input->second);
+			if (producer != producerByName.end() && nodes[producer->second].target)
+				textures.push_back(std::make_pair(input->first, nodes[producer->second].target));
+		}
+		node.material->DrawGraphPass(uniformIndex, node.target, textures);
+
+		// Outputs nobody reads after this pass go back to the pool now.
+		for (size_t p = 0; p < node.producers.size(); ++p)
+			if (nodes[node.producers[p]].lastUse == k)
+				ReleaseRenderTarget(nodes[node.producers[p]].target);
+		if (node.lastUse == (size_t)-1)
+			ReleaseRenderTarget(node.target);
+	}
+
+	graphPasses = (int)order.size();
+	graphCulled = (int)(nodes.size() - liveCount);
+}
+
+void RenderAPI::GetGraphInfo(int* numPasses, int* numCulled) {
+	*numPasses = graphPasses;
+	*numCulled = graphCulled;
+}
+
 void RenderAPI::SetFlags(int flags) { this->flags = flags; }
 
+bool RenderAPI::GetTextureInfo(void* nativeTexture, TextureInfo* info) {
+	if (!nativeTexture)
+		return false;
+	lock_guard<InstrumentedMutex> guard(textureRegistryMutex);
+	auto i = textureInfos.find(nativeTexture);
+	if (i == textureInfos.end()) {
+		TextureInfo described;
+		if (!_describeTexture(nativeTexture, &described) || described.width <= 0)
+			return false;
+		i = textureInfos.insert(std::make_pair(nativeTexture, described)).first;
+	}
+	*info = i->second;
+	return true;
+}
+
+bool RenderAPI::_describeTexture(void* nativeTexture, TextureInfo* info) { return false; }
+
+void* RenderAPI::FindTexturePointer(int id) {
+	lock_guard<InstrumentedMutex> guard(textureRegistryMutex);
+	auto i = texturePointers.find(id);
+	return i != texturePointers.end() ? i->second : nullptr;
+}
+
+void RenderAPI::SetTexturePointer(int id, void* nativeTexture) {
+	lock_guard<InstrumentedMutex> guard(textureRegistryMutex);
+	auto& pointer = texturePointers[id];
+	if (pointer == nativeTexture)
+		return;
+	const bool repointed = pointer != nullptr;
+	if (repointed)
+		textureInfos.erase(pointer); // Unity recreated the texture; the old one is gone
+	const bool recycled = textureInfos.erase(nativeTexture) > 0;
+	pointer = nativeTexture;
+	if (repointed || recycled)
+		_textureGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+void RenderAPI::InvalidateTexture(int id) {
+	lock_guard<InstrumentedMutex> guard(textureRegistryMutex);
+	auto i = texturePointers.find(id);
+	if (i == texturePointers.end())
+		return;
+	textureInfos.erase(i->second);
+	texturePointers.erase(i);
+	_textureGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool SamplerDesc::operator<(const SamplerDesc& other) const {
+	if (filter != other.filter) return filter < other.filter;
+	if (wrap != other.wrap) return wrap < other.wrap;
+	if (anisotropy != other.anisotropy) return anisotropy < other.anisotropy;
+	return mipmapped < other.mipmapped;
+}
+
+bool InstanceKey::operator<(const InstanceKey& other) const {
+	if (programHash != other.programHash) return programHash < other.programHash;
+	if (meshKey != other.meshKey) return meshKey < other.meshKey;
+	if (parentId != other.parentId) return parentId < other.parentId;
+	if (textures != other.textures) return textures < other.textures;
+	if (samplers < other.samplers || other.samplers < samplers) return samplers < other.samplers;
+	return program != other.program && *program < *other.program; // clones share theirs
+}
+
+bool TextureViewDesc::operator<(const TextureViewDesc& other) const {
+	if (texture != other.texture) return std::less<void*>()(texture, other.texture);
+	if (format != other.format) return format < other.format;
+	if (firstMip != other.firstMip) return firstMip < other.firstMip;
+	return mipCount < other.mipCount;
+}
+
+void* RenderAPI::AcquireTextureView(const TextureViewDesc& desc) {
+	if (!desc.texture)
+		return nullptr;
+	lock_guard<InstrumentedMutex> guard(textureViewsMutex);
+	auto i = textureViews.find(desc);
+	if (i == textureViews.end()) {
+		void* view = _newTextureView(desc);
+		if (!view)
+			return nullptr;
+		SharedTextureView shared = { view, 0 };
+		i = textureViews.insert(std::make_pair(desc, shared)).first;
+		textureViewDescs[view] = desc;
+	}
+	++i->second.users;
+	return i->second.view;
+}
+
+void RenderAPI::RetainTextureView(void* view) {
+	if (!view)
+		return;
+	lock_guard<InstrumentedMutex> guard(textureViewsMutex);
+	auto desc = textureViewDescs.find(view);
+	assert(desc != textureViewDescs.end());
+	if (desc != textureViewDescs.end())
+		++textureViews[desc->second].users;
+}
+
+void RenderAPI::ReleaseTextureView(void* view) {
+	if (!view)
+		return;
+	lock_guard<InstrumentedMutex> guard(textureViewsMutex);
+	auto desc = textureViewDescs.find(view);
+	assert(desc != textureViewDescs.end());
+	if (desc == textureViewDescs.end())
+		return;
+	auto shared = textureViews.find(desc->second);
+	if (--shared->second.users > 0)
+		return;
+	_deleteTextureView(view);
+	textureViews.erase(shared);
+	textureViewDescs.erase(desc);
+}
+
+void* RenderAPI::GetSampler(const SamplerDesc& desc) {
+	lock_guard<InstrumentedMutex> guard(textureViewsMutex);
+	auto i = samplers.find(desc);
+	if (i == samplers.end())
+		i = samplers.insert(std::make_pair(desc, _newSampler(desc))).first; // failures too, so they aren't retried every draw
+	return i->second;
+}
+
+void RenderAPI::DestroySamplers() {
+	lock_guard<InstrumentedMutex> guard(textureViewsMutex);
+	for (auto i = samplers.begin(); i != samplers.end(); ++i)
+		if (i->second)
+			_deleteSampler(i->second);
+	samplers.clear();
+}
+
+void* RenderAPI::_newTextureView(const TextureViewDesc& desc) { return nullptr; }
+void RenderAPI::_deleteTextureView(void* view) {}
+void* RenderAPI::_newSampler(const SamplerDesc& desc) { return nullptr; }
+void RenderAPI::_deleteSampler(void* sampler) {}
+
 RenderAPI* CreateRenderAPI(UnityGfxRenderer apiType)
 {
 #	if SUPPORT_D3D11
@@ -592,6 +1833,12 @@ RenderAPI* CreateRenderAPI(UnityGfxRenderer apiType)
 	}
 #	endif // if SUPPORT_METAL
 
+	if (apiType == kUnityGfxRendererNull)
+	{
+		extern RenderAPI* CreateRenderAPI_Null();
+		return CreateRenderAPI_Null();
+	}
+
 
 	// Unknown or unsupported graphics API
 	return NULL;
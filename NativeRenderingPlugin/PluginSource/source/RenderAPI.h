@@ -9,14 +9,20 @@
 #include <mutex>
 #include <thread>
 #include <iostream>
+#include <memory>
+#include <atomic>
 
 #include "ConcurrentQueue.h"
 #include "ShaderProp.h"
+#include "MeshFormat.h"
+#include "InstrumentedMutex.h"
+#include "Log.h"
 
 using std::string;
 using std::thread;
 using std::vector;
 using std::map;
+using std::multimap;
 using std::mutex;
 using std::lock_guard;
 using std::stringstream;
@@ -25,24 +31,6 @@ struct IUnityInterfaces;
 
 #define MAX_GPU_BUFFERS 4
 
-extern mutex debugLogMutex;
-typedef void(*DebugLogFuncPtr)(const char *);
-DebugLogFuncPtr GetDebugFunc();
-
-#define Debug(m) do { \
-	lock_guard<mutex> _debug_log_guard(debugLogMutex); \
-	if (GetDebugFunc()) { GetDebugFunc()(m); } else { std::cout << m << std::endl; } } while(0);
-
-#define DebugSS(ssexp) do { \
-	std::stringstream _ss; _ss << ssexp; \
-	std::string _sDebugString(_ss.str()); \
-    if (GetDebugFunc()) { \
-        GetDebugFunc()(_sDebugString.c_str()); \
-    } else { \
-		std::cout << _sDebugString.c_str() << std::endl; \
-	} \
-} while(0);
-
 class RenderAPI;
 class LiveMaterial;
 
@@ -74,6 +62,175 @@ struct CompileTask {
 
 typedef map<string, ShaderProp*> PropMap;
 
+// The reflected uniforms of a compiled program: a mapping of name -> prop
+// description, type, and offset into the constant buffer, plus where each
+// texture binds. A layout is never modified after reflection builds it, and
+// RenderAPI::InternLayout hands every material compiled from the same program
+// the same instance.
+struct UniformLayout {
+	UniformLayout() : programHash(0), constantBufferSize(0), textureSlotCount(0) {}
+	~UniformLayout();
+
+	ShaderProp* find(const char* name) const;
+	bool sameAs(const UniformLayout& other) const;
+	void findTexelSizes();
+
+	size_t programHash;
+	PropMap props;
+	size_t constantBufferSize;
+
+	map<string, size_t> textureSlots; // name -> D3D11 bind point or GL texture unit
+	size_t textureSlotCount;
+	vector<std::pair<size_t, ShaderProp*>> texelSizes; // name_TexelSize float4s declared, by texture slot
+#if SUPPORT_OPENGL_UNIFIED || SUPPORT_OPENGL_LEGACY
+	vector<int> textureUniformIndexes; // sampler uniform location for each texture unit
+	map<string, size_t> imageSlots; // image uniform name -> GL image unit
+	vector<int> imageUniformIndexes; // image uniform location for each image unit
+	map<string, size_t> storageBlockSlots; // shader storage block name -> binding
+#endif
+
+private:
+	UniformLayout(const UniformLayout&);
+};
+
+typedef std::shared_ptr<const UniformLayout> UniformLayoutRef;
+
+// What the backend reports about a native texture; see RenderAPI::GetTextureInfo.
+struct TextureInfo {
+	int width = 0; // 0 when the texture couldn't be described
+	int height = 0;
+	int mipCount = 0;
+	int format = 0; // the backend's own: a GL internal format or a DXGI_FORMAT
+};
+
+// How a sampler filters and wraps, numbered like Unity's FilterMode and
+// TextureWrapMode. RenderAPI::GetSampler shares one backend sampler object
+// per distinct description.
+enum SamplerFilter { SamplerPoint = 0, SamplerBilinear = 1, SamplerTrilinear = 2, SamplerFilterCount };
+enum SamplerWrap { SamplerRepeat = 0, SamplerClamp = 1, SamplerMirror = 2, SamplerWrapCount };
+
+struct SamplerDesc {
+	SamplerDesc(int filter = SamplerTrilinear, int wrap = SamplerRepeat, int anisotropy = 1)
+		: filter(filter), wrap(wrap), anisotropy(anisotropy), mipmapped(true) {}
+
+	bool operator<(const SamplerDesc& other) const;
+
+	int filter;
+	int wrap;
+	int anisotropy; // 1 for none, up to 16
+	bool mipmapped; // false samples mip 0 only; GL textures without mips need it
+};
+
+// A view a shader reads a texture through; see RenderAPI::AcquireTextureView.
+struct TextureViewDesc {
+	TextureViewDesc(void* texture = nullptr, int format = 0, int firstMip = 0, int mipCount = -1)
+		: texture(texture), format(format), firstMip(firstMip), mipCount(mipCount) {}
+
+	bool operator<(const TextureViewDesc& other) const;
+
+	void* texture;
+	int format; // the backend's own, or 0 for the texture's
+	int firstMip;
+	int mipCount; // -1 for every mip from firstMip down
+};
+
+// A backend's copy of a MeshData in GPU buffers. Created on the render thread
+// the first time a material draws the mesh, and shared along with it.
+struct GpuMesh {
+	virtual ~GpuMesh() {}
+};
+
+// Vertex and index data as set by SetMesh*, packed for upload. Immutable once
+// interned: RenderAPI::InternMesh hands every material that sets byte-identical
+// data the same instance, keyed by a hash of the contents.
+struct MeshData {
+	MeshData() : hash(0), vertexCount(0), gpuBytes(0) {}
+
+	bool sameAs(const MeshData& other) const;
+	void updateHash();
+	size_t cpuBytes() const { return vertices.size() + indices.size() * sizeof(uint32_t); }
+
+	size_t hash;
+	MeshLayout layout;
+	uint32_t vertexCount;
+	vector<unsigned char> vertices;
+	vector<uint32_t> indices;
+
+	mutable std::shared_ptr<GpuMesh> gpu; // render thread only
+	mutable std::atomic<size_t> gpuBytes;
+
+private:
+	MeshData(const MeshData&);
+};
+
+typedef std::shared_ptr<const MeshData> MeshRef;
+
+// Formats the render target pool can allocate, numbered for the C# side.
+enum RenderTargetFormat {
+	RenderTargetRGBA8 = 0,
+	RenderTargetRGBA16F = 1,
+	RenderTargetRGBA32F = 2,
+	RenderTargetR16F = 3,
+	RenderTargetR32F = 4,
+	RenderTargetFormatCount
+};
+
+struct RenderTargetDesc {
+	RenderTargetDesc() : width(0), height(0), format(RenderTargetRGBA8), samples(1) {}
+	RenderTargetDesc(int width, int height, RenderTargetFormat format, int samples = 1)
+		: width(width), height(height), format(format), samples(samples) {}
+
+	bool operator==(const RenderTargetDesc& other) const {
+		return width == other.width && height == other.height && format == other.format && samples == other.samples;
+	}
+	bool valid() const;
+	size_t bytes() const;
+
+	int width;
+	int height;
+	RenderTargetFormat format;
+	int samples;
+};
+
+// A texture from RenderAPI's transient pool. Backends subclass this with the
+// texture and whatever they need to render into it; created and destroyed on
+// the render thread.
+struct RenderTarget {
+	RenderTarget() : lastUsedFrame(0), acquired(false) {}
+	virtual ~RenderTarget() {}
+
+	// What a material's SetTexture expects: a GL texture name or an ID3D11Texture2D*.
+	virtual void* NativeTexturePtr() const = 0;
+
+	RenderTargetDesc desc;
+	uint64_t lastUsedFrame;
+	bool acquired;
+};
+
+// Which of phases (2 or 4) temporal amortization shades pixel x, y in.
+// Backends bake this into their amortized targets' stencil.
+inline int amortizationPhaseAt(int x, int y, int phases) {
+	if (phases == 4) {
+		static const int bayer[2][2] = { { 0, 2 }, { 3, 1 } };
+		return bayer[y & 1][x & 1];
+	}
+	return (x + y) & 1;
+}
+
+// What materials have to share to be drawn as one instanced group; see
+// LiveMaterial::instanceKey. Ordered by the hashes first, so the sources are
+// only compared between materials whose hashes already match.
+struct InstanceKey {
+	size_t programHash = 0; // of the interned layout
+	size_t meshKey = 0;
+	int parentId = 0; // clones bind their parent's textures
+	map<string, void*> textures; // by sampler name, as set
+	map<string, SamplerDesc> samplers;
+	std::shared_ptr<const string> program; // the sources and entry points
+
+	bool operator<(const InstanceKey& other) const;
+};
+
 enum CompileState {
     NeverCompiled,
     Compiling,
@@ -85,15 +242,18 @@ struct Stats {
     CompileState compileState;
     uint64_t compileTimeMs;
     unsigned int instructionCount;
+    uint64_t skippedDraws; // by "static until changed"
+    float gpuTimeMs; // smoothed over recent draws; see RenderAPI::MeasureGpuTime
+    uint64_t gpuTimeSamples; // draws measured so far, 0 while gpuTimeMs means nothing
 };
 
-extern mutex renderAPIMutex;
+extern InstrumentedMutex renderAPIMutex;
 RenderAPI* GetCurrentRenderAPI();
 
 class LiveMaterial {
 public:
 	LiveMaterial(RenderAPI* renderAPI, int id);
-	virtual ~LiveMaterial() {}
+	virtual ~LiveMaterial();
 	int id() const { return _id; }
 
 	Stats GetStats();
@@ -110,6 +270,11 @@ public:
 	void SetFloatArray(const char* name, float* value, int numElems);
 	bool SetTextureID(const char* name, int id);
 	void SetTexturePtr(const char* name, int id, void* nativeTexturePointer);
+
+	// How the texture bound to a sampler name is filtered and wrapped. Without
+	// it D3D11 samples trilinear and repeating, and GL by the texture's own
+	// parameters.
+	void SetSampler(const char* name, const SamplerDesc& desc);
 	void SubmitUniforms(int uniformsIndex);
 	bool HasProperty(const char* name);
 	virtual void SetDepthWritesEnabled(bool enabled);
@@ -119,22 +284,119 @@ public:
 	void getproparray_locked(const char* name, PropType type, float* value, int numFloats);
 	virtual void Draw(int uniformIndex);
 	virtual bool NeedsRender();
+
+	// Static until changed: a material drawing into its render texture skips
+	// the draw while the uniforms slot, textures, mesh and program are all as
+	// they were for the last one. Texture contents aren't tracked, so call
+	// InvalidateDraw when they change under the same pointer.
+	void SetStaticUntilChanged(bool enabled) { _staticUntilChanged = enabled; }
+	void InvalidateDraw() { touchInputs(); }
+
+	// Resolution scale: below 1, a draw into a render texture or graph target
+	// renders at that fraction of its size into a pooled target, which is
+	// then upscaled bilinearly. With a GPU time budget set, the scale also
+	// drops (to no less than minScale) while the material's measured GPU time
+	// is over it, and recovers once there's headroom.
+	void SetResolutionScale(float scale) { _resolutionScale = scale; touchInputs(); }
+	void SetResolutionBudget(float gpuMilliseconds, float minScale);
+
+	// Temporal amortization: with 2 (checkerboard) or 4 (2x2 Bayer) phases, a
+	// draw into a render texture or graph target shades only one phase's
+	// pixels of a persistent target the material owns, keeping the rest from
+	// earlier draws, and copies the whole target over. The phase, which
+	// advances every draw, is written to a _LivePhase float if the shader
+	// declares one. 1 turns it off.
+	void SetTemporalAmortization(int phases);
+
+	// Instancing: materials with instancing enabled that were given the same
+	// shader source, mesh, textures and samplers are drawn together by
+	// RenderAPI::DrawInstanced. Their submitted uniform blocks are packed into
+	// one buffer that the shader reads as
+	// _LiveInstanceData[instanceID * _LiveInstanceStride + i] (float4s).
+	// Materials drawing into a target of their own are drawn alone.
+	void SetInstancingEnabled(bool enabled);
+	bool instancingEnabled() const { return _instancingEnabled; }
+	// False if the material can't join a group: instancing is off, it isn't
+	// compiled yet, or it has a render texture, feedback or graph output.
+	bool instanceKey(InstanceKey* key);
+	size_t instanceStride() const;
+	bool appendInstanceData(int uniformIndex, size_t stride, vector<unsigned char>& instanceData);
+	virtual bool DrawInstanced(int uniformIndex, const unsigned char* instanceData, int instanceCount, size_t stride);
+
 	void SetShaderSource(const char* fragSrc, const char* fragEntry, const char* vertSrc, const char* vertEntry);
 	void SetComputeSource(const char* source, const char* entryPoint);
+
+	// Compute: SetComputeSource turns the material into a compute material,
+	// compiled and reflected like any other. Storage buffers and images are
+	// bound by the names the shader declares them with. SubmitDispatch
+	// snapshots the uniforms and group counts into a slot, which the compute
+	// render event then dispatches; false if the backend can't.
+	void SetComputeBuffer(const char* name, void* nativeBufferPtr);
+	void SetComputeImage(const char* name, void* nativeTexturePtr);
+	void SubmitDispatch(int uniformsIndex, int groupsX, int groupsY, int groupsZ);
+	virtual bool Dispatch(int uniformIndex);
 	void SetMesh(int vertexCount, float* vertices, float* normals, float* uvs);
+	void SetMeshIndexed(int vertexCount, float* vertices, float* normals, float* uvs, int indexCount, int* indices);
+	void SetMeshInterleaved(const void* vertices, int vertexCount, const VertexFormat& format, int indexCount, const int* indices);
+
+	// Swaps in the optimized version of a mesh if it's still the one last set.
+	void replaceMesh(const MeshRef& mesh, const MeshRef& replacement);
 
 	void DumpUniformsToFile(const char* filename, bool flatten);
 
+	// Cloning: a clone shares its parent's program, layout and textures, and
+	// keeps following the parent's program across recompiles until it is given
+	// its own shader source. Its constant buffer is only copied when first written.
+	virtual void _CopyFrom(LiveMaterial* parent);
+	void syncWithParent();
+
 	virtual void SetRenderTexture(void* nativeTexturePtr);
 	virtual bool CanDraw() const;
 
+	// Feedback: with a sampler name set, each draw renders into one of two
+	// targets the material owns while the other, holding the previous draw's
+	// output, is bound to that sampler; then they swap. With a render texture
+	// set as well, every result is copied into it for Unity to use. An empty
+	// name turns feedback off.
+	void SetFeedback(const char* samplerName, int width, int height, int format);
+
+	// Render graph: a material with an output renders into a pooled target
+	// of that name instead of its render texture, and inputs bind other
+	// materials' outputs to its samplers by name. RenderAPI::ExecuteGraph
+	// orders and draws them. An empty output name or null input removes it.
+	void SetGraphOutput(const char* name, int width, int height, int format);
+	void SetGraphInput(const char* samplerName, const char* outputName);
+	bool getGraphNode(string& output, RenderTargetDesc& outputDesc, map<string, string>& inputs);
+	typedef vector<std::pair<string, RenderTarget*>> GraphTextures; // sampler name -> target
+	void DrawGraphPass(int uniformIndex, RenderTarget* target, const GraphTextures& textures);
+
 protected:
     virtual void _QueueCompileTasks(vector<CompileTask> tasks);
+	virtual void _AdoptProgram(LiveMaterial* parent);
 
-	ShaderProp* propForNameSizeOffset(const char* name, uint16_t size, uint16_t offset);
 	ShaderProp* propForName(const char* name, PropType type);
+	void setBuiltinFloat(unsigned char* block, const char* name, float value);
+	// Writes each name_TexelSize the shader declares as (1/width, 1/height,
+	// width, height) of the texture in that slot, like Unity does. textures
+	// is indexed by slot. Needs uniformsMutex and gpuMutex.
+	void writeTexelSizes(unsigned char* block, const vector<TextureInfo>& textures);
+	// Render thread: what a draw uploads, a copy of the slot with the
+	// plugin-provided uniforms (_LivePhase, _LiveInstanceStride and the
+	// texel sizes of textures) written over it. The slot keeps exactly what
+	// SubmitUniforms copied, so its version only changes with the uniforms.
+	// Null if nothing was submitted. Needs uniformsMutex and gpuMutex.
+	const unsigned char* drawBlock(int uniformIndex, const vector<TextureInfo>& textures);
+	vector<unsigned char> _drawBlock;
+	int _drawPhase = -1; // render thread, from amortizationPhase
+	size_t _drawInstanceStride = 0; // render thread, set by DrawInstanced around its upload
 	virtual void _SetTexture(const char* name, void* nativeTexturePtr);
 
+	// What SetSampler set for a sampler name, if anything. Backends look the
+	// samplers up again whenever the version or their layout changes. Both
+	// need texturesMutex.
+	bool samplerSetFor(const string& name, SamplerDesc* desc) const;
+	uint64_t samplersVersion() const { return _samplersVersion; }
+
 	struct MeshVertex
 	{
 		float pos[3];
@@ -142,26 +404,111 @@ protected:
 		float uv[2];
 	};
 
-	vector<MeshVertex> mesh;
+	// The last mesh set, picked up by the render thread on its next draw.
+	// Materials without a mesh draw a quad.
+	InstrumentedMutex meshMutex{ "meshMutex" };
+	MeshRef meshSource;
+	bool _meshPending = false;
+	std::atomic<size_t> _meshKey{0}; // the mesh's content hash, or 0 for the quad; only equal keys are instanced together
+
+	void setPendingMesh(vector<unsigned char>& vertices, const MeshLayout& layout, int indexCount, const int* indices);
+	bool takePendingMesh(MeshRef& mesh);
 
 	Stats _stats = {};
 
 	RenderAPI* _renderAPI = nullptr;
 	int _id = -1;
 	bool _drawingEnabled = true;
-
-	void ensureConstantBufferSize(size_t size, PropMap* oldProps = nullptr, PropMap* newProps = nullptr);
+	bool _instancingEnabled = false;
+	std::shared_ptr<const string> _programSource; // the sources and entry points last set, under uniformsMutex; shared with clones
+
+	// Bumped on the render thread whenever the program or layout changes.
+	int _programGeneration = 0;
+	int _parentId = 0;
+	int _adoptedGeneration = -1;
+
+	void setLayout(UniformLayoutRef layout);
+	UniformLayoutRef currentLayout();
+	void ensureConstantBufferSize(size_t size, const UniformLayout* oldLayout = nullptr, const UniformLayout* newLayout = nullptr);
+	void ensureConstantBufferUnique();
+	void ensureGpuBuffer();
+	std::shared_ptr<vector<unsigned char>> _constantBlock; // may be shared with a clone until written
 	unsigned char* _constantBuffer = nullptr;
 	size_t _constantBufferSize = 0;
 	unsigned char* _gpuBuffer = nullptr;
 
-	mutex uniformsMutex;
-	PropMap shaderProps; // a mapping of name -> prop description, type, and offset into the constant buffer
-
-	mutex gpuMutex;
-
-	mutex texturesMutex;
-	map<int, void*> texturePointers; // caches Object::InstanceID() -> GetNativeTexturePtr()
+	InstrumentedMutex uniformsMutex{ "uniformsMutex" };
+	UniformLayoutRef _layout;
+
+	InstrumentedMutex gpuMutex{ "gpuMutex" };
+
+	InstrumentedMutex texturesMutex{ "texturesMutex" };
+	map<string, void*> computeBuffers; // by storage block name
+	map<string, void*> computeImages; // by image uniform name
+	map<string, SamplerDesc> _samplerDescs; // by sampler name
+	uint64_t _samplersVersion = 0;
+	map<string, std::pair<int, void*> > _textureSources; // by sampler name, the id and pointer last set
+	bool textureSourceChanged(const char* name, int id, void* nativeTexturePointer);
+
+	int _dispatchGroups[MAX_GPU_BUFFERS][3] = {}; // per uniforms slot, under gpuMutex
+
+	// Versions for static until changed, all from one counter so that no two
+	// states share one. A slot's version changes when SubmitUniforms writes
+	// different bytes into it; the resource version whenever a texture, render
+	// texture, mesh, feedback or graph setting is set.
+	void touchInputs();
+	bool drawIsCached(int uniformIndex); // render thread; false means draw, and remembers this state
+	std::atomic<bool> _staticUntilChanged{ false };
+	std::atomic<uint64_t> _inputVersion{ 0 };
+	std::atomic<uint64_t> _resourceVersion{ 0 };
+	uint64_t _slotVersions[MAX_GPU_BUFFERS] = {}; // under gpuMutex
+	uint64_t _drawnSlotVersion = 0; // render thread
+	uint64_t _drawnResourceVersion = 0;
+	int _drawnProgramGeneration = -1;
+	uint64_t _drawnTextureGeneration = 0; // RenderAPI::textureGeneration, bumped when a texture changes under its id
+
+	// Render thread: the reduced target to draw into instead of a width x
+	// height destination, or false to draw at full resolution.
+	bool reducedResolution(int width, int height, RenderTargetDesc& desc);
+	std::atomic<float> _resolutionScale{ 1.0f };
+	std::atomic<float> _gpuBudgetMs{ 0.0f };
+	std::atomic<float> _minResolutionScale{ 0.25f };
+	float _autoScale = 1.0f; // render thread
+	int _measurementsSinceScaled = 0;
+
+	// Smoothed GPU time of this material's draws, or negative until the
+	// backend measures it; _gpuTimeSamples counts the measurements. Backends
+	// time draws when gpuTimingWanted and report results through recordGpuTime.
+	bool gpuTimingWanted() const;
+	void recordGpuTime(float milliseconds); // render thread
+	float _gpuTimeMs = -1.0f;
+	uint64_t _gpuTimeSamples = 0;
+	uint64_t _gpuTimeSamplesSeen = 0;
+
+	// Render thread: the phase this draw shades, also written to the draw's
+	// _LivePhase, or -1 without amortization; phases gets how many there are.
+	int amortizationPhase(int* phases);
+	std::atomic<int> _amortizationPhases{ 1 };
+	unsigned _amortizationDraws = 0; // render thread
+
+	// Render thread: applies the last SetFeedback, then returns the target
+	// this draw renders into (null without feedback) and the previous output.
+	RenderTarget* beginFeedback(RenderTarget** previous);
+	void endFeedback() { _feedbackWrite ^= 1; }
+	void destroyFeedbackTargets();
+	void* _renderTextureSource = nullptr; // as last set, under texturesMutex
+	string _feedbackSamplerSource; // as last set, under texturesMutex
+	RenderTargetDesc _feedbackDescSource;
+	bool _feedbackPending = false;
+	string _feedbackSampler; // render thread
+	RenderTarget* _feedback[2] = {};
+	int _feedbackWrite = 0;
+
+	string _graphOutput; // under texturesMutex
+	RenderTargetDesc _graphOutputDesc;
+	map<string, string> _graphInputs; // sampler name -> output name
+	RenderTarget* _graphTarget = nullptr; // set by DrawGraphPass for the draw it makes
+	const GraphTextures* _graphTextures = nullptr;
 
 private:
 	LiveMaterial();
@@ -181,6 +528,70 @@ public:
 	virtual ~RenderAPI();
 
 	void GetDebugInfo(int* numCompileTasks, int* numLiveMaterials);
+	void GetLayoutInfo(int* numLayouts, int* numLayoutUsers);
+	void GetMeshInfo(int* numMeshes, int64_t* cpuBytes, int64_t* gpuBytes);
+
+	// Returns the shared layout equal to this freshly reflected one if there
+	// is one (deleting the argument), otherwise takes ownership of it.
+	UniformLayoutRef InternLayout(UniformLayout* layout);
+
+	// Same for meshes; the hash must already be set.
+	MeshRef InternMesh(MeshData* mesh);
+
+	// A texture's dimensions, format and mip count, asked of the backend the
+	// first time and remembered from then on, so draws never query them.
+	// Failures aren't remembered: a texture Unity hasn't allocated storage
+	// for yet is asked about again next time. Render thread only; it's the
+	// one thread every backend can answer on.
+	bool GetTextureInfo(void* nativeTexture, TextureInfo* info);
+
+	// Object::GetInstanceID() -> GetNativeTexturePtr(), shared by every
+	// material so C# resolves each texture once however many use it.
+	// InvalidateTexture forgets a texture that was destroyed or recreated,
+	// along with its TextureInfo, and bumps textureGeneration. Re-pointing an
+	// id does the same for its old pointer, and registering a pointer that
+	// already has a TextureInfo does it for that, since a recycled GL name
+	// or D3D address is a different texture.
+	void* FindTexturePointer(int id);
+	void SetTexturePointer(int id, void* nativeTexture);
+	void InvalidateTexture(int id);
+	uint64_t textureGeneration() const { return _textureGeneration.load(std::memory_order_relaxed); }
+
+	// Views and samplers shared by every material. A view is created the
+	// first time its description is acquired and destroyed when its last
+	// user releases it, so setting a texture again just finds the view it
+	// already has; the view keeps its texture alive meanwhile, so a texture
+	// pointer can't be reused under a cached view. Acquire on the render
+	// thread; release from any. Null when the backend has no such views (GL
+	// binds textures directly).
+	void* AcquireTextureView(const TextureViewDesc& desc);
+	void RetainTextureView(void* view);
+	void ReleaseTextureView(void* view);
+
+	// Samplers are created on first use on the render thread and live until
+	// the backend calls DestroySamplers at device shutdown. Null when the
+	// backend can't make one.
+	void* GetSampler(const SamplerDesc& desc);
+	void DestroySamplers();
+
+	// With OptimizeMeshes set, new meshes are drawn as submitted while the
+	// mesh thread welds and reorders them (see MeshOptimizer.h), then replaced
+	// in every material still using them. Results are cached by input hash.
+	MeshRef FindOptimizedMesh(size_t hash);
+	void QueueMeshOptimization(MeshRef mesh);
+
+	// Transient render targets shared by all materials, render thread only.
+	// A target released mid-frame is handed to the next acquire with the same
+	// description, so passes whose lifetimes don't overlap share memory;
+	// anything still acquired comes back at EndFrame. Targets nobody has
+	// used for a few frames are destroyed, which keeps residency near the
+	// frame's peak.
+	RenderTarget* AcquireRenderTarget(const RenderTargetDesc& desc);
+	RenderTarget* CreateRenderTarget(const RenderTargetDesc& desc); // unpooled; the caller deletes it
+	void ReleaseRenderTarget(RenderTarget* target);
+	void EndFrame();
+	void DestroyRenderTargets();
+	void GetRenderTargetInfo(int* numTargets, int64_t* residentBytes, int64_t* peakResidentBytes, int64_t* framePeakBytes);
 
 	// Process general event like initialization, shutdown, device loss/reset etc.
 	virtual void ProcessDeviceEvent(UnityGfxDeviceEventType type, IUnityInterfaces* interfaces) = 0;
@@ -203,20 +614,49 @@ public:
 	virtual void EndModifyTexture(void* textureHandle, int textureWidth, int textureHeight, int rowPitch, void* dataPtr) = 0;
 
 	LiveMaterial* CreateLiveMaterial();
+	LiveMaterial* CloneLiveMaterial(int parentId);
 	bool DestroyLiveMaterial(int id);
 
 	enum Flags {
-		ShowWarnings = 1
+		ShowWarnings = 1,
+		OptimizeMeshes = 2,
+		MeasureGpuTime = 4, // timer queries around every draw, reported in Stats
+		ValidateGraphics = 8 // report graphics API errors; always on in builds without NDEBUG
 	};
 
 	bool showWarnings() const { return flags & ShowWarnings; }
+	bool optimizeMeshes() const { return (flags & OptimizeMeshes) != 0; }
+	bool measureGpuTime() const { return (flags & MeasureGpuTime) != 0; }
+#ifdef NDEBUG
+	bool validateGraphics() const { return (flags & ValidateGraphics) != 0; }
+#else
+	bool validateGraphics() const { return true; }
+#endif
 	void SetFlags(int flags);
 
 	LiveMaterial* GetLiveMaterialById(int id);
 	LiveMaterial* GetLiveMaterialByIdLocked(int id);
 
 	virtual void QueueCompileTasks(vector<CompileTask> tasks);
-	mutex materialsMutex;
+	InstrumentedMutex materialsMutex{ "materialsMutex" };
+
+	// Must be called with materialsMutex held (i.e. from the render event).
+	// The leader's group is drawn once a frame per uniforms slot, so every
+	// member may issue the event, but only once they've all submitted; a
+	// leader in no group is drawn alone.
+	void DrawInstanced(int leaderId, int uniformIndex);
+
+	// Materials call this when they're created or destroyed, or their
+	// instancing flag, program, mesh or resources change, so DrawInstanced regroups.
+	void instanceGroupsChanged() { _instanceGroupsVersion.fetch_add(1, std::memory_order_release); }
+
+	// Draws every material with a graph output or input, producers before
+	// their consumers, skipping producers whose output nothing draws from.
+	// Materials without an output are the sinks that keep the rest alive.
+	// Outputs come from the render target pool and go back after their last
+	// consumer, so later passes reuse them. Same locking as DrawInstanced.
+	void ExecuteGraph(int uniformIndex);
+	void GetGraphInfo(int* numPasses, int* numCulled);
 
 	virtual void ClearCompileCache();
 
@@ -228,10 +668,78 @@ protected:
 	int liveMaterialCount = 0;
 	map<int, LiveMaterial*> liveMaterials;
 
+	InstrumentedMutex layoutsMutex{ "layoutsMutex" };
+	multimap<size_t, std::weak_ptr<const UniformLayout>> layouts; // keyed by UniformLayout::programHash
+	size_t layoutsSweepSize = 0; // layouts is swept of expired entries once it grows this big
+
+	InstrumentedMutex meshesMutex{ "meshesMutex" };
+	multimap<size_t, std::weak_ptr<const MeshData>> meshes; // keyed by MeshData::hash
+	map<size_t, std::weak_ptr<const MeshData>> optimizedMeshes; // by the hash of the mesh as submitted
+	size_t meshesSweepSize = 0, optimizedMeshesSweepSize = 0; // as for layouts
+
+	struct MeshTask {
+		MeshRef mesh;
+		bool quitting = false;
+	};
+	Queue<MeshTask> meshQueue;
+	InstrumentedMutex meshThreadMutex{ "meshThreadMutex" };
+	thread meshThread; // started by the first QueueMeshOptimization
+	void runMeshFunc();
+
+	virtual RenderTarget* _newRenderTarget(const RenderTargetDesc& desc);
+
+	virtual bool _describeTexture(void* nativeTexture, TextureInfo* info);
+	InstrumentedMutex textureRegistryMutex{ "textureRegistryMutex" };
+	map<int, void*> texturePointers;
+	map<void*, TextureInfo> textureInfos;
+	std::atomic<uint64_t> _textureGeneration{ 0 };
+
+	virtual void* _newTextureView(const TextureViewDesc& desc);
+	virtual void _deleteTextureView(void* view);
+	virtual void* _newSampler(const SamplerDesc& desc);
+	virtual void _deleteSampler(void* sampler);
+	struct SharedTextureView {
+		void* view;
+		int users;
+	};
+	InstrumentedMutex textureViewsMutex{ "textureViewsMutex" };
+	map<TextureViewDesc, SharedTextureView> textureViews;
+	map<void*, TextureViewDesc> textureViewDescs; // the same views, by pointer
+	map<SamplerDesc, void*> samplers; // also under textureViewsMutex
+
+	vector<RenderTarget*> renderTargets; // every resident target, acquired or not
+	uint64_t frameIndex = 0;
+	size_t acquiredBytes = 0;
+	size_t framePeakBytes = 0; // most bytes acquired at once this frame
+	std::atomic<int> renderTargetCount{ 0 };
+	std::atomic<int64_t> residentBytes{ 0 };
+	std::atomic<int64_t> peakResidentBytes{ 0 };
+	std::atomic<int64_t> lastFramePeakBytes{ 0 };
+
+	std::atomic<int> graphPasses{ 0 }; // of the last ExecuteGraph
+	std::atomic<int> graphCulled{ 0 };
+
+	vector<unsigned char> instanceData; // scratch for DrawInstanced, reused across frames
+	vector<LiveMaterial*> instanceMembers;
+
+	// Instancing-enabled materials by InstanceKey, in id order, and the
+	// group of each; rebuilt on the next DrawInstanced after instanceGroupsChanged.
+	struct InstanceGroup {
+		vector<LiveMaterial*> members;
+		uint64_t drawnFrame = (uint64_t)-1;
+		int drawnUniformIndex = -1;
+	};
+	map<InstanceKey, InstanceGroup> instanceGroups;
+	map<const LiveMaterial*, InstanceGroup*> instanceGroupOf;
+	std::atomic<uint64_t> _instanceGroupsVersion{ 1 };
+	uint64_t instanceGroupsBuilt = 0;
+	void updateInstanceGroups();
+
 	static void compileThreadFunc(RenderAPI* renderAPI);
 	friend void compileThreadFunc(RenderAPI* renderAPI);
 
 	virtual LiveMaterial* _newLiveMaterial(int id);
+	LiveMaterial* _createLiveMaterialLocked();
 
 };
 
@@ -239,3 +747,7 @@ protected:
 // Create a graphics API implementation instance for the given API type.
 RenderAPI* CreateRenderAPI(UnityGfxRenderer apiType);
 
+// How long the Null backend's stub compiler takes per shader, to stand in
+// for a real compiler when benchmarking; 0 by default.
+void setNullCompileLatency(int microseconds);
+
@@ -2,6 +2,7 @@
 
 #include "RenderAPI.h"
 #include "PlatformBase.h"
+#include "Profiler.h"
 #include "lrucache.hpp"
 
 // Direct3D 11 implementation of RenderAPI.
@@ -33,6 +34,23 @@ static bool DX_CHECK(HRESULT hr) {
 }
 
 
+// Input elements for a mesh packed in the given layout; see MeshFormat.h.
+static void meshInputElements(const MeshLayout& layout, D3D11_INPUT_ELEMENT_DESC elements[3]) {
+	D3D11_INPUT_ELEMENT_DESC position = { "POSITION", 0,
+		layout.halfPositions() ? DXGI_FORMAT_R16G16B16A16_FLOAT : DXGI_FORMAT_R32G32B32_FLOAT,
+		0, layout.positionOffset, D3D11_INPUT_PER_VERTEX_DATA, 0 };
+	D3D11_INPUT_ELEMENT_DESC normal = { "NORMAL", 0,
+		layout.octahedralNormals() ? DXGI_FORMAT_R16G16_SNORM :
+		layout.packedNormals() ? DXGI_FORMAT_R10G10B10A2_UNORM : DXGI_FORMAT_R32G32B32_FLOAT,
+		0, layout.normalOffset, D3D11_INPUT_PER_VERTEX_DATA, 0 };
+	D3D11_INPUT_ELEMENT_DESC uv = { "TEXCOORD", 0,
+		layout.halfUVs() ? DXGI_FORMAT_R16G16_FLOAT : DXGI_FORMAT_R32G32_FLOAT,
+		0, layout.uvOffset, D3D11_INPUT_PER_VERTEX_DATA, 0 };
+	elements[0] = position;
+	elements[1] = normal;
+	elements[2] = uv;
+}
+
 struct CompileOutput {
 	ShaderType shaderType;
 	string shaderBlob;
@@ -40,6 +58,123 @@ struct CompileOutput {
 	bool success;
 };
 
+// GPU copy of an interned mesh, shared by every material drawing it.
+struct GpuMesh_D3D11 : public GpuMesh
+{
+	virtual ~GpuMesh_D3D11() {
+		SAFE_RELEASE(vertexBuffer);
+		SAFE_RELEASE(indexBuffer);
+	}
+
+	ID3D11Buffer* vertexBuffer = nullptr;
+	ID3D11Buffer* indexBuffer = nullptr;
+	UINT vertexCount = 0;
+	UINT indexCount = 0;
+	DXGI_FORMAT indexFormat = DXGI_FORMAT_R16_UINT;
+};
+
+// A pooled render target and the views materials need to draw into and sample it.
+struct RenderTarget_D3D11 : public RenderTarget
+{
+	virtual ~RenderTarget_D3D11() {
+		SAFE_RELEASE(renderTargetView);
+		SAFE_RELEASE(shaderResourceView);
+		SAFE_RELEASE(texture);
+	}
+
+	virtual void* NativeTexturePtr() const { return texture; }
+
+	ID3D11Texture2D* texture = nullptr;
+	ID3D11RenderTargetView* renderTargetView = nullptr;
+	ID3D11ShaderResourceView* shaderResourceView = nullptr;
+};
+
+// Timestamps around a material's draws, each pair inside a disjoint query
+// for the frequency. They go in a small ring and are read back a few draws
+// later, once the GPU has written them, so nothing waits or flushes.
+class GpuTimer_D3D11
+{
+public:
+	GpuTimer_D3D11() { memset(_slots, 0, sizeof(_slots)); }
+
+	~GpuTimer_D3D11() {
+		for (int i = 0; i < kSlots; ++i) {
+			SAFE_RELEASE(_slots[i].disjoint);
+			SAFE_RELEASE(_slots[i].start);
+			SAFE_RELEASE(_slots[i].end);
+		}
+	}
+
+	// False, leaving the draw untimed, while every slot still waits on the GPU.
+	bool begin(ID3D11Device* device, ID3D11DeviceContext* ctx) {
+		if (_pending == kSlots)
+			return false;
+		Slot& slot = _slots[(_head + _pending) % kSlots];
+		if (!slot.disjoint) {
+			D3D11_QUERY_DESC desc = { D3D11_QUERY_TIMESTAMP_DISJOINT, 0 };
+			HRESULT hr = device->CreateQuery(&desc, &slot.disjoint);
+			desc.Query = D3D11_QUERY_TIMESTAMP;
+			if (SUCCEEDED(hr))
+				hr = device->CreateQuery(&desc, &slot.start);
+			if (SUCCEEDED(hr))
+				hr = device->CreateQuery(&desc, &slot.end);
+			if (FAILED(hr)) {
+				SAFE_RELEASE(slot.disjoint);
+				SAFE_RELEASE(slot.start);
+				SAFE_RELEASE(slot.end);
+				return false;
+			}
+		}
+		ctx->Begin(slot.disjoint);
+		ctx->End(slot.start);
+		_active = true;
+		return true;
+	}
+
+	void end(ID3D11DeviceContext* ctx) {
+		if (!_active)
+			return;
+		Slot& slot = _slots[(_head + _pending) % kSlots];
+		ctx->End(slot.end);
+		ctx->End(slot.disjoint);
+		++_pending;
+		_active = false;
+	}
+
+	// The oldest timed draw's GPU milliseconds, if the GPU is done with it.
+	// A disjoint interval is dropped without a result.
+	bool collect(ID3D11DeviceContext* ctx, float* milliseconds) {
+		while (_pending) {
+			Slot& slot = _slots[_head];
+			D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint;
+			UINT64 start = 0, end = 0;
+			if (ctx->GetData(slot.disjoint, &disjoint, sizeof(disjoint), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK ||
+				ctx->GetData(slot.start, &start, sizeof(start), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK ||
+				ctx->GetData(slot.end, &end, sizeof(end), D3D11_ASYNC_GETDATA_DONOTFLUSH) != S_OK)
+				return false;
+			_head = (_head + 1) % kSlots;
+			--_pending;
+			if (!disjoint.Disjoint && disjoint.Frequency) {
+				*milliseconds = end > start ? (float)((end - start) * 1000.0 / disjoint.Frequency) : 0.0f;
+				return true;
+			}
+		}
+		return false;
+	}
+
+private:
+	static const int kSlots = 4;
+	struct Slot {
+		ID3D11Query* disjoint;
+		ID3D11Query* start;
+		ID3D11Query* end;
+	};
+	Slot _slots[kSlots];
+	int _head = 0; // oldest pending slot
+	int _pending = 0;
+	bool _active = false;
+};
+
 class LiveMaterial_D3D11 : public LiveMaterial
 {
 public:
@@ -59,14 +194,18 @@ public:
 		SAFE_RELEASE(_vertexShader);
 		SAFE_RELEASE(_computeShader);
 		SAFE_RELEASE(_deviceConstantBuffer);
-		SAFE_RELEASE(_samplerState);
 		SAFE_RELEASE(_depthState);
+		SAFE_RELEASE(_amortizedState);
+		destroyAmortizedTarget();
 		SAFE_RELEASE(_renderTargetView);
+		SAFE_RELEASE(_instanceView);
+		SAFE_RELEASE(_instanceBuffer);
+		SAFE_RELEASE(_inputLayout);
 
 		{ // Cleanup textures
-			lock_guard<mutex> guard(texturesMutex);
+			lock_guard<InstrumentedMutex> guard(texturesMutex);
 			for (size_t i = 0; i < resourceViews.size(); ++i)
-				SAFE_RELEASE(resourceViews[i]);
+				_renderAPI->ReleaseTextureView(resourceViews[i]);
 			resourceViews.clear();
 
 			for (size_t i = 0; i < pendingResources.size(); ++i)
@@ -75,7 +214,7 @@ public:
 		}
 
 		{ // Cleanup compile outputs
-			lock_guard<mutex> guard(compileOutputMutex);
+			lock_guard<InstrumentedMutex> guard(compileOutputMutex);
 			compileOutput.clear();
 		}
 	}
@@ -86,7 +225,18 @@ public:
 	virtual bool CanDraw() const;
 
 	virtual void Draw(int uniformIndex);
+	virtual bool DrawInstanced(int uniformIndex, const unsigned char* instanceData, int instanceCount, size_t stride);
 	void DrawD3D11(ID3D11DeviceContext* ctx, int uniformIndex);
+	bool prepareDraw(ID3D11DeviceContext* ctx, int uniformIndex);
+	void drawGeometry(ID3D11DeviceContext* ctx, UINT instanceCount);
+	UINT bindTargetTexture(ID3D11DeviceContext* ctx, const string& samplerName, const RenderTarget_D3D11* target);
+	void copyFeedbackOutput(ID3D11DeviceContext* ctx, const RenderTarget_D3D11* output, ID3D11RenderTargetView* destination);
+	void upscaleToDestination(ID3D11DeviceContext* ctx, const RenderTarget_D3D11* reduced, ID3D11RenderTargetView* destination, const UINT* destinationSize);
+
+	// Temporal amortization's persistent target, recreated when the size or
+	// phase count changes; fresh is set when it was, and has nothing kept yet.
+	const RenderTarget_D3D11* amortizedTarget(const UINT* size, int phases, bool* fresh);
+	void destroyAmortizedTarget();
 
 	virtual bool NeedsRender();
 
@@ -100,22 +250,13 @@ protected:
 
 	ID3D11Device* device() const;
 
-	ID3D11SamplerState* samplerState() {
-		if (!_samplerState) {
-			D3D11_SAMPLER_DESC samplerDesc;
-			memset(&samplerDesc, 0, sizeof(samplerDesc));
-			samplerDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
-			samplerDesc.AddressU = D3D11_TEXTURE_ADDRESS_WRAP;
-			samplerDesc.AddressV = D3D11_TEXTURE_ADDRESS_WRAP;
-			samplerDesc.AddressW = D3D11_TEXTURE_ADDRESS_WRAP;
-			DX_CHECK(device()->CreateSamplerState(&samplerDesc, &_samplerState));
-		}
-
-		return _samplerState;
-	}
-
-	void setupPendingResources(ID3D11DeviceContext* ctx);
+	// Needs texturesMutex; layout is the current one, taken before it.
+	void setupPendingResources(ID3D11DeviceContext* ctx, const UniformLayoutRef& layout);
+	void uploadPendingMesh();
+	void ensureInputLayout();
 	void updateUniforms(ID3D11DeviceContext* ctx, int uniformIndex);
+	void ensureDeviceConstantBuffer();
+	virtual void _AdoptProgram(LiveMaterial* parent);
 
 	// Uniforms
 	ID3D11Buffer* _deviceConstantBuffer = nullptr;
@@ -124,12 +265,42 @@ protected:
 	ID3D11PixelShader* _pixelShader = nullptr;
 	ID3D11VertexShader* _vertexShader = nullptr;
 	ID3D11ComputeShader* _computeShader = nullptr;
-	ID3D11SamplerState* _samplerState = nullptr;
 	ID3D11DepthStencilState* _depthState = nullptr;
 	ID3D11RenderTargetView* _renderTargetView = nullptr;
-
-	// Resource Views (textures)
-	vector<ID3D11ShaderResourceView*> resourceViews;
+	UINT _renderTargetSize[2] = {};
+
+	// The amortized target's color, and a depth-stencil texture holding each
+	// pixel's phase; the state passes where the stencil equals its reference.
+	RenderTarget_D3D11* _amortized = nullptr;
+	ID3D11Texture2D* _amortizedStencil = nullptr;
+	ID3D11DepthStencilView* _amortizedStencilView = nullptr;
+	ID3D11DepthStencilState* _amortizedState = nullptr;
+	int _amortizedPhases = 0;
+
+	GpuTimer_D3D11 _gpuTimer;
+
+	// Mesh from SetMesh, uploaded by whichever material draws it first; the
+	// quad is drawn when there is none. _gpuMesh points into _mesh->gpu.
+	std::shared_ptr<const string> _vertexShaderBlob;
+	ID3D11InputLayout* _inputLayout = nullptr; // for _meshLayout and the current vertex shader
+	MeshLayout _meshLayout = MeshLayout::forQuantization(MeshQuantizeNone);
+	MeshRef _mesh;
+	const GpuMesh_D3D11* _gpuMesh = nullptr;
+
+	// Instancing
+	ID3D11Buffer* _instanceBuffer = nullptr;
+	ID3D11ShaderResourceView* _instanceView = nullptr;
+	UINT _instanceBufferSize = 0;
+
+	// Resource Views (textures), each a use of RenderAPI's shared view
+	vector<ID3D11ShaderResourceView*> resourceViews;
+	vector<TextureInfo> textureInfos; // by slot, for _TexelSize; render thread only
+
+	// By slot, from RenderAPI::GetSampler, which owns them. Looked up again
+	// when SetSampler is called or the layout changes; render thread only.
+	vector<ID3D11SamplerState*> _samplers;
+	UniformLayoutRef _samplersLayout;
+	uint64_t _samplersBuiltVersion = 0;
 
 	struct PendingResource {
 		PendingResource(ID3D11Resource* resource_, size_t index_, string name_)
@@ -144,10 +315,9 @@ protected:
 	};
 
 	vector<PendingResource> pendingResources;
-	map<string, size_t> resourceViewIndexes;
 
 	// Compile outputs
-	mutex compileOutputMutex;
+	InstrumentedMutex compileOutputMutex{ "compileOutputMutex" };
 	vector<CompileOutput> compileOutput;
 };
 
@@ -179,7 +349,7 @@ bool LiveMaterial_D3D11::CanDraw() const {
 }
 
 bool LiveMaterial_D3D11::NeedsRender() {
-	lock_guard<mutex> guard(compileOutputMutex);
+	lock_guard<InstrumentedMutex> guard(compileOutputMutex);
 	for (size_t i = 0; i < compileOutput.size(); ++i)
 		if (compileOutput[i].success)
 			return true;
@@ -190,12 +360,14 @@ void LiveMaterial_D3D11::SetDepthWritesEnabled(bool enabled) {
 }
 
 void LiveMaterial_D3D11::_SetTexture(const char* name, void* nativeTexturePtr) {
-	lock_guard<mutex> guard(texturesMutex);
-
-	auto iter = resourceViewIndexes.find(name);
+	auto layout = currentLayout();
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
 
 	// Ignore if the texture doesn't have a slot in the shader.
-	if (iter == resourceViewIndexes.end())
+	if (!layout)
+		return;
+	auto iter = layout->textureSlots.find(name);
+	if (iter == layout->textureSlots.end())
 		return;
 
 	// Increment the texture's reference count; we'll use it later on the render thread.
@@ -208,18 +380,21 @@ void LiveMaterial_D3D11::_SetTexture(const char* name, void* nativeTexturePtr) {
 }
 
 void LiveMaterial_D3D11::SetRenderTexture(void* nativeTexturePtr) {
-	lock_guard<mutex> guard(texturesMutex);
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	_renderTextureSource = nativeTexturePtr;
 	auto resource = (ID3D11Resource*)nativeTexturePtr;
 	if (resource) resource->AddRef();
 	pendingResources.push_back(PendingResource(resource, -1, ""));
+	touchInputs();
 }
 
 void LiveMaterial_D3D11::QueueCompileOutput(CompileOutput& output) {
-	lock_guard<mutex> guard(compileOutputMutex);
+	lock_guard<InstrumentedMutex> guard(compileOutputMutex);
 	compileOutput.push_back(output);
 }
 
 void LiveMaterial_D3D11::constantBufferReflect(const string& shaderBlob) {
+	ProfileScope scope("reflection", id());
 	auto pReflector = shaderReflector(shaderBlob);
 	if (!pReflector)
 		return;
@@ -227,115 +402,102 @@ void LiveMaterial_D3D11::constantBufferReflect(const string& shaderBlob) {
 	D3D11_SHADER_DESC desc;
 	pReflector->GetDesc(&desc);
 
+	_stats.instructionCount = desc.InstructionCount;
+
+	auto layout = new UniformLayout();
+	layout->programHash = std::hash<string>()(shaderBlob);
+
 	UINT maxBind = 0;
 	for (UINT i = 0; i < desc.BoundResources; ++i) {
 		D3D11_SHADER_INPUT_BIND_DESC inputBindDesc;
 		if (DX_CHECK(pReflector->GetResourceBindingDesc(i, &inputBindDesc))) {
 			maxBind = max(maxBind, inputBindDesc.BindPoint);
+			layout->textureSlots[inputBindDesc.Name] = inputBindDesc.BindPoint;
 		}
 	}
-
-	_stats.instructionCount = desc.InstructionCount;
-
-	{
-		lock_guard<mutex> guard(texturesMutex);
-		for (size_t i = 0; i < resourceViews.size(); ++i)
-			SAFE_RELEASE(resourceViews[i]);
-		resourceViews.clear();
-		for (UINT i = 0; i < maxBind + 1; ++i)
-			resourceViews.push_back(nullptr);
-		for (UINT i = 0; i < desc.BoundResources; ++i) {
-			D3D11_SHADER_INPUT_BIND_DESC inputBindDesc;
-			if (DX_CHECK(pReflector->GetResourceBindingDesc(i, &inputBindDesc))) {
-				resourceViewIndexes[inputBindDesc.Name] = inputBindDesc.BindPoint;
-			}
-		}
-	}
+	layout->textureSlotCount = maxBind + 1;
 
 	// TODO: if we add enough uniforms, do we need to split them into multiple buffers?
 	if (desc.ConstantBuffers >= 2) {
-		Debug("WARNING: more than one D3D11 constant buffer, not implemented!");
+		DebugWarning("more than one D3D11 constant buffer, not implemented!");
 		assert(false);
 	}
 
-	{
-		lock_guard<mutex> uniformsGuard(uniformsMutex);
-		lock_guard<mutex> gpuGuard(gpuMutex);
-
-		SAFE_RELEASE(_deviceConstantBuffer);
-		auto oldProps = shaderProps;
-		shaderProps.clear();
-		_deviceConstantBufferSize = 0;
-
-		if (desc.ConstantBuffers > 0) {
-			D3D11_SHADER_BUFFER_DESC Description;
-			ID3D11ShaderReflectionConstantBuffer* pConstBuffer = pReflector->GetConstantBufferByIndex(0);
-			pConstBuffer->GetDesc(&Description);
-			for (UINT j = 0; j < Description.Variables; j++) {
-				ID3D11ShaderReflectionVariable* pVariable = pConstBuffer->GetVariableByIndex(j);
-				D3D11_SHADER_VARIABLE_DESC var_desc;
-				pVariable->GetDesc(&var_desc);
-
-				auto var_type = pVariable->GetType();
-
-				D3D11_SHADER_TYPE_DESC type_desc;
-				auto typeHR = var_type->GetDesc(&type_desc);
-				assert(!FAILED(typeHR));
-				string typeName = type_desc.Name;
-
-				PropType propType;
-				if      (typeName == "float4")   propType = PropType::Vector4;
-				else if (typeName == "float3")   propType = PropType::Vector3;
-				else if (typeName == "float2")   propType = PropType::Vector2;
-				else if (typeName == "float")    propType = PropType::Float;
-				else if (typeName == "float4x4") propType = PropType::Matrix;
-				else assert(false);
-
-				int arraySize = type_desc.Elements > 0 ? type_desc.Elements : 1;
-
-				assert(shaderProps.find(var_desc.Name) == shaderProps.end());
-
-				auto prop = shaderProps[var_desc.Name] = new ShaderProp(propType, var_desc.Name);
-				prop->offset = var_desc.StartOffset;
-				prop->size = ShaderProp::sizeForType(propType);
-				prop->arraySize = arraySize;
-				assert(prop->size * prop->arraySize == var_desc.Size);
-
-				int totalSize = prop->arraySize * prop->size;
-				if (arraySize > 1) {
-					//DebugSS("prop " << prop->name << " has size " << prop->size << " and array size of " << prop->arraySize << " for a total of " << totalSize);
-				}
-				_deviceConstantBufferSize = max(_deviceConstantBufferSize, var_desc.StartOffset + totalSize);
-			}
-
-			if (_deviceConstantBufferSize > 0) {
-				// secret microsoft shitiness: buffersize must be aligned to 16 bytes
-				_deviceConstantBufferSize = roundUp(_deviceConstantBufferSize, 16);
-
-				// constant buffer
-				D3D11_BUFFER_DESC bufdesc;
-				memset(&bufdesc, 0, sizeof(bufdesc));
-				bufdesc.Usage = D3D11_USAGE_DEFAULT;
-				bufdesc.ByteWidth = _deviceConstantBufferSize;
-				bufdesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-				bufdesc.CPUAccessFlags = 0;//D3D11_CPU_ACCESS_WRITE;
-
-				HRESULT hr = device()->CreateBuffer(&bufdesc, NULL, &_deviceConstantBuffer);
-				if (FAILED(hr)) {
-					Debug("ERROR: could not create constant buffer:");
-					DebugHR(hr);
-				}
+	UINT deviceConstantBufferSize = 0;
+	if (desc.ConstantBuffers > 0) {
+		D3D11_SHADER_BUFFER_DESC Description;
+		ID3D11ShaderReflectionConstantBuffer* pConstBuffer = pReflector->GetConstantBufferByIndex(0);
+		pConstBuffer->GetDesc(&Description);
+		for (UINT j = 0; j < Description.Variables; j++) {
+			ID3D11ShaderReflectionVariable* pVariable = pConstBuffer->GetVariableByIndex(j);
+			D3D11_SHADER_VARIABLE_DESC var_desc;
+			pVariable->GetDesc(&var_desc);
+
+			auto var_type = pVariable->GetType();
+
+			D3D11_SHADER_TYPE_DESC type_desc;
+			auto typeHR = var_type->GetDesc(&type_desc);
+			assert(!FAILED(typeHR));
+			string typeName = type_desc.Name;
+
+			PropType propType;
+			if      (typeName == "float4")   propType = PropType::Vector4;
+			else if (typeName == "float3")   propType = PropType::Vector3;
+			else if (typeName == "float2")   propType = PropType::Vector2;
+			else if (typeName == "float")    propType = PropType::Float;
+			else if (typeName == "float4x4") propType = PropType::Matrix;
+			else assert(false);
+
+			int arraySize = type_desc.Elements > 0 ? type_desc.Elements : 1;
+
+			assert(layout->props.find(var_desc.Name) == layout->props.end());
+
+			auto prop = layout->props[var_desc.Name] = new ShaderProp(propType, var_desc.Name);
+			prop->offset = var_desc.StartOffset;
+			prop->size = ShaderProp::sizeForType(propType);
+			prop->arraySize = arraySize;
+			assert(prop->size * prop->arraySize == var_desc.Size);
+
+			int totalSize = prop->arraySize * prop->size;
+			if (arraySize > 1) {
+				//DebugSS("prop " << prop->name << " has size " << prop->size << " and array size of " << prop->arraySize << " for a total of " << totalSize);
 			}
+			deviceConstantBufferSize = max(deviceConstantBufferSize, var_desc.StartOffset + totalSize);
 		}
 
-		ensureConstantBufferSize(_deviceConstantBufferSize, &oldProps, &shaderProps);
+		// secret microsoft shitiness: buffersize must be aligned to 16 bytes
+		if (deviceConstantBufferSize > 0)
+			deviceConstantBufferSize = roundUp(deviceConstantBufferSize, 16);
 	}
+	layout->constantBufferSize = deviceConstantBufferSize;
 
 	pReflector->Release();
+
+	// Materials compiled from the same bytecode end up pointing at one layout.
+	auto shared = _renderAPI->InternLayout(layout);
+
+	{
+		lock_guard<InstrumentedMutex> guard(texturesMutex);
+		for (size_t i = 0; i < resourceViews.size(); ++i)
+			_renderAPI->ReleaseTextureView(resourceViews[i]);
+		resourceViews.assign(shared->textureSlotCount, nullptr);
+		textureInfos.assign(shared->textureSlotCount, TextureInfo());
+	}
+
+	{
+		lock_guard<InstrumentedMutex> uniformsGuard(uniformsMutex);
+		lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+
+		// The device constant buffer itself is created on first use; see ensureDeviceConstantBuffer.
+		SAFE_RELEASE(_deviceConstantBuffer);
+		_deviceConstantBufferSize = deviceConstantBufferSize;
+		setLayout(shared);
+	}
 }
 
 void LiveMaterial_D3D11::updateD3D11Shader(CompileOutput output)
 {
+	ProfileScope scope("updateD3D11Shader", id());
 	if (!output.success) {
 		_stats.compileState = CompileState::Error;
 		assert(output.shaderBlob.empty());
@@ -343,6 +505,7 @@ void LiveMaterial_D3D11::updateD3D11Shader(CompileOutput output)
 	}
 
 	_stats.compileState = CompileState::Success;
+	++_programGeneration;
 
 	assert(!output.shaderBlob.empty());
 	if (output.shaderType == Fragment || output.shaderType == Compute)
@@ -357,7 +520,7 @@ void LiveMaterial_D3D11::updateD3D11Shader(CompileOutput output)
 		ID3D11PixelShader* newPixelShader = nullptr;
 		HRESULT hr = device()->CreatePixelShader(buf, bufSize, nullptr, &newPixelShader);
 		if (FAILED(hr)) {
-			Debug("CreatePixelShader failed\n"); DebugHR(hr);
+			DebugError("CreatePixelShader failed"); DebugHR(hr);
 		} else {
 			SAFE_RELEASE(_pixelShader);
 			_pixelShader = newPixelShader;
@@ -369,12 +532,16 @@ void LiveMaterial_D3D11::updateD3D11Shader(CompileOutput output)
 		HRESULT hr = device()->CreateVertexShader(buf, bufSize, nullptr, &newVertexShader);
 		if (FAILED(hr)) {
 			DebugHR(hr);
-			DebugSS("CreateVertexShader failed:" << 
+			DebugError("CreateVertexShader failed:" << 
 				"\n\n inputId: " << output.inputId <<
 				"\n\n shaderType: " << shaderTypeName(output.shaderType));
 		} else {
 			SAFE_RELEASE(_vertexShader);
 			_vertexShader = newVertexShader;
+
+			// Input layouts are validated against this bytecode; see ensureInputLayout.
+			_vertexShaderBlob = std::make_shared<const string>(output.shaderBlob);
+			SAFE_RELEASE(_inputLayout);
 		}
 		break;
 	}
@@ -382,7 +549,7 @@ void LiveMaterial_D3D11::updateD3D11Shader(CompileOutput output)
 		ID3D11ComputeShader* newShader = nullptr;
 		HRESULT hr = device()->CreateComputeShader(buf, bufSize, nullptr, &newShader);
 		if (FAILED(hr)) {
-			Debug("CreateComputeShader failed"); DebugHR(hr);
+			DebugError("CreateComputeShader failed"); DebugHR(hr);
 		} else {
 			SAFE_RELEASE(_computeShader);
 			_computeShader = newShader;
@@ -409,15 +576,26 @@ public:
 	virtual void EndModifyTexture(void* textureHandle, int textureWidth, int textureHeight, int rowPitch, void* dataPtr);
 
 	virtual LiveMaterial* _newLiveMaterial(int id);
+	virtual RenderTarget* _newRenderTarget(const RenderTargetDesc& desc);
+	virtual bool _describeTexture(void* nativeTexture, TextureInfo* info);
+	virtual void* _newTextureView(const TextureViewDesc& desc);
+	virtual void _deleteTextureView(void* view);
+	virtual void* _newSampler(const SamplerDesc& desc);
+	virtual void _deleteSampler(void* sampler);
 	virtual bool compileShader(CompileTask task);
 
 	virtual void ClearCompileCache();
 
 	ID3D11Device* D3D11Device() const { return m_Device; }
 
+	// Draws source over the whole of the bound render target with a bilinear
+	// sampler. Returns false if the shaders couldn't be built.
+	bool Upscale(ID3D11DeviceContext* ctx, ID3D11ShaderResourceView* source);
+
 private:
 	void CreateResources();
 	void ReleaseResources();
+	bool createUpscaleResources();
 
 	ID3D11Device* m_Device;
 	ID3D11Buffer* m_VB; // vertex buffer
@@ -428,6 +606,12 @@ private:
 	ID3D11RasterizerState* m_RasterState;
 	ID3D11BlendState* m_BlendState;
 	ID3D11DepthStencilState* m_DepthState;
+
+	// Full screen triangle for Upscale, compiled on first use.
+	ID3D11VertexShader* m_UpscaleVertexShader;
+	ID3D11PixelShader* m_UpscalePixelShader;
+	ID3D11SamplerState* m_UpscaleSampler;
+	bool m_UpscaleFailed;
 };
 
 
@@ -485,7 +669,7 @@ bool RenderAPI_D3D11::compileShader(CompileTask task)
 		if (optimizationLevel == 1) flags |= D3DCOMPILE_OPTIMIZATION_LEVEL1;
 		if (optimizationLevel == 2) flags |= D3DCOMPILE_OPTIMIZATION_LEVEL2;
 		if (optimizationLevel == 3) flags |= D3DCOMPILE_OPTIMIZATION_LEVEL3;
-		else DebugSS("Unknown optimization level " << optimizationLevel);
+		else DebugWarning("Unknown optimization level " << optimizationLevel);
 		*/
 		flags |= D3DCOMPILE_OPTIMIZATION_LEVEL0;
 		//if (shaderDebugging) {
@@ -493,10 +677,10 @@ bool RenderAPI_D3D11::compileShader(CompileTask task)
 		//}
 		auto profile = profileNameForShaderType(task.shaderType);
 		if (!profile) {
-			Debug("no profile found for shader type");
+			DebugError("no profile found for shader type");
 		}
 		else if (task.src.empty() || task.filename.empty() || task.entryPoint.empty()) {
-			Debug("empty src or srcName or entryPoint");
+			DebugError("empty src or srcName or entryPoint");
 		}
 		else {
 			ID3DBlob *shaderBlob = nullptr;
@@ -504,13 +688,13 @@ bool RenderAPI_D3D11::compileShader(CompileTask task)
 
 			int currentCount = ++compileCount;
 
-			DebugSS("Starting compile " << currentCount);
+			DebugVerbose("Starting compile " << currentCount);
 
 			HRESULT hr = D3DCompile(
 				task.src.data(), task.src.size(), task.filename.c_str(), defines, D3D_COMPILE_STANDARD_FILE_INCLUDE,
 				task.entryPoint.c_str(), profile, flags, 0, &shaderBlob, &errorBlob);
 
-			DebugSS("..finished compile " << currentCount);
+			DebugVerbose("..finished compile " << currentCount);
 
 			string errstr;
 			if (errorBlob)
@@ -520,12 +704,12 @@ bool RenderAPI_D3D11::compileShader(CompileTask task)
 			//writeTextToFile(inputFilename, task.src.c_str());
 
 			if (FAILED(hr)) {
-				DebugSS("Could not compile shader: " << errstr);
+				DebugError("Could not compile shader: " << errstr);
 				//DebugSS("file is at " << inputFilename);
 			}
 			else {
 				if (!errstr.empty() && showWarnings())
-					DebugSS(errstr);
+					DebugError(errstr);
 				output.shaderBlob = string((const char*)shaderBlob->GetBufferPointer(), shaderBlob->GetBufferSize());
 				output.success = true;
 				cacheOutput(task, output);
@@ -536,9 +720,9 @@ bool RenderAPI_D3D11::compileShader(CompileTask task)
 	}
 
 	{
-		lock_guard<mutex> renderAPIGuard(renderAPIMutex);
+		lock_guard<InstrumentedMutex> renderAPIGuard(renderAPIMutex);
 		if (GetCurrentRenderAPI()) {
-			lock_guard<mutex> guard(materialsMutex);
+			lock_guard<InstrumentedMutex> guard(materialsMutex);
 			auto liveMaterial = (LiveMaterial_D3D11*)GetLiveMaterialByIdLocked(task.liveMaterialId);
 			if (liveMaterial)
 				liveMaterial->QueueCompileOutput(output);
@@ -613,6 +797,10 @@ RenderAPI_D3D11::RenderAPI_D3D11()
 	, m_RasterState(NULL)
 	, m_BlendState(NULL)
 	, m_DepthState(NULL)
+	, m_UpscaleVertexShader(NULL)
+	, m_UpscalePixelShader(NULL)
+	, m_UpscaleSampler(NULL)
+	, m_UpscaleFailed(false)
 {
 }
 
@@ -629,12 +817,149 @@ void RenderAPI_D3D11::ProcessDeviceEvent(UnityGfxDeviceEventType type, IUnityInt
 		break;
 	}
 	case kUnityGfxDeviceEventShutdown:
+		DestroyRenderTargets();
+		DestroySamplers();
 		ReleaseResources();
 		break;
 	}
 }
 
 
+static const DXGI_FORMAT renderTargetFormats[RenderTargetFormatCount] = {
+	DXGI_FORMAT_R8G8B8A8_UNORM,
+	DXGI_FORMAT_R16G16B16A16_FLOAT,
+	DXGI_FORMAT_R32G32B32A32_FLOAT,
+	DXGI_FORMAT_R16_FLOAT,
+	DXGI_FORMAT_R32_FLOAT,
+};
+
+bool RenderAPI_D3D11::_describeTexture(void* nativeTexture, TextureInfo* info)
+{
+	ID3D11Texture2D* texture = nullptr;
+	if (FAILED(((ID3D11Resource*)nativeTexture)->QueryInterface(IID_ID3D11Texture2D, (void**)&texture)))
+		return false;
+	D3D11_TEXTURE2D_DESC desc;
+	texture->GetDesc(&desc);
+	texture->Release();
+	info->width = (int)desc.Width;
+	info->height = (int)desc.Height;
+	info->mipCount = (int)desc.MipLevels;
+	info->format = (int)desc.Format;
+	return true;
+}
+
+// Views with a format or mip range of their own are only made of 2D
+// textures; anything else gets a view of the whole resource.
+void* RenderAPI_D3D11::_newTextureView(const TextureViewDesc& desc)
+{
+	auto resource = (ID3D11Resource*)desc.texture;
+	D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc;
+	D3D11_SHADER_RESOURCE_VIEW_DESC* viewDescPtr = nullptr;
+	ID3D11Texture2D* texture = nullptr;
+	if ((desc.format || desc.firstMip || desc.mipCount >= 0) &&
+		SUCCEEDED(resource->QueryInterface(IID_ID3D11Texture2D, (void**)&texture))) {
+		D3D11_TEXTURE2D_DESC textureDesc;
+		texture->GetDesc(&textureDesc);
+		texture->Release();
+		memset(&viewDesc, 0, sizeof(viewDesc));
+		viewDesc.Format = desc.format ? (DXGI_FORMAT)desc.format : textureDesc.Format;
+		viewDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+		viewDesc.Texture2D.MostDetailedMip = (UINT)desc.firstMip;
+		viewDesc.Texture2D.MipLevels = desc.mipCount >= 0 ? (UINT)desc.mipCount : (UINT)-1;
+		viewDescPtr = &viewDesc;
+	}
+
+	ID3D11ShaderResourceView* view = nullptr;
+	HRESULT hr = m_Device->CreateShaderResourceView(resource, viewDescPtr, &view);
+	if (FAILED(hr)) {
+		DebugError("Could not CreateShaderResourceView");
+		DebugHR(hr);
+		return nullptr;
+	}
+	return view;
+}
+
+void RenderAPI_D3D11::_deleteTextureView(void* view)
+{
+	((ID3D11ShaderResourceView*)view)->Release();
+}
+
+void* RenderAPI_D3D11::_newSampler(const SamplerDesc& desc)
+{
+	static const D3D11_FILTER filters[SamplerFilterCount] = {
+		D3D11_FILTER_MIN_MAG_MIP_POINT,
+		D3D11_FILTER_MIN_MAG_LINEAR_MIP_POINT,
+		D3D11_FILTER_MIN_MAG_MIP_LINEAR,
+	};
+	static const D3D11_TEXTURE_ADDRESS_MODE addressModes[SamplerWrapCount] = {
+		D3D11_TEXTURE_ADDRESS_WRAP,
+		D3D11_TEXTURE_ADDRESS_CLAMP,
+		D3D11_TEXTURE_ADDRESS_MIRROR,
+	};
+
+	D3D11_SAMPLER_DESC samplerDesc;
+	memset(&samplerDesc, 0, sizeof(samplerDesc));
+	samplerDesc.Filter = desc.anisotropy > 1 ? D3D11_FILTER_ANISOTROPIC : filters[desc.filter];
+	samplerDesc.AddressU = addressModes[desc.wrap];
+	samplerDesc.AddressV = addressModes[desc.wrap];
+	samplerDesc.AddressW = addressModes[desc.wrap];
+	samplerDesc.MaxAnisotropy = (UINT)desc.anisotropy;
+	samplerDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+	samplerDesc.MaxLOD = desc.mipmapped ? D3D11_FLOAT32_MAX : 0.0f;
+
+	ID3D11SamplerState* sampler = nullptr;
+	DX_CHECK(m_Device->CreateSamplerState(&samplerDesc, &sampler));
+	return sampler;
+}
+
+void RenderAPI_D3D11::_deleteSampler(void* sampler)
+{
+	((ID3D11SamplerState*)sampler)->Release();
+}
+
+RenderTarget* RenderAPI_D3D11::_newRenderTarget(const RenderTargetDesc& desc)
+{
+	D3D11_TEXTURE2D_DESC texDesc;
+	memset(&texDesc, 0, sizeof(texDesc));
+	texDesc.Width = desc.width;
+	texDesc.Height = desc.height;
+	texDesc.MipLevels = 1;
+	texDesc.ArraySize = 1;
+	texDesc.Format = renderTargetFormats[desc.format];
+	texDesc.SampleDesc.Count = desc.samples;
+	texDesc.Usage = D3D11_USAGE_DEFAULT;
+	texDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+
+	UINT qualityLevels = 0;
+	if (desc.samples > 1 && (FAILED(m_Device->CheckMultisampleQualityLevels(texDesc.Format, desc.samples, &qualityLevels)) || !qualityLevels)) {
+		DebugError("render target format " << desc.format << " can't have " << desc.samples << " samples");
+		return nullptr;
+	}
+
+	RenderTarget_D3D11* target = new RenderTarget_D3D11();
+	HRESULT hr = m_Device->CreateTexture2D(&texDesc, nullptr, &target->texture);
+	if (SUCCEEDED(hr))
+		hr = m_Device->CreateRenderTargetView(target->texture, nullptr, &target->renderTargetView);
+	if (SUCCEEDED(hr))
+		hr = m_Device->CreateShaderResourceView(target->texture, nullptr, &target->shaderResourceView);
+	if (FAILED(hr)) {
+		DebugError("couldn't create a " << desc.width << "x" << desc.height << " render target: " << std::hex << hr);
+		delete target;
+		return nullptr;
+	}
+
+	// New storage is undefined; start from transparent black.
+	ID3D11DeviceContext* ctx = nullptr;
+	m_Device->GetImmediateContext(&ctx);
+	if (ctx) {
+		const FLOAT clearColor[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		ctx->ClearRenderTargetView(target->renderTargetView, clearColor);
+		ctx->Release();
+	}
+	return target;
+}
+
+
 void RenderAPI_D3D11::CreateResources()
 {
 	D3D11_BUFFER_DESC desc;
@@ -706,6 +1031,103 @@ void RenderAPI_D3D11::ReleaseResources() {
 	SAFE_RELEASE(m_RasterState);
 	SAFE_RELEASE(m_BlendState);
 	SAFE_RELEASE(m_DepthState);
+	SAFE_RELEASE(m_UpscaleVertexShader);
+	SAFE_RELEASE(m_UpscalePixelShader);
+	SAFE_RELEASE(m_UpscaleSampler);
+	m_UpscaleFailed = false;
+}
+
+static const char kUpscaleShaderSource[] =
+	"Texture2D source : register(t0);\n"
+	"SamplerState linearClamp : register(s0);\n"
+	"struct V { float4 pos : SV_Position; float2 uv : TEXCOORD0; };\n"
+	"V vert(uint id : SV_VertexID) {\n"
+	"	V v;\n"
+	"	v.uv = float2((id << 1) & 2, id & 2);\n"
+	"	v.pos = float4(v.uv * float2(2, -2) + float2(-1, 1), 0, 1);\n"
+	"	return v;\n"
+	"}\n"
+	"float4 frag(V v) : SV_Target { return source.Sample(linearClamp, v.uv); }\n";
+
+bool RenderAPI_D3D11::createUpscaleResources() {
+	if (m_UpscaleVertexShader && m_UpscalePixelShader && m_UpscaleSampler)
+		return true;
+	if (m_UpscaleFailed || !m_Device)
+		return false;
+	m_UpscaleFailed = true;
+
+	ID3DBlob* vertexBlob = nullptr;
+	ID3DBlob* pixelBlob = nullptr;
+	ID3DBlob* errorBlob = nullptr;
+	HRESULT hr = D3DCompile(kUpscaleShaderSource, sizeof(kUpscaleShaderSource) - 1, "upscale", nullptr, nullptr,
+		"vert", "vs_5_0", D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, &vertexBlob, &errorBlob);
+	if (SUCCEEDED(hr))
+		hr = D3DCompile(kUpscaleShaderSource, sizeof(kUpscaleShaderSource) - 1, "upscale", nullptr, nullptr,
+			"frag", "ps_5_0", D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, &pixelBlob, &errorBlob);
+	if (FAILED(hr)) {
+		if (errorBlob)
+			DebugError("Could not compile upscale shader: " << string((const char*)errorBlob->GetBufferPointer(), errorBlob->GetBufferSize()));
+	} else {
+		m_Device->CreateVertexShader(vertexBlob->GetBufferPointer(), vertexBlob->GetBufferSize(), nullptr, &m_UpscaleVertexShader);
+		m_Device->CreatePixelShader(pixelBlob->GetBufferPointer(), pixelBlob->GetBufferSize(), nullptr, &m_UpscalePixelShader);
+
+		D3D11_SAMPLER_DESC samplerDesc;
+		memset(&samplerDesc, 0, sizeof(samplerDesc));
+		samplerDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+		samplerDesc.AddressU = samplerDesc.AddressV = samplerDesc.AddressW = D3D11_TEXTURE_ADDRESS_CLAMP;
+		samplerDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+		samplerDesc.MaxLOD = D3D11_FLOAT32_MAX;
+		m_Device->CreateSamplerState(&samplerDesc, &m_UpscaleSampler);
+	}
+	SAFE_RELEASE(vertexBlob);
+	SAFE_RELEASE(pixelBlob);
+	SAFE_RELEASE(errorBlob);
+
+	if (!m_UpscaleVertexShader || !m_UpscalePixelShader || !m_UpscaleSampler) {
+		SAFE_RELEASE(m_UpscaleVertexShader);
+		SAFE_RELEASE(m_UpscalePixelShader);
+		SAFE_RELEASE(m_UpscaleSampler);
+		return false;
+	}
+	m_UpscaleFailed = false;
+	return true;
+}
+
+// Replaces the material's shaders and sampler, which it binds again every
+// draw, but keeps Unity's blend, depth and raster state.
+bool RenderAPI_D3D11::Upscale(ID3D11DeviceContext* ctx, ID3D11ShaderResourceView* source) {
+	if (!createUpscaleResources())
+		return false;
+	ID3D11BlendState* oldBlendState = nullptr;
+	FLOAT oldBlendFactor[4];
+	UINT oldSampleMask = 0;
+	ctx->OMGetBlendState(&oldBlendState, oldBlendFactor, &oldSampleMask);
+	ID3D11DepthStencilState* oldDepthState = nullptr;
+	UINT oldStencilRef = 0;
+	ctx->OMGetDepthStencilState(&oldDepthState, &oldStencilRef);
+	ID3D11RasterizerState* oldRasterState = nullptr;
+	ctx->RSGetState(&oldRasterState);
+
+	ctx->IASetInputLayout(nullptr);
+	ctx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	ctx->VSSetShader(m_UpscaleVertexShader, nullptr, 0);
+	ctx->PSSetShader(m_UpscalePixelShader, nullptr, 0);
+	ctx->PSSetShaderResources(0, 1, &source);
+	ctx->PSSetSamplers(0, 1, &m_UpscaleSampler);
+	ctx->OMSetBlendState(nullptr, nullptr, 0xffffffff);
+	ctx->OMSetDepthStencilState(nullptr, 0);
+	ctx->RSSetState(nullptr);
+	ctx->Draw(3, 0);
+	ID3D11ShaderResourceView* nullView = nullptr;
+	ctx->PSSetShaderResources(0, 1, &nullView);
+
+	ctx->OMSetBlendState(oldBlendState, oldBlendFactor, oldSampleMask);
+	ctx->OMSetDepthStencilState(oldDepthState, oldStencilRef);
+	ctx->RSSetState(oldRasterState);
+	SAFE_RELEASE(oldBlendState);
+	SAFE_RELEASE(oldDepthState);
+	SAFE_RELEASE(oldRasterState);
+	return true;
 }
 
 
@@ -781,8 +1203,8 @@ ID3D11Device* LiveMaterial_D3D11::device() const {
 	return ((RenderAPI_D3D11*)_renderAPI)->D3D11Device();
 }
 
-void LiveMaterial_D3D11::setupPendingResources(ID3D11DeviceContext* ctx) {
-
+void LiveMaterial_D3D11::setupPendingResources(ID3D11DeviceContext* ctx, const UniformLayoutRef& layout) {
+	ProfileScope scope("setupPendingResources", id());
 	for (size_t i = 0; i < pendingResources.size(); ++i) {
 		auto resource = pendingResources[i].resource;
 		auto index = pendingResources[i].index;
@@ -798,11 +1220,11 @@ void LiveMaterial_D3D11::setupPendingResources(ID3D11DeviceContext* ctx) {
 				D3D11_RESOURCE_DIMENSION resourceDimension;
 				resource->GetType(&resourceDimension);
 				switch (resourceDimension) {
-				case D3D10_RESOURCE_DIMENSION_UNKNOWN: { Debug("unknown"); break; }
-				case D3D11_RESOURCE_DIMENSION_BUFFER: { Debug("Resource is a buffer."); break; }
-				case D3D11_RESOURCE_DIMENSION_TEXTURE1D: { Debug("Resource is a 1D texture."); break; }
-				case D3D11_RESOURCE_DIMENSION_TEXTURE2D: { Debug("Resource is a 2D texture."); break; }
-				case D3D11_RESOURCE_DIMENSION_TEXTURE3D: { Debug("Resource is a 3D texture."); break;  }
+				case D3D10_RESOURCE_DIMENSION_UNKNOWN: { DebugVerbose("unknown"); break; }
+				case D3D11_RESOURCE_DIMENSION_BUFFER: { DebugVerbose("Resource is a buffer."); break; }
+				case D3D11_RESOURCE_DIMENSION_TEXTURE1D: { DebugVerbose("Resource is a 1D texture."); break; }
+				case D3D11_RESOURCE_DIMENSION_TEXTURE2D: { DebugVerbose("Resource is a 2D texture."); break; }
+				case D3D11_RESOURCE_DIMENSION_TEXTURE3D: { DebugVerbose("Resource is a 3D texture."); break;  }
 				default: assert(false);
 				}
 
@@ -812,39 +1234,32 @@ void LiveMaterial_D3D11::setupPendingResources(ID3D11DeviceContext* ctx) {
 					D3D11_TEXTURE2D_DESC textureDesc;
 					tex2d->GetDesc(&textureDesc);
 
-					DebugSS("render texture size: " << textureDesc.Width << "x" << textureDesc.Height);
+					DebugVerbose("render texture size: " << textureDesc.Width << "x" << textureDesc.Height);
 
 					D3D11_RENDER_TARGET_VIEW_DESC renderTargetViewDesc;
 					renderTargetViewDesc.Format = textureDesc.Format;
 					renderTargetViewDesc.ViewDimension = D3D11_RTV_DIMENSION_TEXTURE2D;
 					renderTargetViewDesc.Texture2D.MipSlice = 0;
 
+					SAFE_RELEASE(_renderTargetView);
 					if (FAILED(device()->CreateRenderTargetView(tex2d, &renderTargetViewDesc, &_renderTargetView))) {
-						Debug("failed creating render target view");
+						DebugError("failed creating render target view");
 					}
+					_renderTargetSize[0] = textureDesc.Width;
+					_renderTargetSize[1] = textureDesc.Height;
+					tex2d->Release();
 				}
 			}
 		}
 		else {
-			auto resourceView = resourceViews[index];
-
-			if (resourceView != nullptr) {
-				SAFE_RELEASE(resourceView);
-				resourceView = nullptr;
-			}
-
-			if (resource) {
-				{
-					HRESULT hr = device()->CreateShaderResourceView(resource, nullptr, &resourceView);
-					if (FAILED(hr)) {
-						Debug("Could not CreateShaderResourceView");
-						DebugHR(hr);
-						resourceView = nullptr;
-					}
-				}
-			}
-
+			// Acquired before the old view is released, so setting the same
+			// texture again keeps its view instead of recreating it.
+			auto resourceView = (ID3D11ShaderResourceView*)_renderAPI->AcquireTextureView(TextureViewDesc(resource));
+			_renderAPI->ReleaseTextureView(resourceViews[index]);
 			resourceViews[index] = resourceView;
+			textureInfos[index] = TextureInfo();
+			if (resource)
+				_renderAPI->GetTextureInfo(resource, &textureInfos[index]);
 		}
 
 		SAFE_RELEASE(resource);
@@ -852,34 +1267,106 @@ void LiveMaterial_D3D11::setupPendingResources(ID3D11DeviceContext* ctx) {
 
 	pendingResources.clear();
 
+	if (resourceViews.empty())
+		return;
 	ctx->PSSetShaderResources(0, (UINT)resourceViews.size(), &resourceViews[0]);
 
-	// TODO: is the number of samplers equal to the number of resource views? no idea
-	vector<ID3D11SamplerState*> samplers;
-	auto sampler = samplerState();
-	assert(sampler);
-	const UINT numSamplers = (UINT)resourceViews.size();
-	for (UINT i = 0; i < numSamplers; ++i)
-		samplers.push_back(sampler);
-	ctx->PSSetSamplers(0, numSamplers, &samplers[0]);
+	// Reflection puts samplers in textureSlots too, by their own register.
+	// A sampler takes the setting for its own name, or for the texture it's
+	// named after (sampler_MainTex for _MainTex), or, for sampler2D-style
+	// shaders whose texture and sampler share a register, the texture's.
+	if (_samplers.size() != resourceViews.size() || _samplersLayout != layout || _samplersBuiltVersion != samplersVersion()) {
+		_samplers.assign(resourceViews.size(), (ID3D11SamplerState*)_renderAPI->GetSampler(SamplerDesc()));
+		if (layout) {
+			for (auto i = layout->textureSlots.begin(); i != layout->textureSlots.end(); ++i) {
+				const string& name = i->first;
+				SamplerDesc desc;
+				if (i->second < _samplers.size() && (samplerSetFor(name, &desc) ||
+					(name.compare(0, 7, "sampler") == 0 && samplerSetFor(name.substr(7), &desc))))
+					_samplers[i->second] = (ID3D11SamplerState*)_renderAPI->GetSampler(desc);
+			}
+		}
+		_samplersLayout = layout;
+		_samplersBuiltVersion = samplersVersion();
+	}
+	ctx->PSSetSamplers(0, (UINT)_samplers.size(), &_samplers[0]);
 }
 
-void LiveMaterial_D3D11::updateUniforms(ID3D11DeviceContext* ctx, int uniformIndex) {
+void LiveMaterial_D3D11::ensureDeviceConstantBuffer() {
+	if (_deviceConstantBuffer || _deviceConstantBufferSize == 0)
+		return;
 
+	// constant buffer
+	D3D11_BUFFER_DESC bufdesc;
+	memset(&bufdesc, 0, sizeof(bufdesc));
+	bufdesc.Usage = D3D11_USAGE_DEFAULT;
+	bufdesc.ByteWidth = _deviceConstantBufferSize;
+	bufdesc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+	bufdesc.CPUAccessFlags = 0;//D3D11_CPU_ACCESS_WRITE;
+
+	HRESULT hr = device()->CreateBuffer(&bufdesc, NULL, &_deviceConstantBuffer);
+	if (FAILED(hr)) {
+		DebugError("could not create constant buffer");
+		DebugHR(hr);
+	}
+}
+
+void LiveMaterial_D3D11::updateUniforms(ID3D11DeviceContext* ctx, int uniformIndex) {
+	ProfileScope scope("updateUniforms", id());
 	assert(uniformIndex < MAX_GPU_BUFFERS);
-	if (_deviceConstantBuffer && _deviceConstantBufferSize > 0) {
-		ctx->UpdateSubresource(_deviceConstantBuffer, 0, 0, _gpuBuffer + _constantBufferSize * uniformIndex, 0, 0);
+	ensureDeviceConstantBuffer();
+	auto block = drawBlock(uniformIndex, textureInfos);
+	if (_deviceConstantBuffer && _deviceConstantBufferSize > 0 && block)
+		ctx->UpdateSubresource(_deviceConstantBuffer, 0, 0, block, 0, 0);
+}
+
+void LiveMaterial_D3D11::_AdoptProgram(LiveMaterial* parentMaterial) {
+	auto parent = (LiveMaterial_D3D11*)parentMaterial;
+
+	// Shaders are refcounted by D3D, so sharing them is just an AddRef.
+	if (parent->_pixelShader) parent->_pixelShader->AddRef();
+	if (parent->_vertexShader) parent->_vertexShader->AddRef();
+	if (parent->_computeShader) parent->_computeShader->AddRef();
+	SAFE_RELEASE(_pixelShader);
+	SAFE_RELEASE(_vertexShader);
+	SAFE_RELEASE(_computeShader);
+	SAFE_RELEASE(_inputLayout);
+	_pixelShader = parent->_pixelShader;
+	_vertexShader = parent->_vertexShader;
+	_computeShader = parent->_computeShader;
+	_vertexShaderBlob = parent->_vertexShaderBlob;
+	_stats.instructionCount = parent->_stats.instructionCount;
+
+	{
+		lock_guard<InstrumentedMutex> parentGuard(parent->texturesMutex);
+		lock_guard<InstrumentedMutex> guard(texturesMutex);
+		for (size_t i = 0; i < resourceViews.size(); ++i)
+			_renderAPI->ReleaseTextureView(resourceViews[i]);
+		resourceViews = parent->resourceViews;
+		for (size_t i = 0; i < resourceViews.size(); ++i)
+			_renderAPI->RetainTextureView(resourceViews[i]);
+		textureInfos = parent->textureInfos;
+	}
+
+	LiveMaterial::_AdoptProgram(parent);
+
+	lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+	if (_deviceConstantBufferSize != parent->_deviceConstantBufferSize) {
+		SAFE_RELEASE(_deviceConstantBuffer);
+		_deviceConstantBufferSize = parent->_deviceConstantBufferSize;
 	}
 }
 
-void LiveMaterial_D3D11::DrawD3D11(ID3D11DeviceContext* ctx, int uniformIndex) {
+bool LiveMaterial_D3D11::prepareDraw(ID3D11DeviceContext* ctx, int uniformIndex) {
 	vector<CompileOutput> outputs;
 
+	syncWithParent();
+
 	if (_depthState)
 		ctx->OMSetDepthStencilState(_depthState, 0);
 
 	{
-		lock_guard<mutex> guard(compileOutputMutex);
+		lock_guard<InstrumentedMutex> guard(compileOutputMutex);
 		outputs = compileOutput;
 		compileOutput.clear();
 	}
@@ -887,42 +1374,414 @@ void LiveMaterial_D3D11::DrawD3D11(ID3D11DeviceContext* ctx, int uniformIndex) {
 	for (size_t i = 0; i < outputs.size(); ++i)
 		updateD3D11Shader(outputs[i]);
 	
-	if (_drawingEnabled && _pixelShader && _vertexShader) {
-		{
-			lock_guard<mutex> guard(texturesMutex);
-			setupPendingResources(ctx);
-		}
+	if (!_drawingEnabled || !_pixelShader || !_vertexShader) {
+		//DebugSS("Can't draw, no pixel or vertex shader in (id=" << id() << ", ptr=" << this << ")");
+		return false;
+	}
 
-		{
-			lock_guard<mutex> uniformsGuard(uniformsMutex);
-			lock_guard<mutex> gpuGuard(gpuMutex);
-			updateUniforms(ctx, uniformIndex);
+	{
+		auto layout = currentLayout();
+		lock_guard<InstrumentedMutex> guard(texturesMutex);
+		setupPendingResources(ctx, layout);
+	}
 
-		}
+	{
+		lock_guard<InstrumentedMutex> uniformsGuard(uniformsMutex);
+		lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+		updateUniforms(ctx, uniformIndex);
 
-		ctx->VSSetShader (_vertexShader, NULL, 0);		
-		ctx->PSSetShader (_pixelShader, NULL, 0);
-		ctx->PSSetConstantBuffers(0, 1, &_deviceConstantBuffer);
+	}
+
+	uploadPendingMesh();
+	ensureInputLayout();
+
+	ctx->VSSetShader (_vertexShader, NULL, 0);		
+	ctx->PSSetShader (_pixelShader, NULL, 0);
+	ctx->PSSetConstantBuffers(0, 1, &_deviceConstantBuffer);
+	if (_gpuMesh && _inputLayout) {
+		const UINT stride = _meshLayout.stride;
+		const UINT offset = 0;
+		ctx->IASetInputLayout(_inputLayout);
+		ctx->IASetVertexBuffers(0, 1, &_gpuMesh->vertexBuffer, &stride, &offset);
+		ctx->IASetIndexBuffer(_gpuMesh->indexBuffer, _gpuMesh->indexFormat, 0);
+		ctx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+	} else {
 		ctx->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
+	}
+	return true;
+}
 
-		if (_renderTargetView) {
-			ID3D11RenderTargetView* oldRenderTargetView = nullptr;
-			ID3D11DepthStencilView* oldDepthStencilView = nullptr;
-			ctx->OMGetRenderTargets(1, &oldRenderTargetView, &oldDepthStencilView);
+void LiveMaterial_D3D11::ensureInputLayout() {
+	if (_inputLayout || !_gpuMesh || !_vertexShaderBlob)
+		return;
 
-			DebugSS("old render target " << oldRenderTargetView);
+	// Shaders that only read SV_VertexID simply ignore the elements.
+	D3D11_INPUT_ELEMENT_DESC elements[3];
+	meshInputElements(_meshLayout, elements);
+	if (!DX_CHECK(device()->CreateInputLayout(elements, 3, _vertexShaderBlob->data(), _vertexShaderBlob->size(), &_inputLayout)))
+		DebugError("could not create an input layout for the mesh");
+}
 
-			ctx->OMSetRenderTargets(1, &_renderTargetView, oldDepthStencilView);
-			ctx->Draw(4, 0);
+void LiveMaterial_D3D11::uploadPendingMesh() {
+	ProfileScope scope("uploadPendingMesh", id());
+	MeshRef mesh;
+	if (!takePendingMesh(mesh))
+		return;
+
+	_mesh = mesh;
+	_gpuMesh = nullptr;
+	if (!mesh)
+		return;
+
+	if (mesh->layout.quantization != _meshLayout.quantization)
+		SAFE_RELEASE(_inputLayout);
+	_meshLayout = mesh->layout;
+
+	if (mesh->gpu) {
+		// Another material with the same mesh already uploaded it.
+		_gpuMesh = (const GpuMesh_D3D11*)mesh->gpu.get();
+		return;
+	}
 
-			ctx->OMSetRenderTargets(1, &oldRenderTargetView, oldDepthStencilView);
+	auto gpu = std::make_shared<GpuMesh_D3D11>();
+	const vector<unsigned char>& vertices = mesh->vertices;
+	const vector<uint32_t>& indices = mesh->indices;
+	D3D11_BUFFER_DESC desc;
+	memset(&desc, 0, sizeof(desc));
+	desc.Usage = D3D11_USAGE_IMMUTABLE;
+	desc.ByteWidth = (UINT)vertices.size();
+	desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+	D3D11_SUBRESOURCE_DATA data;
+	memset(&data, 0, sizeof(data));
+	data.pSysMem = vertices.data();
+	if (!DX_CHECK(device()->CreateBuffer(&desc, &data, &gpu->vertexBuffer))) {
+		DebugError("could not create mesh vertex buffer");
+		return;
+	}
+	gpu->vertexCount = mesh->vertexCount;
+	size_t gpuBytes = desc.ByteWidth;
+
+	if (!indices.empty()) {
+		// 16 bit indices whenever the mesh is small enough, for half the index bandwidth.
+		vector<uint16_t> shortIndices;
+		desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+		if (gpu->vertexCount <= 0x10000) {
+			shortIndices.assign(indices.begin(), indices.end());
+			desc.ByteWidth = (UINT)(shortIndices.size() * sizeof(uint16_t));
+			data.pSysMem = shortIndices.data();
+			gpu->indexFormat = DXGI_FORMAT_R16_UINT;
+		} else {
+			desc.ByteWidth = (UINT)(indices.size() * sizeof(uint32_t));
+			data.pSysMem = indices.data();
+			gpu->indexFormat = DXGI_FORMAT_R32_UINT;
 		}
+		if (!DX_CHECK(device()->CreateBuffer(&desc, &data, &gpu->indexBuffer))) {
+			DebugError("could not create mesh index buffer");
+			return;
+		}
+		gpu->indexCount = (UINT)indices.size();
+		gpuBytes += desc.ByteWidth;
+	}
+
+	mesh->gpuBytes = gpuBytes;
+	mesh->gpu = gpu;
+	_gpuMesh = gpu.get();
+}
 
-		ctx->Draw(4, 0);
+void LiveMaterial_D3D11::drawGeometry(ID3D11DeviceContext* ctx, UINT instanceCount) {
+	ProfileScope scope("drawGeometry", id());
+	if (!_gpuMesh || !_inputLayout) {
+		if (instanceCount > 1)
+			ctx->DrawInstanced(4, instanceCount, 0, 0);
+		else
+			ctx->Draw(4, 0);
+	} else if (_gpuMesh->indexBuffer) {
+		if (instanceCount > 1)
+			ctx->DrawIndexedInstanced(_gpuMesh->indexCount, instanceCount, 0, 0, 0);
+		else
+			ctx->DrawIndexed(_gpuMesh->indexCount, 0, 0);
+	} else {
+		if (instanceCount > 1)
+			ctx->DrawInstanced(_gpuMesh->vertexCount, instanceCount, 0, 0);
+		else
+			ctx->Draw(_gpuMesh->vertexCount, 0);
 	}
-	else {
-		//DebugSS("Can't draw, no pixel or vertex shader in (id=" << id() << ", ptr=" << this << ")");
+}
+
+void LiveMaterial_D3D11::DrawD3D11(ID3D11DeviceContext* ctx, int uniformIndex) {
+	ProfileScope scope("Draw", id());
+	int phases = 0;
+	const int phase = amortizationPhase(&phases);
+	if (!prepareDraw(ctx, uniformIndex))
+		return;
+	if (_renderTargetView && drawIsCached(uniformIndex))
+		return;
+
+	float gpuMilliseconds;
+	while (_gpuTimer.collect(ctx, &gpuMilliseconds))
+		recordGpuTime(gpuMilliseconds);
+	const bool timed = gpuTimingWanted() && _gpuTimer.begin(device(), ctx);
+
+	RenderTarget* previousOutput = nullptr;
+	auto feedback = (const RenderTarget_D3D11*)beginFeedback(&previousOutput);
+	vector<UINT> targetSlots; // unbound again after the draw
+	if (feedback)
+		targetSlots.push_back(bindTargetTexture(ctx, _feedbackSampler, (const RenderTarget_D3D11*)previousOutput));
+	if (_graphTextures) {
+		for (size_t i = 0; i < _graphTextures->size(); ++i)
+			targetSlots.push_back(bindTargetTexture(ctx, (*_graphTextures)[i].first, (const RenderTarget_D3D11*)(*_graphTextures)[i].second));
+	}
+
+	// Where the result ends up: the graph's target, else the render texture.
+	ID3D11RenderTargetView* destination = _renderTargetView;
+	UINT destinationSize[2] = { _renderTargetSize[0], _renderTargetSize[1] };
+	if (_graphTarget) {
+		destination = ((const RenderTarget_D3D11*)_graphTarget)->renderTargetView;
+		destinationSize[0] = _graphTarget->desc.width;
+		destinationSize[1] = _graphTarget->desc.height;
+	}
+
+	if (!feedback && !destination) {
+		drawGeometry(ctx, 1);
+		if (timed)
+			_gpuTimer.end(ctx);
+		return;
+	}
+
+	// Amortized draws shade one phase of a persistent target, masked by its
+	// stencil before any pixel shader work, and the whole of it is copied after.
+	const RenderTarget_D3D11* amortized = nullptr;
+	bool amortizedFresh = false;
+	if (phase >= 0 && !feedback && destination)
+		amortized = amortizedTarget(destinationSize, phases, &amortizedFresh);
+
+	// Reduced resolution renders into a pooled target that's upscaled after.
+	const RenderTarget_D3D11* reduced = nullptr;
+	RenderTargetDesc reducedDesc;
+	if (!feedback && !amortized && reducedResolution(destinationSize[0], destinationSize[1], reducedDesc))
+		reduced = (const RenderTarget_D3D11*)_renderAPI->AcquireRenderTarget(reducedDesc);
+	const RenderTarget_D3D11* intermediate = feedback ? feedback : (amortized ? amortized : reduced);
+
+	// Draw only into the intermediate target or the destination. Unity's depth
+	// buffer generally doesn't match its size, so none is bound.
+	ID3D11RenderTargetView* oldRenderTargetView = nullptr;
+	ID3D11DepthStencilView* oldDepthStencilView = nullptr;
+	ctx->OMGetRenderTargets(1, &oldRenderTargetView, &oldDepthStencilView);
+	UINT numViewports = 1;
+	D3D11_VIEWPORT oldViewport;
+	ctx->RSGetViewports(&numViewports, &oldViewport);
+
+	ID3D11RenderTargetView* renderTargetView = intermediate ? intermediate->renderTargetView : destination;
+	D3D11_VIEWPORT viewport = { 0.0f, 0.0f,
+		intermediate ? (FLOAT)intermediate->desc.width : (FLOAT)destinationSize[0],
+		intermediate ? (FLOAT)intermediate->desc.height : (FLOAT)destinationSize[1], 0.0f, 1.0f };
+	ctx->RSSetViewports(1, &viewport);
+	if (amortized && !amortizedFresh) {
+		ctx->OMSetRenderTargets(1, &renderTargetView, _amortizedStencilView);
+		ctx->OMSetDepthStencilState(_amortizedState, (UINT)phase);
+		drawGeometry(ctx, 1);
+		ctx->OMSetDepthStencilState(_depthState, 0);
+	} else {
+		// A fresh amortized target has nothing to keep, so every pixel is shaded once.
+		ctx->OMSetRenderTargets(1, &renderTargetView, nullptr);
+		drawGeometry(ctx, 1);
+	}
+
+	// Unbind the targets sampled; later draws may render into them.
+	ID3D11ShaderResourceView* nullView = nullptr;
+	for (size_t i = 0; i < targetSlots.size(); ++i)
+		if (targetSlots[i] != (UINT)-1)
+			ctx->PSSetShaderResources(targetSlots[i], 1, &nullView);
+
+	if (feedback) {
+		if (destination)
+			copyFeedbackOutput(ctx, feedback, destination);
+		endFeedback();
+	}
+	if (amortized)
+		upscaleToDestination(ctx, amortized, destination, destinationSize); // same size, so a copy
+	if (reduced) {
+		upscaleToDestination(ctx, reduced, destination, destinationSize);
+		_renderAPI->ReleaseRenderTarget((RenderTarget*)reduced);
 	}
+
+	ctx->OMSetRenderTargets(1, &oldRenderTargetView, oldDepthStencilView);
+	if (numViewports)
+		ctx->RSSetViewports(1, &oldViewport);
+	SAFE_RELEASE(oldRenderTargetView);
+	SAFE_RELEASE(oldDepthStencilView);
+	if (timed)
+		_gpuTimer.end(ctx);
+}
+
+// Binds a feedback or graph target over whatever texture the sampler had,
+// returning the slot or -1 if the shader has no such sampler.
+UINT LiveMaterial_D3D11::bindTargetTexture(ID3D11DeviceContext* ctx, const string& samplerName, const RenderTarget_D3D11* target) {
+	auto layout = currentLayout();
+	if (!layout)
+		return (UINT)-1;
+	auto slot = layout->textureSlots.find(samplerName);
+	if (slot == layout->textureSlots.end())
+		return (UINT)-1;
+	ctx->PSSetShaderResources((UINT)slot->second, 1, &target->shaderResourceView);
+	return (UINT)slot->second;
+}
+
+// CopyResource needs matching sizes and formats; D3D11 has no scaling blit.
+void LiveMaterial_D3D11::copyFeedbackOutput(ID3D11DeviceContext* ctx, const RenderTarget_D3D11* output, ID3D11RenderTargetView* destination) {
+	ID3D11Resource* resource = nullptr;
+	destination->GetResource(&resource);
+	ID3D11Texture2D* renderTexture = nullptr;
+	if (resource && SUCCEEDED(resource->QueryInterface(IID_ID3D11Texture2D, (void**)&renderTexture))) {
+		D3D11_TEXTURE2D_DESC outputDesc, renderTextureDesc;
+		output->texture->GetDesc(&outputDesc);
+		renderTexture->GetDesc(&renderTextureDesc);
+		if (outputDesc.Width == renderTextureDesc.Width && outputDesc.Height == renderTextureDesc.Height &&
+			outputDesc.Format == renderTextureDesc.Format && renderTextureDesc.SampleDesc.Count == 1)
+			ctx->CopyResource(renderTexture, output->texture);
+		else if (_renderAPI->showWarnings())
+			DebugWarning("feedback output doesn't match its destination; not copied (id=" << id() << ")");
+		renderTexture->Release();
+	}
+	SAFE_RELEASE(resource);
+}
+
+void LiveMaterial_D3D11::upscaleToDestination(ID3D11DeviceContext* ctx, const RenderTarget_D3D11* reduced, ID3D11RenderTargetView* destination, const UINT* destinationSize) {
+	D3D11_VIEWPORT viewport = { 0.0f, 0.0f, (FLOAT)destinationSize[0], (FLOAT)destinationSize[1], 0.0f, 1.0f };
+	ctx->OMSetRenderTargets(1, &destination, nullptr);
+	ctx->RSSetViewports(1, &viewport);
+	if (!((RenderAPI_D3D11*)_renderAPI)->Upscale(ctx, reduced->shaderResourceView) && _renderAPI->showWarnings())
+		DebugError("couldn't upscale the reduced resolution draw (id=" << id() << ")");
+}
+
+const RenderTarget_D3D11* LiveMaterial_D3D11::amortizedTarget(const UINT* size, int phases, bool* fresh) {
+	if (_amortized && _amortized->desc.width == (int)size[0] && _amortized->desc.height == (int)size[1] && _amortizedPhases == phases) {
+		*fresh = false;
+		return _amortized;
+	}
+	destroyAmortizedTarget();
+	*fresh = true;
+
+	if (!_amortizedState) {
+		D3D11_DEPTH_STENCIL_DESC dsdesc;
+		memset(&dsdesc, 0, sizeof(dsdesc));
+		dsdesc.DepthEnable = FALSE;
+		dsdesc.StencilEnable = TRUE;
+		dsdesc.StencilReadMask = 0xff;
+		dsdesc.StencilWriteMask = 0;
+		dsdesc.FrontFace.StencilFunc = D3D11_COMPARISON_EQUAL;
+		dsdesc.FrontFace.StencilFailOp = dsdesc.FrontFace.StencilDepthFailOp = dsdesc.FrontFace.StencilPassOp = D3D11_STENCIL_OP_KEEP;
+		dsdesc.BackFace = dsdesc.FrontFace;
+		if (FAILED(device()->CreateDepthStencilState(&dsdesc, &_amortizedState)))
+			return nullptr;
+	}
+
+	_amortized = (RenderTarget_D3D11*)_renderAPI->CreateRenderTarget(RenderTargetDesc((int)size[0], (int)size[1], RenderTargetRGBA16F));
+	if (!_amortized)
+		return nullptr;
+	_amortizedPhases = phases;
+
+	// Depth in the low 24 bits, the pixel's phase in the stencil above.
+	vector<uint32_t> pattern((size_t)size[0] * size[1]);
+	for (UINT y = 0; y < size[1]; ++y)
+		for (UINT x = 0; x < size[0]; ++x)
+			pattern[(size_t)y * size[0] + x] = 0x00ffffffu | ((uint32_t)amortizationPhaseAt((int)x, (int)y, phases) << 24);
+
+	D3D11_TEXTURE2D_DESC desc;
+	memset(&desc, 0, sizeof(desc));
+	desc.Width = size[0];
+	desc.Height = size[1];
+	desc.MipLevels = 1;
+	desc.ArraySize = 1;
+	desc.Format = DXGI_FORMAT_D24_UNORM_S8_UINT;
+	desc.SampleDesc.Count = 1;
+	desc.Usage = D3D11_USAGE_DEFAULT;
+	desc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+	D3D11_SUBRESOURCE_DATA data = { pattern.data(), size[0] * (UINT)sizeof(uint32_t), 0 };
+	HRESULT hr = device()->CreateTexture2D(&desc, &data, &_amortizedStencil);
+	if (SUCCEEDED(hr))
+		hr = device()->CreateDepthStencilView(_amortizedStencil, nullptr, &_amortizedStencilView);
+	if (FAILED(hr)) {
+		DebugError("couldn't create a " << size[0] << "x" << size[1] << " amortized target (id=" << id() << ")"); DebugHR(hr);
+		destroyAmortizedTarget();
+	}
+	return _amortized;
+}
+
+void LiveMaterial_D3D11::destroyAmortizedTarget() {
+	SAFE_DELETE(_amortized);
+	SAFE_RELEASE(_amortizedStencilView);
+	SAFE_RELEASE(_amortizedStencil);
+	_amortizedPhases = 0;
+}
+
+bool LiveMaterial_D3D11::DrawInstanced(int uniformIndex, const unsigned char* instanceData, int instanceCount, size_t stride) {
+	ProfileScope scope("DrawInstanced", id());
+	ID3D11DeviceContext* ctx = nullptr;
+	device()->GetImmediateContext(&ctx);
+	if (!ctx)
+		return false;
+
+	bool drawn = false;
+	_drawInstanceStride = stride;
+	const bool prepared = prepareDraw(ctx, uniformIndex);
+	_drawInstanceStride = 0;
+	if (prepared) {
+		size_t slot = (size_t)-1;
+		{
+			lock_guard<InstrumentedMutex> guard(uniformsMutex);
+			if (_layout) {
+				auto iter = _layout->textureSlots.find("_LiveInstanceData");
+				if (iter != _layout->textureSlots.end())
+					slot = iter->second;
+			}
+		}
+
+		UINT byteWidth = (UINT)(stride * instanceCount);
+		if (slot != (size_t)-1 && byteWidth > _instanceBufferSize) {
+			// Grow geometrically so a slowly growing group doesn't reallocate every frame.
+			UINT newSize = max(byteWidth, _instanceBufferSize * 2);
+			SAFE_RELEASE(_instanceView);
+			SAFE_RELEASE(_instanceBuffer);
+			_instanceBufferSize = 0;
+
+			D3D11_BUFFER_DESC desc;
+			memset(&desc, 0, sizeof(desc));
+			desc.Usage = D3D11_USAGE_DYNAMIC;
+			desc.ByteWidth = newSize;
+			desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+			desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+			desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_STRUCTURED;
+			desc.StructureByteStride = 16;
+
+			if (DX_CHECK(device()->CreateBuffer(&desc, nullptr, &_instanceBuffer))) {
+				D3D11_SHADER_RESOURCE_VIEW_DESC viewDesc;
+				memset(&viewDesc, 0, sizeof(viewDesc));
+				viewDesc.Format = DXGI_FORMAT_UNKNOWN;
+				viewDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+				viewDesc.Buffer.FirstElement = 0;
+				viewDesc.Buffer.NumElements = newSize / 16;
+				if (DX_CHECK(device()->CreateShaderResourceView(_instanceBuffer, &viewDesc, &_instanceView)))
+					_instanceBufferSize = newSize;
+				else
+					SAFE_RELEASE(_instanceBuffer);
+			}
+		}
+
+		D3D11_MAPPED_SUBRESOURCE mapped;
+		if (slot != (size_t)-1 && _instanceView && DX_CHECK(ctx->Map(_instanceBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped))) {
+			memcpy(mapped.pData, instanceData, byteWidth);
+			ctx->Unmap(_instanceBuffer, 0);
+
+			ctx->VSSetShaderResources((UINT)slot, 1, &_instanceView);
+			ctx->PSSetShaderResources((UINT)slot, 1, &_instanceView);
+			drawGeometry(ctx, (UINT)instanceCount);
+			drawn = true;
+		}
+	}
+
+	ctx->Release();
+	return drawn;
 }
 
 
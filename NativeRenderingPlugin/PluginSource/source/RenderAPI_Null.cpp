@@ -0,0 +1,361 @@
+#include "RenderAPI.h"
+#include "PlatformBase.h"
+#include "Profiler.h"
+
+#include <chrono>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Null implementation of RenderAPI, for Unity's "null" device (batch mode
+// with -nographics) and for running the plugin's CPU side on machines with
+// no GPU at all. Nothing is compiled or drawn: a stub compiler waits out
+// the latency set with setNullCompileLatency, then lays out the float,
+// float2, float3, float4 and float4x4 globals the source declares the way
+// a constant buffer would be packed. Everything around the GPU calls (the
+// material registry, uniforms, the compile queue, layout and mesh interning,
+// the render target pool) runs as it does with a real device.
+
+static std::atomic<int> nullCompileLatencyUs{ 0 };
+
+void setNullCompileLatency(int microseconds) {
+	nullCompileLatencyUs.store(microseconds > 0 ? microseconds : 0, std::memory_order_relaxed);
+}
+
+// What the stub compiler hands the render thread, with the layout already
+// interned; null for vertex shaders, which declare nothing materials set.
+struct CompileOutput_Null {
+	ShaderType shaderType;
+	UniformLayoutRef layout;
+	bool success;
+};
+
+struct RenderTarget_Null : public RenderTarget {
+	virtual void* NativeTexturePtr() const { return (void*)this; }
+};
+
+class LiveMaterial_Null : public LiveMaterial
+{
+public:
+	LiveMaterial_Null(RenderAPI* renderAPI, int id) : LiveMaterial(renderAPI, id) {}
+
+	void QueueCompileOutput(const CompileOutput_Null& output);
+
+	virtual void Draw(int uniformIndex);
+	virtual bool DrawInstanced(int uniformIndex, const unsigned char* instanceData, int instanceCount, size_t stride);
+	virtual bool Dispatch(int uniformIndex);
+	virtual void SetRenderTexture(void* nativeTexturePtr);
+
+protected:
+	virtual void _SetTexture(const char*, void*) {}
+	virtual void _AdoptProgram(LiveMaterial* parent);
+
+	// Render thread: applies finished compiles and picks up the mesh, then
+	// copies the slot out the way a backend uploads it. False if the shader
+	// that type of draw needs isn't compiled.
+	bool prepare(int uniformIndex, ShaderType shaderType);
+	void applyCompileOutputs();
+
+	bool _compiled[3] = {}; // by ShaderType; render thread only
+	MeshRef _mesh;
+	vector<unsigned char> _deviceBuffer; // stands in for the GPU's constant buffer
+	void* _renderTexture = nullptr; // under texturesMutex
+
+	InstrumentedMutex compileOutputMutex{ "compileOutputMutex" };
+	vector<CompileOutput_Null> compileOutput;
+};
+
+class RenderAPI_Null : public RenderAPI
+{
+public:
+	virtual ~RenderAPI_Null() {}
+
+	virtual void ProcessDeviceEvent(UnityGfxDeviceEventType type, IUnityInterfaces* interfaces);
+	virtual void DrawSimpleTriangles(const float[16], int, const void*) {}
+	virtual void* BeginModifyTexture(void* textureHandle, int textureWidth, int textureHeight, int* outRowPitch);
+	virtual void EndModifyTexture(void* textureHandle, int textureWidth, int textureHeight, int rowPitch, void* dataPtr);
+
+protected:
+	virtual LiveMaterial* _newLiveMaterial(int id) { return new LiveMaterial_Null(this, id); }
+	virtual RenderTarget* _newRenderTarget(const RenderTargetDesc&) { return new RenderTarget_Null(); }
+	virtual bool compileShader(CompileTask task);
+
+	vector<unsigned char> _modifyBuffer;
+};
+
+RenderAPI* CreateRenderAPI_Null() { return new RenderAPI_Null(); }
+
+void RenderAPI_Null::ProcessDeviceEvent(UnityGfxDeviceEventType type, IUnityInterfaces*)
+{
+	if (type == kUnityGfxDeviceEventShutdown)
+		DestroyRenderTargets();
+}
+
+void* RenderAPI_Null::BeginModifyTexture(void*, int textureWidth, int textureHeight, int* outRowPitch)
+{
+	*outRowPitch = textureWidth * 4;
+	_modifyBuffer.resize((size_t)textureWidth * textureHeight * 4);
+	return _modifyBuffer.empty() ? nullptr : &_modifyBuffer[0];
+}
+
+void RenderAPI_Null::EndModifyTexture(void*, int, int, int, void*)
+{
+}
+
+// The source with comments and preprocessor lines blanked out.
+static string stripComments(const string& src) {
+	string out(src);
+	size_t i = 0;
+	bool lineStart = true;
+	while (i < out.size()) {
+		if (out.compare(i, 2, "//") == 0 || (lineStart && out[i] == '#')) {
+			while (i < out.size() && out[i] != '\n')
+				out[i++] = ' ';
+		} else if (out.compare(i, 2, "/*") == 0) {
+			size_t end = out.find("*/", i + 2);
+			end = end == string::npos ? out.size() : end + 2;
+			for (; i < end; ++i)
+				if (out[i] != '\n')
+					out[i] = ' ';
+		} else {
+			if (out[i] == '\n')
+				lineStart = true;
+			else if (!isspace((unsigned char)out[i]))
+				lineStart = false;
+			++i;
+		}
+	}
+	return out;
+}
+
+static bool propTypeNamed(const string& name, PropType* type) {
+	if (name == "float") *type = Float;
+	else if (name == "float2" || name == "vec2") *type = Vector2;
+	else if (name == "float3" || name == "vec3") *type = Vector3;
+	else if (name == "float4" || name == "vec4") *type = Vector4;
+	else if (name == "float4x4" || name == "mat4") *type = Matrix;
+	else return false;
+	return true;
+}
+
+static bool isTextureType(const string& name) {
+	return name.compare(0, 7, "Texture") == 0 || name.compare(0, 7, "sampler") == 0 || name == "SamplerState";
+}
+
+// Adds one global declaration's props or texture slots. Only uniform
+// globals are taken: anything static, const or groupshared is skipped.
+static void declare(const string& statement, UniformLayout* layout, size_t* offset) {
+	string decl = statement.substr(0, statement.find_first_of(":=")); // drop semantics, registers and initializers
+	vector<string> tokens;
+	for (size_t i = 0; i < decl.size();) {
+		if (isalnum((unsigned char)decl[i]) || decl[i] == '_') {
+			size_t start = i;
+			while (i < decl.size() && (isalnum((unsigned char)decl[i]) || decl[i] == '_'))
+				++i;
+			tokens.push_back(decl.substr(start, i - start));
+		} else if (decl[i] == '[' || decl[i] == ']' || decl[i] == ',' || decl[i] == '(' || decl[i] == '<') {
+			tokens.push_back(string(1, decl[i++]));
+		} else {
+			++i;
+		}
+	}
+
+	size_t t = 0;
+	while (t < tokens.size() && (tokens[t] == "uniform" || tokens[t] == "row_major" || tokens[t] == "column_major"))
+		++t;
+	if (t >= tokens.size())
+		return;
+	for (size_t i = t; i < tokens.size(); ++i)
+		if (tokens[i] == "static" || tokens[i] == "const" || tokens[i] == "groupshared" || tokens[i] == "(")
+			return;
+
+	const string& typeName = tokens[t++];
+	PropType type = Float;
+	const bool texture = isTextureType(typeName);
+	if (!texture && !propTypeNamed(typeName, &type))
+		return;
+	if (texture && t < tokens.size() && tokens[t] == "<") // Texture2D<float4>
+		t += 2;
+
+	// One or more declarators: name, name[N], ...
+	while (t < tokens.size()) {
+		const string& name = tokens[t++];
+		int arraySize = 1;
+		if (t < tokens.size() && tokens[t] == "[") {
+			arraySize = t + 1 < tokens.size() ? atoi(tokens[t + 1].c_str()) : 1;
+			t += 3;
+		}
+		if (t < tokens.size() && tokens[t] == ",")
+			++t;
+		if (!isalpha((unsigned char)name[0]) && name[0] != '_')
+			continue;
+
+		if (texture) {
+			if (layout->textureSlots.find(name) == layout->textureSlots.end())
+				layout->textureSlots[name] = layout->textureSlotCount++;
+			continue;
+		}
+		if (arraySize < 1 || layout->props.find(name) != layout->props.end())
+			continue;
+
+		// Constant buffer packing, except that array elements are contiguous
+		// like every backend's reflection hands them to LiveMaterial.
+		const size_t size = ShaderProp::sizeForType(type);
+		if (arraySize > 1 || type == Matrix || (*offset % 16) + size > 16)
+			*offset = (*offset + 15) & ~(size_t)15;
+		if (*offset + size * arraySize > 0xffff)
+			return; // past what a ShaderProp offset can hold
+
+		auto prop = new ShaderProp(type, name);
+		prop->offset = (uint16_t)*offset;
+		prop->size = (uint16_t)size;
+		prop->arraySize = (uint16_t)arraySize;
+		layout->props[name] = prop;
+		*offset += size * arraySize;
+	}
+}
+
+// Walks the top level (and cbuffer blocks) one statement at a time.
+static UniformLayout* layoutFromSource(const string& source) {
+	auto layout = new UniformLayout();
+	layout->programHash = std::hash<string>()(source);
+
+	const string src = stripComments(source);
+	size_t offset = 0;
+	int depth = 0;
+	int cbufferDepth = -1; // depth of the cbuffer block we're in, if any
+	string statement;
+	for (size_t i = 0; i < src.size(); ++i) {
+		const char c = src[i];
+		if (c == '{') {
+			if (depth == 0 && statement.find("cbuffer") != string::npos)
+				cbufferDepth = depth + 1;
+			++depth;
+			statement.clear();
+		} else if (c == '}') {
+			if (depth == cbufferDepth)
+				cbufferDepth = -1;
+			--depth;
+			statement.clear();
+		} else if (c == ';') {
+			if (depth == 0 || depth == cbufferDepth)
+				declare(statement, layout, &offset);
+			statement.clear();
+		} else {
+			statement += c;
+		}
+	}
+
+	layout->constantBufferSize = (offset + 15) & ~(size_t)15;
+	return layout;
+}
+
+bool RenderAPI_Null::compileShader(CompileTask task)
+{
+	const int latency = nullCompileLatencyUs.load(std::memory_order_relaxed);
+	if (latency > 0)
+		std::this_thread::sleep_for(std::chrono::microseconds(latency));
+
+	CompileOutput_Null output;
+	output.shaderType = task.shaderType;
+	output.success = task.src.find("#error") == string::npos;
+	if (output.success && task.shaderType != Vertex)
+		output.layout = InternLayout(layoutFromSource(task.src));
+
+	{
+		lock_guard<InstrumentedMutex> renderAPIGuard(renderAPIMutex);
+		if (GetCurrentRenderAPI()) {
+			lock_guard<InstrumentedMutex> guard(materialsMutex);
+			auto liveMaterial = (LiveMaterial_Null*)GetLiveMaterialByIdLocked(task.liveMaterialId);
+			if (liveMaterial)
+				liveMaterial->QueueCompileOutput(output);
+		}
+	}
+
+	return output.success;
+}
+
+void LiveMaterial_Null::QueueCompileOutput(const CompileOutput_Null& output) {
+	lock_guard<InstrumentedMutex> guard(compileOutputMutex);
+	compileOutput.push_back(output);
+}
+
+void LiveMaterial_Null::applyCompileOutputs() {
+	vector<CompileOutput_Null> outputs;
+	{
+		lock_guard<InstrumentedMutex> guard(compileOutputMutex);
+		outputs.swap(compileOutput);
+	}
+
+	for (size_t i = 0; i < outputs.size(); ++i) {
+		const CompileOutput_Null& output = outputs[i];
+		if (!output.success) {
+			_stats.compileState = CompileState::Error;
+			continue;
+		}
+		_stats.compileState = CompileState::Success;
+		_compiled[output.shaderType] = true;
+		++_programGeneration;
+		if (output.layout) {
+			lock_guard<InstrumentedMutex> uniformsGuard(uniformsMutex);
+			lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+			setLayout(output.layout);
+		}
+	}
+}
+
+void LiveMaterial_Null::_AdoptProgram(LiveMaterial* parentMaterial) {
+	auto parent = (LiveMaterial_Null*)parentMaterial;
+	memcpy(_compiled, parent->_compiled, sizeof(_compiled));
+	LiveMaterial::_AdoptProgram(parent);
+}
+
+bool LiveMaterial_Null::prepare(int uniformIndex, ShaderType shaderType) {
+	syncWithParent();
+	applyCompileOutputs();
+	if (!_drawingEnabled || !_compiled[shaderType])
+		return false;
+
+	MeshRef mesh;
+	if (takePendingMesh(mesh))
+		_mesh = mesh;
+
+	lock_guard<InstrumentedMutex> uniformsGuard(uniformsMutex);
+	lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+	auto block = drawBlock(uniformIndex, vector<TextureInfo>());
+	if (block && _constantBufferSize > 0)
+		_deviceBuffer.assign(block, block + _constantBufferSize);
+	return true;
+}
+
+void LiveMaterial_Null::Draw(int uniformIndex) {
+	ProfileScope scope("Draw", id());
+	int phases;
+	amortizationPhase(&phases);
+	if (!prepare(uniformIndex, Fragment))
+		return;
+	bool hasRenderTexture;
+	{
+		lock_guard<InstrumentedMutex> guard(texturesMutex);
+		hasRenderTexture = _renderTexture != nullptr;
+	}
+	if (hasRenderTexture)
+		drawIsCached(uniformIndex);
+}
+
+bool LiveMaterial_Null::DrawInstanced(int uniformIndex, const unsigned char*, int, size_t) {
+	ProfileScope scope("DrawInstanced", id());
+	return prepare(uniformIndex, Fragment);
+}
+
+bool LiveMaterial_Null::Dispatch(int uniformIndex) {
+	ProfileScope scope("Dispatch", id());
+	return prepare(uniformIndex, Compute);
+}
+
+void LiveMaterial_Null::SetRenderTexture(void* nativeTexturePtr) {
+	lock_guard<InstrumentedMutex> guard(texturesMutex);
+	_renderTextureSource = nativeTexturePtr;
+	_renderTexture = nativeTexturePtr;
+	touchInputs();
+}
@@ -1,8 +1,10 @@
 #include "RenderAPI.h"
 #include "PlatformBase.h"
+#include "Profiler.h"
 
 #include <iostream>
 #include <fstream>
+#include <string.h>
 
 // OpenGL Core profile (desktop) or OpenGL ES (mobile) implementation of RenderAPI.
 // Supports several flavors: Core, ES2, ES3
@@ -20,7 +22,48 @@
 #	include "GLEW/glew.h"
 #endif
 
-#define printOpenGLError() printOglError(__FILE__, __LINE__)
+// GL errors are only looked for while validating (see
+// RenderAPI::validateGraphics). Where KHR_debug is available the driver
+// reports them to onGLDebugMessage as they happen, and the hot path makes no
+// error queries at all; otherwise printOpenGLError falls back to glGetError.
+// checkOpenGLError always queries, for the few places that act on the result.
+// Those call clearOpenGLErrors first: since the hot path no longer drains the
+// error flag, it may still hold an error from Unity's rendering or an
+// earlier unchecked call.
+enum GLValidation { GLValidationOff, GLValidationCallback, GLValidationPoll };
+static GLValidation glValidation = GLValidationOff; // render thread only
+
+#define printOpenGLError() (glValidation == GLValidationPoll ? printOglError(__FILE__, __LINE__) : 0)
+#define checkOpenGLError() printOglError(__FILE__, __LINE__)
+static void clearOpenGLErrors() { while (glGetError() != GL_NO_ERROR) {} }
+
+// What the render thread is doing, so an error can say which material and
+// phase it came from.
+struct GLErrorContext {
+    int materialId;
+    const char* phase;
+    bool probing; // errors are expected and handled, don't report them
+};
+static thread_local GLErrorContext glErrorContext = { -1, nullptr, false };
+
+// Names a phase both in the profile and in the GL errors raised during it.
+class GLPhaseScope {
+public:
+    GLPhaseScope(const char* phase, int materialId) : _profile(phase, materialId), _previous(glErrorContext) {
+        glErrorContext.materialId = materialId;
+        glErrorContext.phase = phase;
+    }
+    ~GLPhaseScope() { glErrorContext = _previous; }
+
+private:
+    ProfileScope _profile;
+    GLErrorContext _previous;
+};
+
+static void writeGLErrorContext(stringstream& ss) {
+    if (glErrorContext.phase)
+        ss << " (id=" << glErrorContext.materialId << ", in " << glErrorContext.phase << ")";
+}
 
 static const char* myGLErrorString(GLenum error) {
     switch (error) {
@@ -42,15 +85,71 @@ int printOglError(const char *file, int line) {
     if (glErr == GL_NO_ERROR)
         return 0;
     
-    const int SIZE = 1024 * 5;
-    char buffer [SIZE];
-
-    snprintf(buffer, SIZE, "glError in %s:%d: %s\n",
-           file, line, myGLErrorString(glErr));
-    Debug(buffer);
+    stringstream ss;
+    ss << "glError in " << file << ":" << line << ": " << myGLErrorString(glErr);
+    writeGLErrorContext(ss);
+    DebugError(ss.str());
     return 1;
 }
 
+#if SUPPORT_OPENGL_CORE
+// The context is Unity's, so whatever debug output it had set up is put back
+// when validation stops, and meanwhile gets every message that isn't ours.
+struct GLDebugState {
+    GLDEBUGPROC callback;
+    const void* userParam;
+    bool output;
+    bool synchronous;
+};
+static GLDebugState unityGLDebugState; // render thread only
+
+static void GLAPIENTRY onGLDebugMessage(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void*) {
+    // Only errors raised inside one of our phases are ours; performance and
+    // other messages, and anything from Unity's own rendering, are not.
+    if (type == GL_DEBUG_TYPE_ERROR && glErrorContext.phase) {
+        if (glErrorContext.probing)
+            return;
+        stringstream ss;
+        ss << "GL error: " << message;
+        writeGLErrorContext(ss);
+        DebugError(ss.str());
+        return;
+    }
+    if (unityGLDebugState.output && unityGLDebugState.callback)
+        unityGLDebugState.callback(source, type, id, severity, length, message, unityGLDebugState.userParam);
+}
+#endif
+
+// Switches between the debug callback, glGetError and no checking at all to
+// match validateGraphics. Render thread only; cheap when nothing changed.
+static void updateGLValidation(bool wanted) {
+    if (wanted == (glValidation != GLValidationOff))
+        return;
+#if SUPPORT_OPENGL_CORE
+    if (GLEW_KHR_debug || GLEW_VERSION_4_3) {
+        GLDebugState& unity = unityGLDebugState;
+        if (wanted) {
+            glGetPointerv(GL_DEBUG_CALLBACK_FUNCTION, (void**)&unity.callback);
+            glGetPointerv(GL_DEBUG_CALLBACK_USER_PARAM, (void**)&unity.userParam);
+            unity.output = glIsEnabled(GL_DEBUG_OUTPUT) == GL_TRUE;
+            unity.synchronous = glIsEnabled(GL_DEBUG_OUTPUT_SYNCHRONOUS) == GL_TRUE;
+            glDebugMessageCallback(onGLDebugMessage, nullptr);
+            glEnable(GL_DEBUG_OUTPUT);
+            glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS); // so the callback runs inside the failing call, in its phase
+        } else {
+            if (!unity.synchronous)
+                glDisable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+            if (!unity.output)
+                glDisable(GL_DEBUG_OUTPUT);
+            glDebugMessageCallback(unity.callback, unity.userParam);
+        }
+        glValidation = wanted ? GLValidationCallback : GLValidationOff;
+        return;
+    }
+#endif
+    glValidation = wanted ? GLValidationPoll : GLValidationOff;
+}
+
 struct CompileOutput {
   ShaderType shaderType;
   GLint program;
@@ -58,6 +157,217 @@ struct CompileOutput {
   bool success;
 };
 
+// Programs and shaders can be shared between cloned materials, so they are
+// refcounted here. Objects whose last user lets go are deleted the next time
+// the render thread draws, since materials may be destroyed from any thread.
+enum GLObjectType { GLShaderObject, GLProgramObject, GLBufferObject, GLTextureObject, GLVertexArrayObject, GLFramebufferObject, GLQueryObject };
+typedef std::pair<GLObjectType, GLuint> GLObjectKey;
+
+static InstrumentedMutex glObjectsMutex("glObjectsMutex");
+static map<GLObjectKey, int> glObjectRefs;
+static vector<GLObjectKey> glObjectsToDelete;
+
+static void retainGLObject(GLObjectType type, GLuint name) {
+    if (!name) return;
+    lock_guard<InstrumentedMutex> guard(glObjectsMutex);
+    glObjectRefs[GLObjectKey(type, name)]++;
+}
+
+static void releaseGLObject(GLObjectType type, GLuint name) {
+    if (!name) return;
+    lock_guard<InstrumentedMutex> guard(glObjectsMutex);
+    auto iter = glObjectRefs.find(GLObjectKey(type, name));
+    assert(iter != glObjectRefs.end());
+    if (iter == glObjectRefs.end() || --iter->second > 0)
+        return;
+    glObjectRefs.erase(iter);
+    glObjectsToDelete.push_back(GLObjectKey(type, name));
+}
+
+// For objects a single material owns; deleted along with released shared ones.
+static void deleteGLObjectLater(GLObjectType type, GLuint name) {
+    if (!name) return;
+    lock_guard<InstrumentedMutex> guard(glObjectsMutex);
+    glObjectsToDelete.push_back(GLObjectKey(type, name));
+}
+
+static void deleteReleasedGLObjects() {
+    vector<GLObjectKey> toDelete;
+    {
+        lock_guard<InstrumentedMutex> guard(glObjectsMutex);
+        if (glObjectsToDelete.empty())
+            return;
+        toDelete.swap(glObjectsToDelete);
+    }
+    for (size_t i = 0; i < toDelete.size(); ++i) {
+        GLuint name = toDelete[i].second;
+        switch (toDelete[i].first) {
+            case GLProgramObject: glDeleteProgram(name); break;
+            case GLShaderObject: glDeleteShader(name); break;
+            case GLBufferObject: glDeleteBuffers(1, &name); break;
+            case GLTextureObject: glDeleteTextures(1, &name); break;
+            case GLFramebufferObject: glDeleteFramebuffers(1, &name); break;
+#if SUPPORT_OPENGL_CORE
+            case GLVertexArrayObject: glDeleteVertexArrays(1, &name); break;
+            case GLQueryObject: glDeleteQueries(1, &name); break;
+#endif
+            default: assert(false);
+        }
+    }
+}
+
+// GPU copy of an interned mesh, shared by every material drawing it.
+struct GpuMesh_GL : public GpuMesh {
+    GpuMesh_GL()
+        : vertexBuffer(0)
+        , indexBuffer(0)
+        , vertexArray(0)
+        , vertexCount(0)
+        , indexCount(0)
+        , indexType(GL_UNSIGNED_SHORT)
+    {
+    }
+
+    virtual ~GpuMesh_GL() {
+        // The last reference may go away on the main thread.
+        deleteGLObjectLater(GLBufferObject, vertexBuffer);
+        deleteGLObjectLater(GLBufferObject, indexBuffer);
+        deleteGLObjectLater(GLVertexArrayObject, vertexArray);
+    }
+
+    void bindAttributes() const;
+
+    GLuint vertexBuffer;
+    GLuint indexBuffer;
+    GLuint vertexArray;
+    GLsizei vertexCount;
+    GLsizei indexCount;
+    GLenum indexType;
+    MeshLayout layout;
+};
+
+// The depth and stencil state an amortized draw changes, for both faces.
+struct GLStencilState {
+    void save() {
+        depthTest = glIsEnabled(GL_DEPTH_TEST);
+        stencilTest = glIsEnabled(GL_STENCIL_TEST);
+        const GLenum front[] = { GL_STENCIL_FUNC, GL_STENCIL_REF, GL_STENCIL_VALUE_MASK, GL_STENCIL_FAIL, GL_STENCIL_PASS_DEPTH_FAIL, GL_STENCIL_PASS_DEPTH_PASS, GL_STENCIL_WRITEMASK };
+        const GLenum back[] = { GL_STENCIL_BACK_FUNC, GL_STENCIL_BACK_REF, GL_STENCIL_BACK_VALUE_MASK, GL_STENCIL_BACK_FAIL, GL_STENCIL_BACK_PASS_DEPTH_FAIL, GL_STENCIL_BACK_PASS_DEPTH_PASS, GL_STENCIL_BACK_WRITEMASK };
+        for (int i = 0; i < 7; ++i) {
+            glGetIntegerv(front[i], &faces[0][i]);
+            glGetIntegerv(back[i], &faces[1][i]);
+        }
+    }
+
+    void restore() const {
+        const GLenum face[] = { GL_FRONT, GL_BACK };
+        for (int i = 0; i < 2; ++i) {
+            glStencilFuncSeparate(face[i], (GLenum)faces[i][0], faces[i][1], (GLuint)faces[i][2]);
+            glStencilOpSeparate(face[i], (GLenum)faces[i][3], (GLenum)faces[i][4], (GLenum)faces[i][5]);
+            glStencilMaskSeparate(face[i], (GLuint)faces[i][6]);
+        }
+        if (depthTest) glEnable(GL_DEPTH_TEST); else glDisable(GL_DEPTH_TEST);
+        if (stencilTest) glEnable(GL_STENCIL_TEST); else glDisable(GL_STENCIL_TEST);
+    }
+
+    GLboolean depthTest;
+    GLboolean stencilTest;
+    GLint faces[2][7]; // func, ref, value mask, fail, depth fail, depth pass, write mask
+};
+
+// Timestamps around a material's draws. They go in a small ring and are read
+// back a few draws later, once the GPU has written them, so nothing waits.
+// Timestamps rather than GL_TIME_ELAPSED since only one of those can be
+// active at a time, and Unity may have its own running.
+class GpuTimer_GL {
+public:
+    GpuTimer_GL() : _head(0), _pending(0), _active(false) { memset(_queries, 0, sizeof(_queries)); }
+
+    ~GpuTimer_GL() {
+        for (int i = 0; i < kSlots; ++i) {
+            deleteGLObjectLater(GLQueryObject, _queries[i][0]);
+            deleteGLObjectLater(GLQueryObject, _queries[i][1]);
+        }
+    }
+
+    static bool supported() {
+#if SUPPORT_OPENGL_CORE
+        return GLEW_ARB_timer_query != 0;
+#else
+        return false;
+#endif
+    }
+
+    // False, leaving the draw untimed, while every slot still waits on the GPU.
+    bool begin() {
+#if SUPPORT_OPENGL_CORE
+        if (_pending == kSlots)
+            return false;
+        GLuint* queries = _queries[(_head + _pending) % kSlots];
+        if (!queries[0])
+            glGenQueries(2, queries);
+        glQueryCounter(queries[0], GL_TIMESTAMP);
+        _active = true;
+#endif
+        return _active;
+    }
+
+    void end() {
+#if SUPPORT_OPENGL_CORE
+        if (!_active)
+            return;
+        glQueryCounter(_queries[(_head + _pending) % kSlots][1], GL_TIMESTAMP);
+        ++_pending;
+        _active = false;
+#endif
+    }
+
+    // The oldest timed draw's GPU milliseconds, if the GPU is done with it.
+    bool collect(float* milliseconds) {
+#if SUPPORT_OPENGL_CORE
+        if (!_pending)
+            return false;
+        GLuint* queries = _queries[_head];
+        GLint available = 0;
+        glGetQueryObjectiv(queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            return false;
+        GLuint64 start = 0, end = 0;
+        glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &end);
+        _head = (_head + 1) % kSlots;
+        --_pending;
+        *milliseconds = end > start ? (float)((end - start) / 1.0e6) : 0.0f;
+        return true;
+#else
+        return false;
+#endif
+    }
+
+private:
+    static const int kSlots = 4;
+    GLuint _queries[kSlots][2]; // start and end timestamps
+    int _head; // oldest pending slot
+    int _pending;
+    bool _active;
+};
+
+// A pooled render target: the texture, and a framebuffer with it attached.
+struct RenderTarget_GL : public RenderTarget {
+    RenderTarget_GL() : texture(0), framebuffer(0), textureTarget(GL_TEXTURE_2D) {}
+
+    virtual ~RenderTarget_GL() {
+        deleteGLObjectLater(GLFramebufferObject, framebuffer);
+        deleteGLObjectLater(GLTextureObject, texture);
+    }
+
+    virtual void* NativeTexturePtr() const { return (void*)(size_t)texture; }
+
+    GLuint texture;
+    GLuint framebuffer;
+    GLenum textureTarget;
+};
+
 class LiveMaterial_GL : public LiveMaterial {
 public:
     LiveMaterial_GL(RenderAPI* renderAPI, int id)
@@ -65,39 +375,121 @@ public:
           , _vertexShader(0)
           , _fragmentShader(0)
           , _program(0)
+          , _computeShader(0)
+          , _vertexSourceHash(0)
+          , _fragmentSourceHash(0)
+          , _computeSourceHash(0)
+          , _instanceDataLoc(-1)
+          , _instanceBuffer(0)
+          , _instanceTexture(0)
+          , _gpuMesh(nullptr)
+          , _pendingRenderTexture(nullptr)
+          , _renderTexturePending(false)
+          , _renderTexture(0)
+          , _framebuffer(0)
+          , _amortized(nullptr)
+          , _amortizedStencil(0)
+          , _amortizedPhases(0)
     {
+        _renderTextureSize[0] = _renderTextureSize[1] = 0;
     }
 
     virtual ~LiveMaterial_GL() {
+        releaseGLObject(GLProgramObject, _program);
+        releaseGLObject(GLShaderObject, _vertexShader);
+        releaseGLObject(GLShaderObject, _fragmentShader);
+        releaseGLObject(GLShaderObject, _computeShader);
+        deleteGLObjectLater(GLBufferObject, _instanceBuffer);
+        deleteGLObjectLater(GLTextureObject, _instanceTexture);
+        destroyAmortizedTarget();
     }
 
     virtual void Draw(int uniformIndex);
+    virtual bool DrawInstanced(int uniformIndex, const unsigned char* instanceData, int instanceCount, size_t stride);
+    virtual bool Dispatch(int uniformIndex);
     virtual bool NeedsRender();
     virtual void _SetTexture(const char* name, void* nativeTexturePtr);
+    virtual void SetRenderTexture(void* nativeTexturePtr);
 
 protected:
     virtual void _QueueCompileTasks(vector<CompileTask> tasks);
     void _discoverUniforms(GLuint program);
+    virtual void _AdoptProgram(LiveMaterial* parent);
 
     void updateUniforms(int uniformsIndex);
     void compileNewShaders();
     void LinkProgram();
 
+    void uploadPendingMesh();
+    void drawGeometry(int instanceCount);
+
+    void bindComputeResources();
+
+    bool resolveRenderTexture();
+    void bindTargetTexture(const string& samplerName, const RenderTarget_GL* target);
+    void copyToDestination(const RenderTarget_GL* output, GLuint destination, const GLint* destinationSize);
+
+    // Temporal amortization's persistent target, recreated when the size or
+    // phase count changes; fresh is set when it was, and has nothing kept yet.
+    const RenderTarget_GL* amortizedTarget(const GLint* size, int phases, bool* fresh);
+    void destroyAmortizedTarget();
+
 	GLuint _vertexShader;
 	GLuint _fragmentShader;
 	GLuint _program;
+    GLuint _computeShader; // set instead of the vertex and fragment shaders for compute materials
+    size_t _vertexSourceHash; // of the source the current shaders were compiled from
+    size_t _fragmentSourceHash;
+    size_t _computeSourceHash;
 
-    // Textures
+    // Textures, indexed by the texture unit the layout assigned
     vector<GLint> textureIDs;
-    vector<GLint> uniformLocs;
-    map<string, size_t> textureUnits;
+    vector<TextureInfo> _textureInfos; // for _TexelSize; render thread only
+    vector<GLint> _textureInfoIDs; // the texture each of those describes
+    uint64_t _textureInfoGeneration = 0; // RenderAPI::textureGeneration they were looked up at
+
+    // Sampler objects from RenderAPI::GetSampler by texture unit, or 0 to
+    // sample by the texture's own parameters. Looked up with the unit's
+    // TextureInfo, since textures without mips need a sampler that doesn't
+    // ask for them; _unitSamplers are the SetSampler settings by unit.
+    GLuint samplerObjectFor(size_t textureUnit);
+    vector<GLuint> _samplerObjects;
+    map<size_t, SamplerDesc> _unitSamplers;
+    UniformLayoutRef _samplersLayout;
+    uint64_t _samplersBuiltVersion = 0;
+
+    // Instancing
+    GLint _instanceDataLoc;
+    GLuint _instanceBuffer;
+    GLuint _instanceTexture;
+
+    // Mesh from SetMesh, uploaded by whichever material draws it first; the
+    // quad is drawn when there is none. _gpuMesh points into _mesh->gpu.
+    MeshRef _mesh;
+    const GpuMesh_GL* _gpuMesh;
+
+    // Offscreen target from SetRenderTexture; the framebuffer belongs to the
+    // RenderAPI's cache and is only looked up again when the texture changes.
+    void* _pendingRenderTexture; // under texturesMutex
+    bool _renderTexturePending;
+    GLuint _renderTexture;
+    GLuint _framebuffer;
+    GLint _renderTextureSize[2];
+
+    // The amortized target's color, plus a depth-stencil texture holding each
+    // pixel's phase that's attached to its framebuffer.
+    RenderTarget_GL* _amortized;
+    GLuint _amortizedStencil;
+    int _amortizedPhases;
+
+    GpuTimer_GL _gpuTimer;
 
 	// Compile outputs
-	mutex compileOutputMutex;
+	InstrumentedMutex compileOutputMutex{ "compileOutputMutex" };
 	vector<CompileOutput> compileOutput;
     
     // Compile inputs
-    mutex compileTaskMutex;
+    InstrumentedMutex compileTaskMutex{ "compileTaskMutex" };
     vector<CompileTask> compileTasks;
 };
 
@@ -116,14 +508,36 @@ public:
 	virtual void EndModifyTexture(void* textureHandle, int textureWidth, int textureHeight, int rowPitch, void* dataPtr);
     
     bool IsOpenGLCore() const { return m_APIType == kUnityGfxRendererOpenGLCore; }
+#if SUPPORT_OPENGL_CORE
+    bool SupportsCompute() const { return IsOpenGLCore() && GLEW_VERSION_4_3; }
+    bool SupportsSamplers() const { return IsOpenGLCore() && (GLEW_VERSION_3_3 || GLEW_ARB_sampler_objects); }
+    // Half float and 2_10_10_10_REV vertex attributes, for quantized meshes.
+    bool SupportsQuantizedMeshes() const { return m_APIType == kUnityGfxRendererOpenGLES30 || (IsOpenGLCore() && GLEW_VERSION_3_3); }
+#else
+    bool SupportsCompute() const { return false; }
+    bool SupportsSamplers() const { return false; }
+    bool SupportsQuantizedMeshes() const { return false; }
+#endif
     virtual LiveMaterial* _newLiveMaterial(int id);
+
+    // A framebuffer with the texture as its only color attachment, created
+    // the first time any material renders to that texture in that format.
+    // Render thread only.
+    GLuint FramebufferFor(GLuint texture, GLint format);
     
+    virtual RenderTarget* _newRenderTarget(const RenderTargetDesc& desc);
 
 protected:
     virtual bool supportsBackgroundCompiles();
+    virtual bool _describeTexture(void* nativeTexture, TextureInfo* info);
+    virtual void* _newSampler(const SamplerDesc& desc);
+    virtual void _deleteSampler(void* sampler);
 
 private:
 	void CreateResources();
+	void DeleteFramebuffers();
+
+	map<std::pair<GLuint, GLint>, GLuint> m_Framebuffers; // (texture, internal format) -> FBO
 
 private:
 	UnityGfxRenderer m_APIType;
@@ -138,7 +552,7 @@ private:
 
 
 bool LiveMaterial_GL::NeedsRender() {
-	lock_guard<mutex> guard(compileOutputMutex);
+	lock_guard<InstrumentedMutex> guard(compileOutputMutex);
 	for (size_t i = 0; i < compileOutput.size(); ++i)
 		if (compileOutput[i].success)
 			return true;
@@ -148,27 +562,540 @@ bool LiveMaterial_GL::NeedsRender() {
 
 
 void LiveMaterial_GL::Draw(int uniformIndex) {
-    assert(glGetError() == GL_NO_ERROR); // Make sure no OpenGL error happen before starting rendering
-    
+    updateGLValidation(_renderAPI->validateGraphics());
+    GLPhaseScope scope("Draw", id());
+
+    deleteReleasedGLObjects();
+    syncWithParent();
     compileNewShaders();
-    if (_program == 0)
+    if (_program == 0 || _computeShader)
+        return;
+    if (_renderTexture && drawIsCached(uniformIndex))
+        return;
+
+    float gpuMilliseconds;
+    while (_gpuTimer.collect(&gpuMilliseconds))
+        recordGpuTime(gpuMilliseconds);
+    const bool core = ((RenderAPI_OpenGLCoreES*)_renderAPI)->IsOpenGLCore();
+    const bool timed = core && gpuTimingWanted() && GpuTimer_GL::supported() && _gpuTimer.begin();
+
+    int phases = 0;
+    const int phase = amortizationPhase(&phases);
+
+    glUseProgram(_program);
+    updateUniforms(uniformIndex);
+    printOpenGLError();
+
+    uploadPendingMesh();
+
+    RenderTarget* previousOutput = nullptr;
+    auto feedback = (const RenderTarget_GL*)beginFeedback(&previousOutput);
+    if (feedback)
+        bindTargetTexture(_feedbackSampler, (const RenderTarget_GL*)previousOutput);
+    if (_graphTextures) {
+        for (size_t i = 0; i < _graphTextures->size(); ++i)
+            bindTargetTexture((*_graphTextures)[i].first, (const RenderTarget_GL*)(*_graphTextures)[i].second);
+    }
+
+    // Where the result ends up: the graph's target, else the render texture.
+    GLuint destination = 0;
+    GLint destinationSize[2] = { 0, 0 };
+    if (_graphTarget) {
+        destination = ((const RenderTarget_GL*)_graphTarget)->framebuffer;
+        destinationSize[0] = _graphTarget->desc.width;
+        destinationSize[1] = _graphTarget->desc.height;
+    } else if (resolveRenderTexture()) {
+        destination = _framebuffer;
+        destinationSize[0] = _renderTextureSize[0];
+        destinationSize[1] = _renderTextureSize[1];
+    }
+
+    // Amortized draws shade one phase of a persistent target, masked by its
+    // stencil before any fragment work, and the whole of it is copied after.
+    const RenderTarget_GL* amortized = nullptr;
+    bool amortizedFresh = false;
+    if (phase >= 0 && !feedback && destination && core)
+        amortized = amortizedTarget(destinationSize, phases, &amortizedFresh);
+
+    // Reduced resolution renders into a pooled target that's upscaled after.
+    const RenderTarget_GL* reduced = nullptr;
+    RenderTargetDesc reducedDesc;
+    if (!feedback && !amortized && destination && core &&
+        reducedResolution(destinationSize[0], destinationSize[1], reducedDesc))
+        reduced = (const RenderTarget_GL*)_renderAPI->AcquireRenderTarget(reducedDesc);
+
+    // Feedback, amortized and reduced draws go to an intermediate target and are copied after.
+    const RenderTarget_GL* intermediate = feedback ? feedback : (amortized ? amortized : reduced);
+    GLint previousFramebuffer = 0;
+    GLint previousViewport[4];
+    const bool offscreen = intermediate || destination;
+    if (offscreen) {
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+        glGetIntegerv(GL_VIEWPORT, previousViewport);
+        if (intermediate) {
+            glBindFramebuffer(GL_FRAMEBUFFER, intermediate->framebuffer);
+            glViewport(0, 0, intermediate->desc.width, intermediate->desc.height);
+        } else {
+            glBindFramebuffer(GL_FRAMEBUFFER, destination);
+            glViewport(0, 0, destinationSize[0], destinationSize[1]);
+        }
+    }
+    if (amortized) {
+        GLStencilState previousStencil;
+        previousStencil.save();
+        glDisable(GL_DEPTH_TEST);
+        if (amortizedFresh) {
+            glDisable(GL_STENCIL_TEST); // nothing to keep, so shade every pixel once
+        } else {
+            glEnable(GL_STENCIL_TEST);
+            glStencilFunc(GL_EQUAL, phase, 0xff);
+            glStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+            glStencilMask(0);
+        }
+        drawGeometry(1);
+        previousStencil.restore();
+    } else {
+        drawGeometry(1);
+    }
+    if (intermediate && destination)
+        copyToDestination(intermediate, destination, destinationSize);
+    if (feedback)
+        endFeedback();
+    if (reduced)
+        _renderAPI->ReleaseRenderTarget((RenderTarget*)reduced);
+    if (offscreen) {
+        glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+        glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+    }
+    if (timed)
+        _gpuTimer.end();
+    printOpenGLError();
+}
+
+// Binds a feedback or graph target over whatever texture the sampler had.
+void LiveMaterial_GL::bindTargetTexture(const string& samplerName, const RenderTarget_GL* target) {
+    auto layout = currentLayout();
+    if (!layout)
+        return;
+    auto slot = layout->textureSlots.find(samplerName);
+    if (slot == layout->textureSlots.end() || slot->second >= layout->textureUniformIndexes.size())
         return;
 
+    const GLint textureUnit = (GLint)slot->second;
+    glActiveTexture(GL_TEXTURE0 + (GLenum)textureUnit);
+    glBindTexture(target->textureTarget, target->texture);
+    glUniform1i(layout->textureUniformIndexes[textureUnit], textureUnit);
+}
+
+const RenderTarget_GL* LiveMaterial_GL::amortizedTarget(const GLint* size, int phases, bool* fresh) {
+    if (_amortized && _amortized->desc.width == size[0] && _amortized->desc.height == size[1] && _amortizedPhases == phases) {
+        *fresh = false;
+        return _amortized;
+    }
+    destroyAmortizedTarget();
+    *fresh = true;
+
+#if SUPPORT_OPENGL_CORE
+    _amortized = (RenderTarget_GL*)_renderAPI->CreateRenderTarget(RenderTargetDesc(size[0], size[1], RenderTargetRGBA16F));
+    if (!_amortized)
+        return nullptr;
+    _amortizedPhases = phases;
+
+    // Depth in the top 24 bits, the pixel's phase in the stencil below.
+    vector<GLuint> pattern((size_t)size[0] * size[1]);
+    for (GLint y = 0; y < size[1]; ++y)
+        for (GLint x = 0; x < size[0]; ++x)
+            pattern[(size_t)y * size[0] + x] = 0xffffff00u | (GLuint)amortizationPhaseAt(x, y, phases);
+
+    clearOpenGLErrors();
+    GLint previousTexture = 0, previousFramebuffer = 0;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTexture);
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+    glGenTextures(1, &_amortizedStencil);
+    glBindTexture(GL_TEXTURE_2D, _amortizedStencil);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, size[0], size[1], 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, pattern.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, previousTexture);
+    glBindFramebuffer(GL_FRAMEBUFFER, _amortized->framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, _amortizedStencil, 0);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+
+    if (checkOpenGLError() || status != GL_FRAMEBUFFER_COMPLETE) {
+        DebugError("couldn't create a " << size[0] << "x" << size[1] << " amortized target (framebuffer status " << status << ", id=" << id() << ")");
+        destroyAmortizedTarget();
+    }
+#endif
+    return _amortized;
+}
+
+void LiveMaterial_GL::destroyAmortizedTarget() {
+    SAFE_DELETE(_amortized);
+    deleteGLObjectLater(GLTextureObject, _amortizedStencil);
+    _amortizedStencil = 0;
+    _amortizedPhases = 0;
+}
+
+// Bilinear when the sizes differ.
+void LiveMaterial_GL::copyToDestination(const RenderTarget_GL* output, GLuint destination, const GLint* destinationSize) {
+#if SUPPORT_OPENGL_CORE
+    const bool sameSize = output->desc.width == destinationSize[0] && output->desc.height == destinationSize[1];
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, output->framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, destination);
+    glBlitFramebuffer(0, 0, output->desc.width, output->desc.height,
+        0, 0, destinationSize[0], destinationSize[1],
+        GL_COLOR_BUFFER_BIT, sameSize ? GL_NEAREST : GL_LINEAR);
+#endif
+}
+
+void LiveMaterial_GL::SetRenderTexture(void* nativeTexturePtr) {
+    lock_guard<InstrumentedMutex> guard(texturesMutex);
+    _renderTextureSource = nativeTexturePtr;
+    _pendingRenderTexture = nativeTexturePtr;
+    _renderTexturePending = true;
+    touchInputs();
+}
+
+bool LiveMaterial_GL::resolveRenderTexture() {
+    {
+        lock_guard<InstrumentedMutex> guard(texturesMutex);
+        if (_renderTexturePending) {
+            _renderTexturePending = false;
+            _renderTexture = (GLuint)(size_t)_pendingRenderTexture;
+            _framebuffer = 0;
+        }
+    }
+    if (!_renderTexture)
+        return false;
+
+    if (!_framebuffer) {
+        clearOpenGLErrors();
+        GLint previousTexture = 0, format = 0;
+        glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTexture);
+        glBindTexture(GL_TEXTURE_2D, _renderTexture);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_INTERNAL_FORMAT, &format);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &_renderTextureSize[0]);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &_renderTextureSize[1]);
+        glBindTexture(GL_TEXTURE_2D, previousTexture);
+        if (checkOpenGLError()) {
+            DebugError("not a 2D render texture: " << _renderTexture);
+            _renderTexture = 0;
+            return false;
+        }
+        _framebuffer = ((RenderAPI_OpenGLCoreES*)_renderAPI)->FramebufferFor(_renderTexture, format);
+        if (!_framebuffer) {
+            _renderTexture = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LiveMaterial_GL::DrawInstanced(int uniformIndex, const unsigned char* instanceData, int instanceCount, size_t stride) {
+    updateGLValidation(_renderAPI->validateGraphics());
+    GLPhaseScope scope("DrawInstanced", id());
+#if SUPPORT_OPENGL_CORE
+    // Texture buffers and instanced draws need a core context.
+    if (!((RenderAPI_OpenGLCoreES*)_renderAPI)->IsOpenGLCore())
+        return false;
+
+    deleteReleasedGLObjects();
+    syncWithParent();
+    compileNewShaders();
+    if (_program == 0 || _computeShader || _instanceDataLoc < 0)
+        return false;
+
     glUseProgram(_program);
+    _drawInstanceStride = stride;
     updateUniforms(uniformIndex);
+    _drawInstanceStride = 0;
+
+    if (!_instanceBuffer) {
+        glGenBuffers(1, &_instanceBuffer);
+        glGenTextures(1, &_instanceTexture);
+    }
+
+    glBindBuffer(GL_TEXTURE_BUFFER, _instanceBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, stride * instanceCount, instanceData, GL_STREAM_DRAW);
+
+    // The instance buffer takes the first texture unit after the shader's samplers.
+    GLint textureUnit = (GLint)textureIDs.size();
+    glActiveTexture(GL_TEXTURE0 + textureUnit);
+    glBindTexture(GL_TEXTURE_BUFFER, _instanceTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, _instanceBuffer);
+    glUniform1i(_instanceDataLoc, textureUnit);
     printOpenGLError();
 
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    uploadPendingMesh();
+    drawGeometry(instanceCount);
     printOpenGLError();
+
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool LiveMaterial_GL::Dispatch(int uniformIndex) {
+    updateGLValidation(_renderAPI->validateGraphics());
+    GLPhaseScope scope("Dispatch", id());
+#if SUPPORT_OPENGL_CORE && defined(GL_COMPUTE_SHADER)
+    if (!((RenderAPI_OpenGLCoreES*)_renderAPI)->SupportsCompute())
+        return false;
+
+    deleteReleasedGLObjects();
+    syncWithParent();
+    compileNewShaders();
+    if (_program == 0 || !_computeShader)
+        return false;
+
+    GLuint groups[3];
+    {
+        lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+        for (int i = 0; i < 3; ++i)
+            groups[i] = (GLuint)_dispatchGroups[uniformIndex][i];
+    }
+    if (!groups[0] || !groups[1] || !groups[2])
+        return false;
+
+    glUseProgram(_program);
+    updateUniforms(uniformIndex);
+    bindComputeResources();
+    glDispatchCompute(groups[0], groups[1], groups[2]);
+
+    // Whatever Unity does with the results next (vertex fetch, sampling,
+    // indirect args or another dispatch) has to see these writes.
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+        GL_TEXTURE_FETCH_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+    printOpenGLError();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void LiveMaterial_GL::bindComputeResources() {
+#if SUPPORT_OPENGL_CORE && defined(GL_COMPUTE_SHADER)
+    auto layout = currentLayout();
+    if (!layout)
+        return;
+
+    lock_guard<InstrumentedMutex> guard(texturesMutex);
+    for (auto i = layout->storageBlockSlots.begin(); i != layout->storageBlockSlots.end(); ++i) {
+        auto buffer = computeBuffers.find(i->first);
+        GLuint name = buffer == computeBuffers.end() ? 0 : (GLuint)(size_t)buffer->second;
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, (GLuint)i->second, name);
+    }
+
+    for (auto i = layout->imageSlots.begin(); i != layout->imageSlots.end(); ++i) {
+        const GLuint unit = (GLuint)i->second;
+        auto image = computeImages.find(i->first);
+        if (image == computeImages.end()) {
+            glBindImageTexture(unit, 0, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+            continue;
+        }
+        // Images have to be bound with their texture's own format, which the
+        // registry looked up the first time it saw the texture.
+        TextureInfo info;
+        const GLenum format = _renderAPI->GetTextureInfo(image->second, &info) ? (GLenum)info.format : GL_RGBA32F;
+        glBindImageTexture(unit, (GLuint)(size_t)image->second, 0, GL_TRUE, 0, GL_READ_WRITE, format);
+        glUniform1i(layout->imageUniformIndexes[unit], (GLint)unit);
+    }
+    printOpenGLError();
+#endif
+}
+
+// Attribute names used by the GLSL our shaders are translated to, and the
+// locations LinkProgram binds them to for mesh drawing.
+enum MeshAttribute {
+    kMeshAttribPosition = 0,
+    kMeshAttribNormal = 1,
+    kMeshAttribTexCoord = 2
+};
+
+static const struct { MeshAttribute location; const char* name; } kMeshAttribNames[] = {
+    { kMeshAttribPosition, "xlat_attrib_POSITION" },
+    { kMeshAttribPosition, "in_POSITION0" },
+    { kMeshAttribNormal, "xlat_attrib_NORMAL" },
+    { kMeshAttribNormal, "in_NORMAL0" },
+    { kMeshAttribTexCoord, "xlat_attrib_TEXCOORD0" },
+    { kMeshAttribTexCoord, "in_TEXCOORD0" },
+};
+
+void LiveMaterial_GL::uploadPendingMesh() {
+    GLPhaseScope scope("uploadPendingMesh", id());
+    MeshRef mesh;
+    if (!takePendingMesh(mesh))
+        return;
+
+    _mesh = mesh;
+    _gpuMesh = nullptr;
+    if (!mesh)
+        return;
+    if (mesh->gpu) {
+        // Another material with the same mesh already uploaded it.
+        _gpuMesh = (const GpuMesh_GL*)mesh->gpu.get();
+        return;
+    }
+
+    const MeshLayout& layout = mesh->layout;
+    if (layout.quantization != MeshQuantizeNone && !((RenderAPI_OpenGLCoreES*)_renderAPI)->SupportsQuantizedMeshes()) {
+        DebugWarning("quantized meshes need GL 3.3 or ES 3; not drawing this mesh");
+        return;
+    }
+
+    auto gpu = std::make_shared<GpuMesh_GL>();
+    size_t gpuBytes = mesh->vertices.size();
+    glGenBuffers(1, &gpu->vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, gpu->vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, mesh->vertices.size(), mesh->vertices.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    gpu->layout = layout;
+    gpu->vertexCount = (GLsizei)mesh->vertexCount;
+
+    // The element array binding belongs to the bound VAO, so the index
+    // buffer goes in with this mesh's own VAO bound, never Unity's.
+    // Without VAOs it's global state, and whatever was bound goes back.
+    GLint previousVertexArray = 0;
+    GLint previousIndexBuffer = 0;
+#if SUPPORT_OPENGL_CORE
+    // Core profiles can't draw without a VAO; record one per mesh so drawing
+    // doesn't disturb whatever Unity has bound. VAOs aren't shared between
+    // contexts, but everything here runs on Unity's one render context.
+    if (((RenderAPI_OpenGLCoreES*)_renderAPI)->IsOpenGLCore()) {
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+        glGenVertexArrays(1, &gpu->vertexArray);
+        glBindVertexArray(gpu->vertexArray);
+    }
+#endif
+    if (!gpu->vertexArray)
+        glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &previousIndexBuffer);
+
+    const vector<uint32_t>& indices = mesh->indices;
+    if (!indices.empty()) {
+        glGenBuffers(1, &gpu->indexBuffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu->indexBuffer);
+        if (gpu->vertexCount <= 0x10000) {
+            // Half the index bandwidth, and the only index type plain ES2 has.
+            vector<uint16_t> shortIndices(indices.begin(), indices.end());
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * sizeof(uint16_t), shortIndices.data(), GL_STATIC_DRAW);
+            gpu->indexType = GL_UNSIGNED_SHORT;
+            gpuBytes += shortIndices.size() * sizeof(uint16_t);
+        } else {
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(), GL_STATIC_DRAW);
+            gpu->indexType = GL_UNSIGNED_INT;
+            gpuBytes += indices.size() * sizeof(uint32_t);
+        }
+        gpu->indexCount = (GLsizei)indices.size();
+    }
+
+    if (gpu->vertexArray) {
+#if SUPPORT_OPENGL_CORE
+        gpu->bindAttributes();
+        glBindVertexArray(previousVertexArray);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+    } else {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, previousIndexBuffer);
+    }
+    printOpenGLError();
+
+    mesh->gpuBytes = gpuBytes;
+    mesh->gpu = gpu;
+    _gpuMesh = gpu.get();
+}
+
+void GpuMesh_GL::bindAttributes() const {
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    const GLsizei stride = layout.stride;
+    glEnableVertexAttribArray(kMeshAttribPosition);
+    glEnableVertexAttribArray(kMeshAttribNormal);
+    glEnableVertexAttribArray(kMeshAttribTexCoord);
+#if defined(GL_HALF_FLOAT) && defined(GL_UNSIGNED_INT_2_10_10_10_REV)
+    if (layout.halfPositions())
+        glVertexAttribPointer(kMeshAttribPosition, 4, GL_HALF_FLOAT, GL_FALSE, stride, (char*)NULL + layout.positionOffset);
+    else
+#endif
+        glVertexAttribPointer(kMeshAttribPosition, 3, GL_FLOAT, GL_FALSE, stride, (char*)NULL + layout.positionOffset);
+#if defined(GL_HALF_FLOAT) && defined(GL_UNSIGNED_INT_2_10_10_10_REV)
+    if (layout.octahedralNormals())
+        glVertexAttribPointer(kMeshAttribNormal, 2, GL_SHORT, GL_TRUE, stride, (char*)NULL + layout.normalOffset);
+    else if (layout.packedNormals())
+        glVertexAttribPointer(kMeshAttribNormal, 4, GL_UNSIGNED_INT_2_10_10_10_REV, GL_TRUE, stride, (char*)NULL + layout.normalOffset);
+    else
+#endif
+        glVertexAttribPointer(kMeshAttribNormal, 3, GL_FLOAT, GL_FALSE, stride, (char*)NULL + layout.normalOffset);
+#if defined(GL_HALF_FLOAT) && defined(GL_UNSIGNED_INT_2_10_10_10_REV)
+    if (layout.halfUVs())
+        glVertexAttribPointer(kMeshAttribTexCoord, 2, GL_HALF_FLOAT, GL_FALSE, stride, (char*)NULL + layout.uvOffset);
+    else
+#endif
+        glVertexAttribPointer(kMeshAttribTexCoord, 2, GL_FLOAT, GL_FALSE, stride, (char*)NULL + layout.uvOffset);
+}
+
+void LiveMaterial_GL::drawGeometry(int instanceCount) {
+    GLPhaseScope scope("drawGeometry", id());
+    const GpuMesh_GL* mesh = _gpuMesh;
+    if (!mesh) {
+#if SUPPORT_OPENGL_CORE
+        if (instanceCount > 1) {
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, instanceCount);
+            return;
+        }
+#endif
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        return;
+    }
+
+    GLint previousVertexArray = 0;
+    GLint previousIndexBuffer = 0;
+    if (mesh->vertexArray) {
+#if SUPPORT_OPENGL_CORE
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previousVertexArray);
+        glBindVertexArray(mesh->vertexArray);
+#endif
+    } else {
+        glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &previousIndexBuffer);
+        mesh->bindAttributes();
+    }
+
+#if SUPPORT_OPENGL_CORE
+    if (instanceCount > 1) {
+        if (mesh->indexBuffer)
+            glDrawElementsInstanced(GL_TRIANGLES, mesh->indexCount, mesh->indexType, nullptr, instanceCount);
+        else
+            glDrawArraysInstanced(GL_TRIANGLES, 0, mesh->vertexCount, instanceCount);
+    } else
+#endif
+    if (mesh->indexBuffer)
+        glDrawElements(GL_TRIANGLES, mesh->indexCount, mesh->indexType, nullptr);
+    else
+        glDrawArrays(GL_TRIANGLES, 0, mesh->vertexCount);
+
+    if (mesh->vertexArray) {
+#if SUPPORT_OPENGL_CORE
+        glBindVertexArray(previousVertexArray);
+#endif
+    } else {
+        glDisableVertexAttribArray(kMeshAttribPosition);
+        glDisableVertexAttribArray(kMeshAttribNormal);
+        glDisableVertexAttribArray(kMeshAttribTexCoord);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, previousIndexBuffer);
+    }
 }
 
 void LiveMaterial_GL::_SetTexture(const char* name, void* nativeTexturePtr) {
-    if (_program == 0)
+    auto layout = currentLayout();
+    if (!layout)
         return;
 
-    lock_guard<mutex> guard(texturesMutex);
-    auto iter = textureUnits.find(name);
-    if (iter == textureUnits.end())
+    lock_guard<InstrumentedMutex> guard(texturesMutex);
+    auto iter = layout->textureSlots.find(name);
+    if (iter == layout->textureSlots.end() || iter->second >= textureIDs.size())
         return;
     
     auto textureID = (GLint)(size_t)nativeTexturePtr;
@@ -176,8 +1103,37 @@ void LiveMaterial_GL::_SetTexture(const char* name, void* nativeTexturePtr) {
     textureIDs[textureUnit] = textureID;           
 }
 
+void LiveMaterial_GL::_AdoptProgram(LiveMaterial* parentMaterial) {
+    auto parent = (LiveMaterial_GL*)parentMaterial;
+
+    retainGLObject(GLProgramObject, parent->_program);
+    retainGLObject(GLShaderObject, parent->_vertexShader);
+    retainGLObject(GLShaderObject, parent->_fragmentShader);
+    retainGLObject(GLShaderObject, parent->_computeShader);
+    releaseGLObject(GLProgramObject, _program);
+    releaseGLObject(GLShaderObject, _vertexShader);
+    releaseGLObject(GLShaderObject, _fragmentShader);
+    releaseGLObject(GLShaderObject, _computeShader);
+    _program = parent->_program;
+    _vertexShader = parent->_vertexShader;
+    _fragmentShader = parent->_fragmentShader;
+    _computeShader = parent->_computeShader;
+    _vertexSourceHash = parent->_vertexSourceHash;
+    _fragmentSourceHash = parent->_fragmentSourceHash;
+    _computeSourceHash = parent->_computeSourceHash;
+    _instanceDataLoc = parent->_instanceDataLoc;
+
+    {
+        lock_guard<InstrumentedMutex> parentGuard(parent->texturesMutex);
+        lock_guard<InstrumentedMutex> guard(texturesMutex);
+        textureIDs = parent->textureIDs;
+    }
+
+    LiveMaterial::_AdoptProgram(parent);
+}
+
 void LiveMaterial_GL::_QueueCompileTasks(vector<CompileTask> tasks) {
-    lock_guard<mutex> guard(compileTaskMutex);
+    lock_guard<InstrumentedMutex> guard(compileTaskMutex);
     for (size_t i = 0; i < tasks.size(); ++i)
         compileTasks.push_back(tasks[i]);
 }
@@ -188,24 +1144,31 @@ void LiveMaterial_GL::LinkProgram() {
     //glBindAttribLocation(program, ATTRIB_POSITION, "xlat_attrib_POSITION");
     //glBindAttribLocation(program, ATTRIB_COLOR, "xlat_attrib_COLOR");
     //glBindAttribLocation(program, ATTRIB_UV, "xlat_attrib_TEXCOORD0");
-    glAttachShader(program, _vertexShader);
-    glAttachShader(program, _fragmentShader);
+    if (_computeShader) {
+        glAttachShader(program, _computeShader);
+    } else {
+        glAttachShader(program, _vertexShader);
+        glAttachShader(program, _fragmentShader);
+        for (size_t i = 0; i < sizeof(kMeshAttribNames) / sizeof(kMeshAttribNames[0]); ++i)
+            glBindAttribLocation(program, kMeshAttribNames[i].location, kMeshAttribNames[i].name);
 #if SUPPORT_OPENGL_CORE
-    if (((RenderAPI_OpenGLCoreES*)_renderAPI)->IsOpenGLCore())
-        glBindFragDataLocationEXT(program, 0, "fragColor");
+        if (((RenderAPI_OpenGLCoreES*)_renderAPI)->IsOpenGLCore())
+            glBindFragDataLocationEXT(program, 0, "fragColor");
 #endif
+    }
     glLinkProgram(program);
     
     GLint status = 0;
     glGetProgramiv(program, GL_LINK_STATUS, &status);
     
     if (status == GL_TRUE) {
-        if (_program)
-            glDeleteProgram(_program);
+        releaseGLObject(GLProgramObject, _program);
+        retainGLObject(GLProgramObject, program);
         _program = program;
+        ++_programGeneration;
         //stats.compileState = CompileState::Success;
     } else {
-        Debug("failure linking program:");
+        DebugError("failure linking program:");
         //stats.compileState = CompileState::Error;
         
         GLint infoLen = 0;
@@ -213,7 +1176,7 @@ void LiveMaterial_GL::LinkProgram() {
         if (infoLen > 0) {
             char* infoLog = (char*)malloc (sizeof(char) * infoLen);
             glGetProgramInfoLog(program, infoLen, nullptr, infoLog);
-            Debug(infoLog);
+            DebugError(infoLog);
             free(infoLog);
         }
     }
@@ -223,7 +1186,7 @@ GLuint loadShader(GLenum type, const char *shaderSrc, const char* debugOutPath)
 {
     GLuint shader = glCreateShader(type);
     if (shader == 0) {
-        Debug("could not create shader object");
+        DebugError("could not create shader object");
         return 0;
     }
     
@@ -244,14 +1207,14 @@ GLuint loadShader(GLenum type, const char *shaderSrc, const char* debugOutPath)
     if (!compiled) {
         GLint infoLen = 0;
         glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infoLen);
-        Debug("error compiling glsl shader:");
+        DebugError("error compiling glsl shader:");
         //if (type == GL_FRAGMENT_SHADER)
             //stats.compileState = CompileState::Error;
         if (infoLen > 1) {
             char* infoLog = (char*)malloc (sizeof(char) * infoLen);
             if (infoLog) {
                 glGetShaderInfoLog(shader, infoLen, NULL, infoLog);
-                Debug(infoLog);
+                DebugError(infoLog);
                 free(infoLog);
             }
         }
@@ -265,10 +1228,11 @@ GLuint loadShader(GLenum type, const char *shaderSrc, const char* debugOutPath)
 
 
 void LiveMaterial_GL::compileNewShaders() {
+    GLPhaseScope scope("compileNewShaders", id());
     bool needsUpdate = false;
     vector<CompileTask> tasks;
     {
-        lock_guard<mutex> guard(compileTaskMutex);
+        lock_guard<InstrumentedMutex> guard(compileTaskMutex);
         tasks = compileTasks;
         compileTasks.clear();
     }
@@ -279,31 +1243,57 @@ void LiveMaterial_GL::compileNewShaders() {
         auto compileTask = tasks[i];
         GLenum glType;
         GLuint* storedProgram;
+        size_t* storedHash;
         switch (compileTask.shaderType) {
             case Fragment:
                 glType = GL_FRAGMENT_SHADER;
                 storedProgram = &_fragmentShader;
+                storedHash = &_fragmentSourceHash;
                 break;
             case Vertex:
                 glType = GL_VERTEX_SHADER;
                 storedProgram = &_vertexShader;
+                storedHash = &_vertexSourceHash;
+                break;
+#ifdef GL_COMPUTE_SHADER
+            case Compute:
+                if (!((RenderAPI_OpenGLCoreES*)_renderAPI)->SupportsCompute()) {
+                    DebugError("compute shaders need an OpenGL 4.3 core context");
+                    error = true;
+                    continue;
+                }
+                glType = GL_COMPUTE_SHADER;
+                storedProgram = &_computeShader;
+                storedHash = &_computeSourceHash;
                 break;
+#endif
             default:
                 assert(false);
                 continue;
         }
         GLuint newShader = loadShader(glType, compileTask.src.c_str(), nullptr);
         if (newShader) {
-            if (*storedProgram)
-                glDeleteShader(*storedProgram);
+            releaseGLObject(GLShaderObject, *storedProgram);
+            retainGLObject(GLShaderObject, newShader);
             *storedProgram = newShader;
+            *storedHash = std::hash<string>()(compileTask.src);
             needsUpdate = true;
+
+            // A material is either compute or graphics, whichever source it was given last.
+            if (compileTask.shaderType == Compute) {
+                releaseGLObject(GLShaderObject, _vertexShader);
+                releaseGLObject(GLShaderObject, _fragmentShader);
+                _vertexShader = _fragmentShader = 0;
+            } else {
+                releaseGLObject(GLShaderObject, _computeShader);
+                _computeShader = 0;
+            }
         } else {
             error = true;
         }
     }
 
-    if (needsUpdate) {
+    if (needsUpdate && (_computeShader || (_vertexShader && _fragmentShader))) {
         LinkProgram();
         if (_program) {
             _discoverUniforms(_program);
@@ -316,24 +1306,27 @@ void LiveMaterial_GL::compileNewShaders() {
 }
 
 void LiveMaterial_GL::_discoverUniforms(GLuint program) {
-    lock_guard<mutex> uniformsGuard(uniformsMutex);
-    lock_guard<mutex> texturesGuard(texturesMutex);
+    GLPhaseScope scope("reflection", id());
+    lock_guard<InstrumentedMutex> uniformsGuard(uniformsMutex);
+    lock_guard<InstrumentedMutex> texturesGuard(texturesMutex);
+    lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+        clearOpenGLErrors();
+        // A program without plain uniforms, such as a compute shader that
+        // only reads and writes storage blocks, still gets a layout.
         int maxNameLength = 0;
         glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
-        if (maxNameLength == 0) {
-            Debug("max name length was 0");
-            return;
-        }
         
         char* name = new char[maxNameLength + 1];
         
         int numUniforms = 0;
         glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &numUniforms);
         int offset = 0;
-        if (!printOpenGLError()) {
+        auto layout = new UniformLayout();
+        layout->programHash = _computeShader ? _computeSourceHash : _vertexSourceHash ^ (_fragmentSourceHash << 1);
+        if (!checkOpenGLError()) {
             int textureUnit = 0;
-            textureUnits.clear();
-            uniformLocs.clear();
+            int imageUnit = 0;
+            _instanceDataLoc = -1;
             
             for (int i = 0; i < numUniforms; i++) {
                 int nameLength = 0;
@@ -358,69 +1351,149 @@ void LiveMaterial_GL::_discoverUniforms(GLuint program) {
                 
                 switch (type) {
                     case GL_FLOAT:
-                        size = 1 * sizeof(float) * arraysize;
+                        size = 1 * sizeof(float);
                         propType = Float;
                         break;
                     case GL_FLOAT_VEC2:
-                        size = 2 * sizeof(float) * arraysize;
+                        size = 2 * sizeof(float);
                         propType = Vector2;
                         break;
                     case GL_FLOAT_VEC3:
-                        size = 3 * sizeof(float) * arraysize;
+                        size = 3 * sizeof(float);
                         propType = Vector3;
                         break;
                     case GL_FLOAT_VEC4:
-                        size = 4 * sizeof(float) * arraysize;
+                        size = 4 * sizeof(float);
                         propType = Vector4;
                         break;
                     case GL_FLOAT_MAT4:
-                        size = 16 * sizeof(float) * arraysize;
+                        size = 16 * sizeof(float);
                         propType = Matrix;
                         break;
                     case GL_SAMPLER_2D: {
                         // assign texture units in the order we see them here
-                        textureUnits[name] = textureUnit++;
-                        uniformLocs.push_back(glGetUniformLocation(program, name));
+                        layout->textureSlots[name] = textureUnit++;
+                        layout->textureUniformIndexes.push_back(glGetUniformLocation(program, name));
                         continue; // don't make a prop
                     }
+#if SUPPORT_OPENGL_CORE
+                    case GL_SAMPLER_BUFFER: {
+                        if (strcmp(name, "_LiveInstanceData") == 0)
+                            _instanceDataLoc = glGetUniformLocation(program, name);
+                        continue;
+                    }
+#endif
+#ifdef GL_IMAGE_2D
+                    case GL_IMAGE_2D:
+                    case GL_IMAGE_3D:
+                    case GL_IMAGE_2D_ARRAY:
+                    case GL_INT_IMAGE_2D:
+                    case GL_INT_IMAGE_3D:
+                    case GL_UNSIGNED_INT_IMAGE_2D:
+                    case GL_UNSIGNED_INT_IMAGE_3D: {
+                        // Image units are assigned like texture units; see bindComputeResources.
+                        layout->imageSlots[name] = imageUnit++;
+                        layout->imageUniformIndexes.push_back(glGetUniformLocation(program, name));
+                        continue;
+                    }
+#endif
                     default:
                         const char* typeName = nullptr; //getGLTypeName(type);
                         if (typeName == nullptr) typeName = "unknown";
-                        DebugSS("unknown gl type " << typeName);
+                        DebugWarning("unknown gl type " << typeName);
                         assert(false);
                         continue;
                 }
                 
                 //DebugSS("uniform " << name << " with size " << size << " at offset " << offset);
-                auto prop = propForName(name, propType);
+                auto prop = layout->props[name];
+                if (!prop)
+                    prop = layout->props[name] = new ShaderProp(propType, name);
                 prop->arraySize = arraysize;
                 prop->size = size;
                 prop->offset = offset;
                 prop->uniformIndex = glGetUniformLocation(program, name);
                 
                 printOpenGLError();
-                offset += size;
+                offset += size * arraysize;
             }
             
-            textureIDs.clear();
-            for (int i = 0; i < textureUnit; ++i)
-                textureIDs.push_back(0);
+            layout->textureSlotCount = textureUnit;
+            textureIDs.assign(textureUnit, 0);
+
+#ifdef GL_SHADER_STORAGE_BLOCK
+            // Storage blocks get bindings in declaration order, overriding
+            // any binding = N in the source so names are all callers need.
+            if (((RenderAPI_OpenGLCoreES*)_renderAPI)->SupportsCompute()) {
+                GLint numBlocks = 0;
+                glGetProgramInterfaceiv(program, GL_SHADER_STORAGE_BLOCK, GL_ACTIVE_RESOURCES, &numBlocks);
+                for (GLint block = 0; block < numBlocks; ++block) {
+                    char blockName[256];
+                    glGetProgramResourceName(program, GL_SHADER_STORAGE_BLOCK, block, sizeof(blockName), nullptr, blockName);
+                    glShaderStorageBlockBinding(program, block, block);
+                    layout->storageBlockSlots[blockName] = block;
+                }
+                printOpenGLError();
+            }
+#endif
         }
         
         delete [] name;
-        ensureConstantBufferSize(offset);
+        layout->constantBufferSize = offset;
+
+        // Materials linked from the same source end up pointing at one layout.
+        setLayout(_renderAPI->InternLayout(layout));
     
 
 }
 
-void LiveMaterial_GL::updateUniforms(int uniformIndex) {
+GLuint LiveMaterial_GL::samplerObjectFor(size_t textureUnit) {
+    auto i = _unitSamplers.find(textureUnit);
+    if (i == _unitSamplers.end() || textureIDs[textureUnit] < 1)
+        return 0;
+    SamplerDesc desc = i->second;
+    desc.mipmapped = _textureInfos[textureUnit].mipCount > 1;
+    return (GLuint)(size_t)_renderAPI->GetSampler(desc);
+}
 
+void LiveMaterial_GL::updateUniforms(int uniformIndex) {
+    GLPhaseScope scope("updateUniforms", id());
     // Bind textures
-    {
-        lock_guard<mutex> guard(texturesMutex);
-        for (size_t textureUnit = 0; textureUnit < textureIDs.size(); ++textureUnit) {
-            auto uniformLoc = uniformLocs[textureUnit];
+    auto layout = currentLayout();
+    if (layout) {
+        lock_guard<InstrumentedMutex> guard(texturesMutex);
+        _textureInfos.resize(textureIDs.size());
+        _textureInfoIDs.resize(textureIDs.size(), -1);
+        const uint64_t textureGeneration = _renderAPI->textureGeneration();
+        if (_textureInfoGeneration != textureGeneration) {
+            _textureInfoIDs.assign(_textureInfoIDs.size(), -1); // GL may have reused a name
+            _textureInfoGeneration = textureGeneration;
+        }
+        const bool bindSamplers = ((RenderAPI_OpenGLCoreES*)_renderAPI)->SupportsSamplers();
+        if (bindSamplers && (_samplersLayout != layout || _samplersBuiltVersion != samplersVersion())) {
+            _unitSamplers.clear();
+            for (auto i = layout->textureSlots.begin(); i != layout->textureSlots.end(); ++i) {
+                SamplerDesc desc;
+                if (samplerSetFor(i->first, &desc))
+                    _unitSamplers[i->second] = desc;
+            }
+            _samplerObjects.assign(textureIDs.size(), 0);
+            _textureInfoIDs.assign(_textureInfoIDs.size(), -1); // so every unit looks its sampler up again
+            _samplersLayout = layout;
+            _samplersBuiltVersion = samplersVersion();
+        }
+        _samplerObjects.resize(textureIDs.size(), 0);
+        for (size_t textureUnit = 0; textureUnit < textureIDs.size() && textureUnit < layout->textureUniformIndexes.size(); ++textureUnit) {
+            auto uniformLoc = layout->textureUniformIndexes[textureUnit];
             auto textureID = textureIDs[textureUnit];
+            if (_textureInfoIDs[textureUnit] != textureID) {
+                _textureInfos[textureUnit] = TextureInfo();
+                // A texture that can't be described yet is asked about again next draw.
+                const bool described = textureID < 1 || _renderAPI->GetTextureInfo((void*)(size_t)textureID, &_textureInfos[textureUnit]);
+                _textureInfoIDs[textureUnit] = described ? textureID : -1;
+                if (bindSamplers)
+                    _samplerObjects[textureUnit] = samplerObjectFor(textureUnit);
+            }
             if (textureID < 1)
                 continue;
 
@@ -428,22 +1501,25 @@ void LiveMaterial_GL::updateUniforms(int uniformIndex) {
             glActiveTexture(activeTexture);
             printOpenGLError();
             glBindTexture(GL_TEXTURE_2D, textureID);
-            if (printOpenGLError()) { DebugSS("Error binding texture with id " << textureID); }
+            if (printOpenGLError()) { DebugError("Error binding texture with id " << textureID); }
+#if SUPPORT_OPENGL_CORE
+            if (bindSamplers)
+                glBindSampler((GLuint)textureUnit, _samplerObjects[textureUnit]); // 0 clears another material's
+#endif
             glUniform1i(uniformLoc, (GLint)textureUnit);
             printOpenGLError();
-
-            int w = 0, h = 0;
-            int miplevel = 0;
-            glGetTexLevelParameteriv(GL_TEXTURE_2D, miplevel, GL_TEXTURE_WIDTH, &w);
-            glGetTexLevelParameteriv(GL_TEXTURE_2D, miplevel, GL_TEXTURE_HEIGHT, &h);
-            printOpenGLError();
         }
     }
 
-    // Set uniforms
+    // Set uniforms from the block SubmitUniforms copied for this draw
     {
-        lock_guard<mutex> guard(uniformsMutex);
-        for (auto i = shaderProps.begin(); i != shaderProps.end(); i++) {
+        lock_guard<InstrumentedMutex> uniformsGuard(uniformsMutex);
+        lock_guard<InstrumentedMutex> gpuGuard(gpuMutex);
+        auto block = _layout ? drawBlock(uniformIndex, _textureInfos) : nullptr;
+        if (!block)
+            return;
+
+        for (auto i = _layout->props.begin(); i != _layout->props.end(); i++) {
             auto prop = i->second;
             
             if (prop->uniformIndex == ShaderProp::UNIFORM_UNSET || prop->uniformIndex == prop->UNIFORM_INVALID) {
@@ -451,7 +1527,7 @@ void LiveMaterial_GL::updateUniforms(int uniformIndex) {
                 continue;
             }
 
-            auto data = (float*)(_constantBuffer + prop->offset);
+            auto data = (const float*)(block + prop->offset);
 
             switch (prop->type) {
             case Float:
@@ -480,7 +1556,7 @@ void LiveMaterial_GL::updateUniforms(int uniformIndex) {
             //if (errorStr.size()) Debug(errorStr.c_str());
                     
             if (printOpenGLError())
-                DebugSS("error setting uniform " << prop->name << " with type " << prop->typeString() << " and uniform index " << prop->uniformIndex);
+                DebugError("error setting uniform " << prop->name << " with type " << prop->typeString() << " and uniform index " << prop->uniformIndex);
         }
     }
 }
@@ -617,6 +1693,99 @@ RenderAPI_OpenGLCoreES::RenderAPI_OpenGLCoreES(UnityGfxRenderer apiType)
 }
 
 
+static void describeBoundTexture(GLenum target, TextureInfo* info) {
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_WIDTH, &info->width);
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_HEIGHT, &info->height);
+    glGetTexLevelParameteriv(target, 0, GL_TEXTURE_INTERNAL_FORMAT, &info->format);
+
+    // Immutable textures know their level count; otherwise count the levels
+    // that have an image.
+    GLint levels = 0;
+#ifdef GL_TEXTURE_IMMUTABLE_LEVELS
+    GLint immutable = GL_FALSE;
+    glGetTexParameteriv(target, GL_TEXTURE_IMMUTABLE_FORMAT, &immutable);
+    if (immutable)
+        glGetTexParameteriv(target, GL_TEXTURE_IMMUTABLE_LEVELS, &levels);
+#endif
+    if (!levels && info->width > 0) {
+        GLint width = info->width;
+        while (width > 0 && levels < 32) {
+            ++levels;
+            width = 0;
+            glGetTexLevelParameteriv(target, levels, GL_TEXTURE_WIDTH, &width);
+        }
+    }
+    info->mipCount = levels;
+}
+
+bool RenderAPI_OpenGLCoreES::_describeTexture(void* nativeTexture, TextureInfo* info) {
+    // A texture only binds to the target it was created with, and there's
+    // no other way to ask GL which that was. Compute images can be 3D or
+    // arrays; other textures that fit none of these go undescribed.
+    static const GLenum targets[][2] = {
+        { GL_TEXTURE_2D, GL_TEXTURE_BINDING_2D },
+#if SUPPORT_OPENGL_CORE
+        { GL_TEXTURE_3D, GL_TEXTURE_BINDING_3D },
+        { GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BINDING_2D_ARRAY },
+#endif
+    };
+    clearOpenGLErrors(); // so the checks after binding see only the bind's error
+
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); ++i) {
+        GLint previous = 0;
+        glGetIntegerv(targets[i][1], &previous);
+        glErrorContext.probing = true;
+        glBindTexture(targets[i][0], (GLuint)(size_t)nativeTexture);
+        const bool bound = glGetError() == GL_NO_ERROR;
+        glErrorContext.probing = false;
+        if (!bound)
+            continue;
+
+        describeBoundTexture(targets[i][0], info);
+        glBindTexture(targets[i][0], previous);
+        return !checkOpenGLError() && info->width > 0;
+    }
+    return false;
+}
+
+void* RenderAPI_OpenGLCoreES::_newSampler(const SamplerDesc& desc) {
+#if SUPPORT_OPENGL_CORE
+    if (!SupportsSamplers())
+        return nullptr;
+    static const GLint minFilters[SamplerFilterCount][2] = { // without mips, with
+        { GL_NEAREST, GL_NEAREST_MIPMAP_NEAREST },
+        { GL_LINEAR, GL_LINEAR_MIPMAP_NEAREST },
+        { GL_LINEAR, GL_LINEAR_MIPMAP_LINEAR },
+    };
+    static const GLint wraps[SamplerWrapCount] = { GL_REPEAT, GL_CLAMP_TO_EDGE, GL_MIRRORED_REPEAT };
+
+    clearOpenGLErrors();
+    GLuint sampler = 0;
+    glGenSamplers(1, &sampler);
+    glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, minFilters[desc.filter][desc.mipmapped ? 1 : 0]);
+    glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, desc.filter == SamplerPoint ? GL_NEAREST : GL_LINEAR);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, wraps[desc.wrap]);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, wraps[desc.wrap]);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_R, wraps[desc.wrap]);
+    if (desc.anisotropy > 1 && GLEW_EXT_texture_filter_anisotropic)
+        glSamplerParameterf(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT, (GLfloat)desc.anisotropy);
+    if (checkOpenGLError()) {
+        glDeleteSamplers(1, &sampler);
+        return nullptr;
+    }
+    return (void*)(size_t)sampler;
+#else
+    return nullptr;
+#endif
+}
+
+void RenderAPI_OpenGLCoreES::_deleteSampler(void* sampler) {
+#if SUPPORT_OPENGL_CORE
+    GLuint name = (GLuint)(size_t)sampler;
+    glDeleteSamplers(1, &name);
+#endif
+}
+
 void RenderAPI_OpenGLCoreES::ProcessDeviceEvent(UnityGfxDeviceEventType type, IUnityInterfaces* interfaces)
 {
 	if (type == kUnityGfxDeviceEventInitialize)
@@ -626,6 +1795,11 @@ void RenderAPI_OpenGLCoreES::ProcessDeviceEvent(UnityGfxDeviceEventType type, IU
 	else if (type == kUnityGfxDeviceEventShutdown)
 	{
 		//@TODO: release resources
+		DeleteFramebuffers();
+		DestroyRenderTargets();
+		DestroySamplers();
+		deleteReleasedGLObjects();
+		updateGLValidation(false); // hands Unity's context back its own debug output
 	}
 }
 
@@ -707,5 +1881,138 @@ void RenderAPI_OpenGLCoreES::EndModifyTexture(void* textureHandle, int textureWi
 
 LiveMaterial* RenderAPI_OpenGLCoreES::_newLiveMaterial(int id) { return new LiveMaterial_GL(this, id); }
 
+GLuint RenderAPI_OpenGLCoreES::FramebufferFor(GLuint texture, GLint format)
+{
+	auto key = std::make_pair(texture, format);
+	GLint previousFramebuffer = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+
+	auto iter = m_Framebuffers.find(key);
+	if (iter != m_Framebuffers.end()) {
+		// Attach again: if Unity deleted the texture and its name was reused,
+		// the framebuffer would still point at the old storage.
+		glBindFramebuffer(GL_FRAMEBUFFER, iter->second);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+		return iter->second;
+	}
+
+	// Drop framebuffers whose textures no longer exist.
+	for (auto i = m_Framebuffers.begin(); i != m_Framebuffers.end();) {
+		if (!glIsTexture(i->first.first)) {
+			glDeleteFramebuffers(1, &i->second);
+			i = m_Framebuffers.erase(i);
+		} else {
+			++i;
+		}
+	}
+
+	GLuint framebuffer = 0;
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+	const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		DebugError("render texture " << texture << " can't be rendered to (framebuffer status " << status << ")");
+		glDeleteFramebuffers(1, &framebuffer);
+		return 0;
+	}
+
+	m_Framebuffers[key] = framebuffer;
+	return framebuffer;
+}
+
+void RenderAPI_OpenGLCoreES::DeleteFramebuffers()
+{
+	for (auto i = m_Framebuffers.begin(); i != m_Framebuffers.end(); ++i)
+		glDeleteFramebuffers(1, &i->second);
+	m_Framebuffers.clear();
+}
+
+static bool glFormatFor(RenderTargetFormat format, GLint* internalFormat, GLenum* pixelFormat, GLenum* type)
+{
+	// The ES2 headers we build against only have unsized RGBA.
+	switch (format) {
+#if SUPPORT_OPENGL_CORE
+	case RenderTargetRGBA8: *internalFormat = GL_RGBA8; *pixelFormat = GL_RGBA; *type = GL_UNSIGNED_BYTE; return true;
+	case RenderTargetRGBA16F: *internalFormat = GL_RGBA16F; *pixelFormat = GL_RGBA; *type = GL_HALF_FLOAT; return true;
+	case RenderTargetRGBA32F: *internalFormat = GL_RGBA32F; *pixelFormat = GL_RGBA; *type = GL_FLOAT; return true;
+	case RenderTargetR16F: *internalFormat = GL_R16F; *pixelFormat = GL_RED; *type = GL_HALF_FLOAT; return true;
+	case RenderTargetR32F: *internalFormat = GL_R32F; *pixelFormat = GL_RED; *type = GL_FLOAT; return true;
+#else
+	case RenderTargetRGBA8: *internalFormat = GL_RGBA; *pixelFormat = GL_RGBA; *type = GL_UNSIGNED_BYTE; return true;
+#endif
+	default: return false;
+	}
+}
+
+RenderTarget* RenderAPI_OpenGLCoreES::_newRenderTarget(const RenderTargetDesc& desc)
+{
+	GLint internalFormat = 0;
+	GLenum pixelFormat = 0, type = 0;
+	if (!glFormatFor(desc.format, &internalFormat, &pixelFormat, &type)) {
+		DebugError("render target format " << desc.format << " isn't supported by this context");
+		return nullptr;
+	}
+
+	clearOpenGLErrors();
+	RenderTarget_GL* target = new RenderTarget_GL();
+	GLint previousTexture = 0, previousFramebuffer = 0;
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+	glGenTextures(1, &target->texture);
+
+	if (desc.samples > 1) {
+#if SUPPORT_OPENGL_CORE
+		if (IsOpenGLCore()) {
+			target->textureTarget = GL_TEXTURE_2D_MULTISAMPLE;
+			glGetIntegerv(GL_TEXTURE_BINDING_2D_MULTISAMPLE, &previousTexture);
+			glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, target->texture);
+			glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, desc.samples, internalFormat, desc.width, desc.height, GL_TRUE);
+		}
+#endif
+		if (target->textureTarget != GL_TEXTURE_2D_MULTISAMPLE) {
+			DebugError("multisampled render targets need a core context");
+			delete target;
+			return nullptr;
+		}
+	} else {
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTexture);
+		glBindTexture(GL_TEXTURE_2D, target->texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, desc.width, desc.height, 0, pixelFormat, type, nullptr);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(target->textureTarget, previousTexture);
+
+	glGenFramebuffers(1, &target->framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, target->framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, target->textureTarget, target->texture, 0);
+	const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status == GL_FRAMEBUFFER_COMPLETE) {
+		// New storage is undefined; start from transparent black.
+		GLfloat previousClearColor[4];
+		glGetFloatv(GL_COLOR_CLEAR_VALUE, previousClearColor);
+		const GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+		glDisable(GL_SCISSOR_TEST);
+		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+		glClear(GL_COLOR_BUFFER_BIT);
+		glClearColor(previousClearColor[0], previousClearColor[1], previousClearColor[2], previousClearColor[3]);
+		if (scissor)
+			glEnable(GL_SCISSOR_TEST);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+
+	if (checkOpenGLError() || status != GL_FRAMEBUFFER_COMPLETE) {
+		DebugError("couldn't create a " << desc.width << "x" << desc.height << " render target (framebuffer status " << status << ")");
+		delete target;
+		return nullptr;
+	}
+	return target;
+}
+
 
 #endif // #if SUPPORT_OPENGL_UNIFIED
@@ -2,16 +2,13 @@
 
 #include "PlatformBase.h"
 #include "RenderAPI.h"
+#include "Profiler.h"
 
 #include <assert.h>
 #include <math.h>
 #include <map>
 
 
-mutex debugLogMutex;
-static DebugLogFuncPtr s_debugLogFunc = nullptr;
-DebugLogFuncPtr GetDebugFunc() { return s_debugLogFunc; }
-
 static string s_shaderIncludePath;
 string GetShaderIncludePath() { return s_shaderIncludePath; }
 
@@ -56,10 +53,13 @@ extern "C" void	UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UnityPluginLoad(IUnit
 
 
 extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API SetCallbackFunctions(DebugLogFuncPtr debugLogFunc) {
-	{
-		lock_guard<mutex> guard(debugLogMutex);
-		s_debugLogFunc = debugLogFunc;
-	}
+	setLogCallback(debugLogFunc);
+}
+
+// Hands messages logged since the last call to the debug log callback. Call
+// it from the thread that may call into managed code, once a frame.
+extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API FlushLog() {
+	drainLog();
 }
 
 extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UnityPluginUnload()
@@ -67,10 +67,7 @@ extern "C" void UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API UnityPluginUnload()
 	s_Graphics->UnregisterDeviceEventCallback(OnGraphicsDeviceEvent);
 
 	// clear the debug log function
-	{
-		lock_guard<mutex> guard(debugLogMutex);
-		s_debugLogFunc = nullptr;
-	}
+	setLogCallback(nullptr);
 }
 
 
@@ -88,7 +85,7 @@ static void UNITY_INTERFACE_API OnGraphicsDeviceEvent(UnityGfxDeviceEventType ev
 	if (eventType == kUnityGfxDeviceEventInitialize) {
 		assert(s_CurrentAPI == NULL);
 		{
-			lock_guard<mutex> guard(renderAPIMutex);
+			lock_guard<InstrumentedMutex> guard(renderAPIMutex);
 			s_DeviceType = s_Graphics->GetRenderer();
 			s_CurrentAPI = CreateRenderAPI(s_DeviceType);
 			s_CurrentAPI->Initialize();
@@ -103,7 +100,7 @@ static void UNITY_INTERFACE_API OnGraphicsDeviceEvent(UnityGfxDeviceEventType ev
 	// Cleanup graphics API implementation upon shutdown
 	if (eventType == kUnityGfxDeviceEventShutdown) {
 		{
-			lock_guard<mutex> guard(renderAPIMutex);
+			lock_guard<InstrumentedMutex> guard(renderAPIMutex);
 			auto api = s_CurrentAPI;
 			s_CurrentAPI = nullptr;
 			delete api;
@@ -131,19 +128,55 @@ extern "C" {
 		return liveMaterial ? liveMaterial->id() : -1;
 	}
 
+	NativePtr UNITY_FUNC CloneLiveMaterial(int id) {
+		assert(s_CurrentAPI);
+		return s_CurrentAPI->CloneLiveMaterial(id);
+	}
+
+	int UNITY_FUNC CloneLiveMaterialId(int id) {
+		auto liveMaterial = CloneLiveMaterial(id);
+		return liveMaterial ? liveMaterial->id() : -1;
+	}
+
 	NativePtr UNITY_FUNC GetLiveMaterialPtr(int id) { return s_CurrentAPI ? s_CurrentAPI->GetLiveMaterialById(id) : nullptr; }
 	void UNITY_FUNC DestroyLiveMaterial(int id) { if (s_CurrentAPI) s_CurrentAPI->DestroyLiveMaterial(id); }
     Stats UNITY_FUNC GetStats(LiveMaterial* liveMaterial) { return liveMaterial->GetStats(); }
 	void UNITY_FUNC SetDrawingEnabled(LiveMaterial* liveMaterial, bool enabled) { return liveMaterial->SetDrawingEnabled(enabled);  }
+	void UNITY_FUNC SetInstancingEnabled(LiveMaterial* liveMaterial, bool enabled) { liveMaterial->SetInstancingEnabled(enabled); }
 	void UNITY_FUNC SetStats(LiveMaterial* liveMaterial, Stats stats) { return liveMaterial->SetStats(stats); }
 	bool UNITY_FUNC HasProperty(LiveMaterial* liveMaterial, const char* name) { return liveMaterial->HasProperty(name); }
 	bool UNITY_FUNC NeedsRender(LiveMaterial* liveMaterial) { return liveMaterial->NeedsRender(); }
 	void UNITY_FUNC SetDepthWritesEnabled(LiveMaterial* liveMaterial, bool enabled) { liveMaterial->SetDepthWritesEnabled(enabled); }
 	void UNITY_FUNC SetShaderSource(LiveMaterial* liveMaterial, const char* fragSrc, const char* fragEntry, const char* vertSrc, const char* vertEntry) { liveMaterial->SetShaderSource(fragSrc, fragEntry, vertSrc, vertEntry); }
+	void UNITY_FUNC SetComputeSource(LiveMaterial* liveMaterial, const char* source, const char* entryPoint) { liveMaterial->SetComputeSource(source, entryPoint); }
+	void UNITY_FUNC SetComputeBuffer(LiveMaterial* liveMaterial, const char* name, void* nativeBufferPtr) { liveMaterial->SetComputeBuffer(name, nativeBufferPtr); }
+	void UNITY_FUNC SetComputeImage(LiveMaterial* liveMaterial, const char* name, void* nativeTexturePtr) { liveMaterial->SetComputeImage(name, nativeTexturePtr); }
+	void UNITY_FUNC SubmitDispatch(LiveMaterial* liveMaterial, int uniformsIndex, int groupsX, int groupsY, int groupsZ) { liveMaterial->SubmitDispatch(uniformsIndex, groupsX, groupsY, groupsZ); }
 	void UNITY_FUNC SubmitUniforms(LiveMaterial* liveMaterial, int uniformsIndex) { liveMaterial->SubmitUniforms(uniformsIndex); }
 	bool UNITY_FUNC SetTextureID(LiveMaterial* liveMaterial, const char* name, int id) { return liveMaterial->SetTextureID(name, id); }
 	void UNITY_FUNC SetTexturePtr(LiveMaterial* liveMaterial, const char* name, int id, void* nativeTexturePointer) { return liveMaterial->SetTexturePtr(name, id, nativeTexturePointer); }
+	void UNITY_FUNC InvalidateTexture(int id) {
+		if (s_CurrentAPI)
+			s_CurrentAPI->InvalidateTexture(id);
+	}
 	void UNITY_FUNC SetRenderTexture(LiveMaterial* liveMaterial, void* nativeTexturePointer) { return liveMaterial->SetRenderTexture(nativeTexturePointer); }
+	void UNITY_FUNC SetSampler(LiveMaterial* liveMaterial, const char* name, int filter, int wrap, int anisotropy) {
+		liveMaterial->SetSampler(name, SamplerDesc(filter, wrap, anisotropy));
+	}
+	void UNITY_FUNC SetFeedback(LiveMaterial* liveMaterial, const char* samplerName, int width, int height, int format) {
+		liveMaterial->SetFeedback(samplerName, width, height, format);
+	}
+	void UNITY_FUNC SetStaticUntilChanged(LiveMaterial* liveMaterial, bool enabled) { liveMaterial->SetStaticUntilChanged(enabled); }
+	void UNITY_FUNC InvalidateDraw(LiveMaterial* liveMaterial) { liveMaterial->InvalidateDraw(); }
+	void UNITY_FUNC SetResolutionScale(LiveMaterial* liveMaterial, float scale) { liveMaterial->SetResolutionScale(scale); }
+	void UNITY_FUNC SetResolutionBudget(LiveMaterial* liveMaterial, float gpuMilliseconds, float minScale) { liveMaterial->SetResolutionBudget(gpuMilliseconds, minScale); }
+	void UNITY_FUNC SetTemporalAmortization(LiveMaterial* liveMaterial, int phases) { liveMaterial->SetTemporalAmortization(phases); }
+	void UNITY_FUNC SetGraphOutput(LiveMaterial* liveMaterial, const char* name, int width, int height, int format) {
+		liveMaterial->SetGraphOutput(name, width, height, format);
+	}
+	void UNITY_FUNC SetGraphInput(LiveMaterial* liveMaterial, const char* samplerName, const char* outputName) {
+		liveMaterial->SetGraphInput(samplerName, outputName);
+	}
 	void UNITY_FUNC SetFloat(LiveMaterial* liveMaterial, const char* name, float value) { liveMaterial->SetFloat(name, value); }
 	void UNITY_FUNC SetVector4(LiveMaterial* liveMaterial, const char* name, float* value) { liveMaterial->SetVector4(name, value); }
 	void UNITY_FUNC SetMatrix(LiveMaterial* liveMaterial, const char* name, float* value) { liveMaterial->SetMatrix(name, value); }
@@ -153,6 +186,8 @@ extern "C" {
 	void UNITY_FUNC GetVector4(LiveMaterial* liveMaterial, const char* name, float* value) { liveMaterial->GetVector4(name, value); }
 	void UNITY_FUNC GetMatrix(LiveMaterial* liveMaterial, const char* name, float* value) { liveMaterial->GetMatrix(name, value); }
 	void UNITY_FUNC SetMesh(LiveMaterial* liveMaterial, int vertexCount, float* vertices, float* normals, float* uvs) { liveMaterial->SetMesh(vertexCount, vertices, normals, uvs); }
+	void UNITY_FUNC SetMeshIndexed(LiveMaterial* liveMaterial, int vertexCount, float* vertices, float* normals, float* uvs, int indexCount, int* indices) { liveMaterial->SetMeshIndexed(vertexCount, vertices, normals, uvs, indexCount, indices); }
+	void UNITY_FUNC SetMeshInterleaved(LiveMaterial* liveMaterial, const void* vertices, int vertexCount, VertexFormat* format, int indexCount, int* indices) { liveMaterial->SetMeshInterleaved(vertices, vertexCount, *format, indexCount, indices); }
 	float UNITY_FUNC GetFloat(LiveMaterial* liveMaterial, const char* name) {
 		float value = 0;
 		liveMaterial->GetFloat(name, &value);
@@ -163,6 +198,27 @@ extern "C" {
 		if (s_CurrentAPI)
 			s_CurrentAPI->GetDebugInfo(numCompileTasks, numLiveMaterials);
 	}
+	void UNITY_FUNC GetLayoutInfo(int* numLayouts, int* numLayoutUsers) {
+		if (s_CurrentAPI)
+			s_CurrentAPI->GetLayoutInfo(numLayouts, numLayoutUsers);
+	}
+	void UNITY_FUNC GetMeshInfo(int* numMeshes, int64_t* cpuBytes, int64_t* gpuBytes) {
+		if (s_CurrentAPI)
+			s_CurrentAPI->GetMeshInfo(numMeshes, cpuBytes, gpuBytes);
+	}
+	void UNITY_FUNC GetRenderTargetInfo(int* numTargets, int64_t* residentBytes, int64_t* peakResidentBytes, int64_t* framePeakBytes) {
+		if (s_CurrentAPI)
+			s_CurrentAPI->GetRenderTargetInfo(numTargets, residentBytes, peakResidentBytes, framePeakBytes);
+	}
+	void UNITY_FUNC GetGraphInfo(int* numPasses, int* numCulled) {
+		if (s_CurrentAPI)
+			s_CurrentAPI->GetGraphInfo(numPasses, numCulled);
+	}
+	void UNITY_FUNC SetProfilerEnabled(bool enabled) { setProfilerEnabled(enabled); }
+	bool UNITY_FUNC WriteProfileTrace(const char* filename) { return writeProfileTrace(filename); }
+	void UNITY_FUNC SetLockStatsEnabled(bool enabled) { setLockStatsEnabled(enabled); }
+	void UNITY_FUNC ResetLockStats() { resetLockStats(); }
+	bool UNITY_FUNC GetLockStats(int index, LockStats* stats) { return getLockStats(index, stats); }
 	void UNITY_FUNC SetFlags(int flags) {
 		if (s_CurrentAPI)
 			s_CurrentAPI->SetFlags(flags);
@@ -175,11 +231,12 @@ extern "C" {
 		if (s_CurrentAPI)
 			s_CurrentAPI->ClearCompileCache();
 	}
+	void UNITY_FUNC SetNullCompileLatency(int microseconds) { setNullCompileLatency(microseconds); }
 
 	bool UNITY_FUNC CanDraw(LiveMaterial* liveMaterial) { return liveMaterial->CanDraw(); }
 }
 
-mutex renderAPIMutex;
+InstrumentedMutex renderAPIMutex("renderAPIMutex");
 RenderAPI* GetCurrentRenderAPI() { return s_CurrentAPI; }
 
 static void UNITY_INTERFACE_API OnRenderEvent(int packedValue) {
@@ -192,20 +249,96 @@ static void UNITY_INTERFACE_API OnRenderEvent(int packedValue) {
 	//DebugSS("OnRenderEvent(id=" << id << ", uniformIndex=" << uniformIndex << ")");
 
 	//DrawColoredTriangle(uniformIndex);
-	lock_guard<mutex> guard(s_CurrentAPI->materialsMutex);
+	lock_guard<InstrumentedMutex> guard(s_CurrentAPI->materialsMutex);
 	auto liveMaterial = s_CurrentAPI->GetLiveMaterialByIdLocked(id);
 	if (liveMaterial) {
 		liveMaterial->Draw(uniformIndex);
 	}
 	else {
-		DebugSS("not drawing: id: " << id << ", uniformIndex: " << uniformIndex);
+		DebugWarning("not drawing: id: " << id << ", uniformIndex: " << uniformIndex);
 	}
 	//ModifyTexturePixels();
 }
 
 
+// Same packing as OnRenderEvent; draws every instancing-enabled material sharing
+// the given material's program, mesh, textures and samplers with a single
+// instanced draw call. Each group is drawn once per frame, counted by the frame
+// end event, so every member's uniforms must be submitted before any member
+// issues this; LiveMaterial.cs submits them all first.
+static void UNITY_INTERFACE_API OnInstancedRenderEvent(int packedValue) {
+	if (s_CurrentAPI == nullptr)
+		return;
+
+	int16_t uniformIndex = packedValue & 0xffff;
+	int16_t id = (packedValue >> 16) & 0xffff;
+
+	lock_guard<InstrumentedMutex> guard(s_CurrentAPI->materialsMutex);
+	s_CurrentAPI->DrawInstanced(id, uniformIndex);
+}
+
+
+// Same packing as OnRenderEvent; dispatches a compute material with the
+// uniforms and group counts SubmitDispatch stored in the slot.
+static void UNITY_INTERFACE_API OnComputeEvent(int packedValue) {
+	if (s_CurrentAPI == nullptr)
+		return;
+
+	int16_t uniformIndex = packedValue & 0xffff;
+	int16_t id = (packedValue >> 16) & 0xffff;
+
+	lock_guard<InstrumentedMutex> guard(s_CurrentAPI->materialsMutex);
+	auto liveMaterial = s_CurrentAPI->GetLiveMaterialByIdLocked(id);
+	if (!liveMaterial || !liveMaterial->Dispatch(uniformIndex))
+		DebugWarning("not dispatching: id: " << id << ", uniformIndex: " << uniformIndex);
+}
+
+
+// Draws the whole render graph; the value is the uniforms slot every
+// material in it draws with.
+static void UNITY_INTERFACE_API OnGraphEvent(int uniformIndex) {
+	if (s_CurrentAPI == nullptr)
+		return;
+
+	lock_guard<InstrumentedMutex> guard(s_CurrentAPI->materialsMutex);
+	s_CurrentAPI->ExecuteGraph(uniformIndex);
+}
+
+
+// Issue once per frame, between one frame's last draw and the next frame's
+// first: recycles the transient render targets and trims ones that have gone
+// unused. LiveMaterial.cs issues it before the first draw of each frame.
+static void UNITY_INTERFACE_API OnFrameEndEvent(int) {
+	if (s_CurrentAPI == nullptr)
+		return;
+
+	lock_guard<InstrumentedMutex> guard(s_CurrentAPI->materialsMutex);
+	s_CurrentAPI->EndFrame();
+}
+
+
 extern "C" UnityRenderingEvent UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API GetRenderEventFunc()
 {
 	return OnRenderEvent;
 }
 
+extern "C" UnityRenderingEvent UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API GetInstancedRenderEventFunc()
+{
+	return OnInstancedRenderEvent;
+}
+
+extern "C" UnityRenderingEvent UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API GetComputeEventFunc()
+{
+	return OnComputeEvent;
+}
+
+extern "C" UnityRenderingEvent UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API GetGraphEventFunc()
+{
+	return OnGraphEvent;
+}
+
+extern "C" UnityRenderingEvent UNITY_INTERFACE_EXPORT UNITY_INTERFACE_API GetFrameEndEventFunc()
+{
+	return OnFrameEndEvent;
+}
+
@@ -2,6 +2,7 @@ using UnityEngine;
 using UnityEngine.Assertions;
 using System;
 using System.Collections;
+using System.Collections.Generic;
 using System.Runtime.InteropServices;
 #if UNITY_EDITOR
 using UnityEditor;
@@ -11,14 +12,17 @@ using Random = UnityEngine.Random;
 
 public class LiveMaterial : MonoBehaviour
 {
-    [UnmanagedFunctionPointer(CallingConvention.StdCall)] delegate void DebugLogFunc(string str);
+    [UnmanagedFunctionPointer(CallingConvention.StdCall)] delegate void DebugLogFunc(int level, string str);
 
     struct Native {
         const string PluginName = "RenderingPlugin";
         [DllImport(PluginName)] internal static extern void SetTimeFromUnity(float t);
         [DllImport(PluginName)] internal static extern void SetTextureFromUnity(IntPtr texture, int w, int h);
         [DllImport(PluginName)] internal static extern IntPtr GetRenderEventFunc();
+        [DllImport(PluginName)] internal static extern IntPtr GetFrameEndEventFunc();
+        [DllImport(PluginName)] internal static extern IntPtr GetInstancedRenderEventFunc();
         [DllImport(PluginName)] internal static extern void SetCallbackFunctions(IntPtr debugLogFunc);
+        [DllImport(PluginName)] internal static extern void FlushLog();
 
         [DllImport(PluginName)] internal static extern IntPtr CreateLiveMaterial();
         [DllImport(PluginName)] internal static extern int GetLiveMaterialId(IntPtr nativePtr);
@@ -26,6 +30,8 @@ public class LiveMaterial : MonoBehaviour
         [DllImport(PluginName)] internal static extern void SetShaderSource(IntPtr nativePtr, string fragSrc, string fragEntry, string vertSrc, string vertEntry);
         [DllImport(PluginName)] internal static extern bool SetTextureID(IntPtr nativePtr, string name, int id);
         [DllImport(PluginName)] internal static extern void SetTexturePtr(IntPtr nativePtr, string name, int id, IntPtr texture);
+        [DllImport(PluginName)] internal static extern void InvalidateTexture(int id);
+        [DllImport(PluginName)] internal static extern void SetSampler(IntPtr nativePtr, string name, int filter, int wrap, int anisotropy);
         [DllImport(PluginName)] internal static extern void SetVector4(IntPtr nativePtr, string name, float[] value);
         [DllImport(PluginName)] internal static extern void SetFloatArray(IntPtr nativePtr, string name, float[] value, int numFloats);
         [DllImport(PluginName)] internal static extern void SetMatrix(IntPtr nativePtr, string name, float[] value);
@@ -35,10 +41,22 @@ public class LiveMaterial : MonoBehaviour
         [DllImport(PluginName)] internal static extern void GetMatrix(IntPtr nativePtr, string name, float[] value);
         [DllImport(PluginName)] internal static extern bool HasProperty(IntPtr nativePtr, string name);
         [DllImport(PluginName)] internal static extern void SubmitUniforms(IntPtr nativePtr, int uniformsIndex);
+        [DllImport(PluginName)] internal static extern void SetInstancingEnabled(IntPtr nativePtr, bool enabled);
         [DllImport(PluginName)] internal static extern void PrintUniforms(IntPtr nativePtr);
     }
 
-    private static void DebugWrapper(string log) { Debug.Log(log); }
+    // The plugin's LogLevel, from Log.h.
+    const int LOG_WARNING = 2;
+    const int LOG_ERROR = 3;
+
+    private static void DebugWrapper(int level, string log) {
+        if (level >= LOG_ERROR)
+            Debug.LogError(log);
+        else if (level == LOG_WARNING)
+            Debug.LogWarning(log);
+        else
+            Debug.Log(log);
+    }
     static readonly DebugLogFunc debugLogFunc = new DebugLogFunc(DebugWrapper);
 
     const int ID_UNSET = -1;
@@ -134,10 +152,40 @@ public class LiveMaterial : MonoBehaviour
             Native.SetTexturePtr(NativePtr, name, instanceID, texture.GetNativeTexturePtr());
     }
 
+    // Overrides how the texture set for name is sampled; the plugin shares
+    // one sampler object per distinct setting.
+    public void SetSampler(string name, FilterMode filter, TextureWrapMode wrap, int anisoLevel = 1) {
+        Native.SetSampler(NativePtr, name, (int)filter, (int)wrap, anisoLevel);
+    }
+
+    // Native texture pointers are cached by instance ID for every material;
+    // call this after destroying or recreating a texture's native resource
+    // (e.g. RenderTexture.Release) so the next SetTexture asks again.
+    public static void InvalidateTexture(Texture texture) {
+        if (texture != null)
+            Native.InvalidateTexture(texture.GetInstanceID());
+    }
+
     public void PrintUniforms() { Native.PrintUniforms(NativePtr); }
 
     public void SubmitUniforms(int uniformsIndex) { Native.SubmitUniforms(NativePtr, uniformsIndex); }
 
+    // Materials with instancing enabled and the same shader source, mesh,
+    // textures and samplers are drawn together, with one instanced draw call
+    // a frame. EndOfFrameOnce draws them rather than their own coroutines.
+    bool _instancingEnabled = false;
+    static readonly List<LiveMaterial> _instanced = new List<LiveMaterial>();
+    public bool InstancingEnabled {
+        get { return _instancingEnabled; }
+        set {
+            _instancingEnabled = value;
+            Native.SetInstancingEnabled(NativePtr, value);
+            _instanced.Remove(this);
+            if (value)
+                _instanced.Add(this);
+        }
+    }
+
 #if UNITY_EDITOR
     static bool didInit = false;
 #endif
@@ -165,6 +213,7 @@ public class LiveMaterial : MonoBehaviour
 	}
 
     void OnDestroy() {
+        _instanced.Remove(this);
         if (_nativePtr != IntPtr.Zero) {
             Native.DestroyLiveMaterial(_nativePtr);
             _nativeId = ID_DESTROYED;
@@ -194,14 +243,41 @@ public class LiveMaterial : MonoBehaviour
 
     bool Alive { get { return _nativePtr != IntPtr.Zero && _nativePtr != DELETED_PTR;  } }
 
+    // Every material's coroutine calls this at the end of the frame; the
+    // first to get there does the plugin's once-a-frame work for all of them.
+    // Its frame end event reaches the render thread ahead of this frame's
+    // draws, so it ends the previous frame: transient render targets are
+    // recycled and ones gone unused are trimmed. Then it draws the instanced
+    // materials: all of them submit before any issues its event, since the
+    // first event of a group draws every member with what it has submitted.
+    static int _lastFrameEnd = -1;
+    static void EndOfFrameOnce() {
+        if (_lastFrameEnd == Time.frameCount)
+            return;
+        _lastFrameEnd = Time.frameCount;
+        Native.SetTimeFromUnity(Time.timeSinceLevelLoad);
+        Native.FlushLog();
+        GL.IssuePluginEvent(Native.GetFrameEndEventFunc(), 0);
+
+        const int uniformIndex = 0;
+        foreach (var material in _instanced) {
+            if (material.Alive && material.gameObject.activeInHierarchy)
+                material.SubmitUniforms(uniformIndex);
+        }
+        foreach (var material in _instanced) {
+            if (material.Alive && material.gameObject.activeInHierarchy)
+                GL.IssuePluginEvent(Native.GetInstancedRenderEventFunc(), material.GetPluginEventId(uniformIndex));
+        }
+    }
+
 	private IEnumerator CallPluginAtEndOfFrames() {
 		while (true) {
 			yield return new WaitForEndOfFrame();
-			Native.SetTimeFromUnity (Time.timeSinceLevelLoad);
-            if (Alive) {
+            EndOfFrameOnce();
+            if (Alive && !_instancingEnabled) {
                 int uniformIndex = 0;
                 SubmitUniforms(uniformIndex);
-                GL.IssuePluginEvent(Native.GetRenderEventFunc(), GetPluginEventId(uniformIndex));
+                GL.IssuePluginEvent(Native.GetRenderEventFunc(), GetPluginEventId(uniformIndex));
             }
 		}
 	}